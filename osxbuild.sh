@@ -8,9 +8,14 @@ fi
 
 cd ./release
 
-gcc ../src/art2png.c -I/opt/local/include -L/opt/local/lib -lfreeimage -arch x86_64 -arch i386 -o ./art2png
-gcc ../src/png2art.c -I/opt/local/include -L/opt/local/lib -lfreeimage -arch x86_64 -arch i386 -o ./png2art
+gcc ../src/art2png.c ../src/artkernels.c -I/opt/local/include -L/opt/local/lib -lfreeimage -lpthread -arch x86_64 -arch i386 -o ./art2png
+gcc ../src/png2art.c ../src/artkernels.c -I/opt/local/include -L/opt/local/lib -lfreeimage -lpthread -arch x86_64 -arch i386 -o ./png2art
 gcc ../src/palgen.c -I/opt/local/include -L/opt/local/lib -arch x86_64 -arch i386 -o ./palgen
+gcc ../src/artremap.c ../src/artkernels.c -arch x86_64 -arch i386 -o ./artremap
+gcc ../src/artedit.c -arch x86_64 -arch i386 -o ./artedit
+gcc ../src/artdiff.c -arch x86_64 -arch i386 -o ./artdiff
+gcc ../src/artlint.c -arch x86_64 -arch i386 -o ./artlint
+gcc ../src/artstats.c -lpthread -arch x86_64 -arch i386 -o ./artstats
 
 
 echo "Copying to MacPorts directory"
@@ -27,6 +32,31 @@ if [ -f /opt/local/bin/palgen ] ; then
 	rm /opt/local/bin/palgen
 fi
 
+if [ -f /opt/local/bin/artremap ] ; then
+	rm /opt/local/bin/artremap
+fi
+
+if [ -f /opt/local/bin/artedit ] ; then
+	rm /opt/local/bin/artedit
+fi
+
+if [ -f /opt/local/bin/artdiff ] ; then
+	rm /opt/local/bin/artdiff
+fi
+
+if [ -f /opt/local/bin/artlint ] ; then
+	rm /opt/local/bin/artlint
+fi
+
+if [ -f /opt/local/bin/artstats ] ; then
+	rm /opt/local/bin/artstats
+fi
+
 cp -f art2png /opt/local/bin
 cp -f png2art /opt/local/bin
 cp -f palgen /opt/local/bin
+cp -f artremap /opt/local/bin
+cp -f artedit /opt/local/bin
+cp -f artdiff /opt/local/bin
+cp -f artlint /opt/local/bin
+cp -f artstats /opt/local/bin
@@ -16,9 +16,15 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <FreeImage.h>
 
@@ -26,45 +32,213 @@
 // Types and Constants
 //
 
-typedef		signed char		int8_t;
-typedef		signed short	int16_t;
-typedef		signed int		int32_t;
-typedef	  unsigned char		uint8_t;
-typedef	  unsigned short	uint16_t;
-typedef	  unsigned int		uint32_t;
+// Tile table. Each header field gets its own array so a scan over one
+// field (sizes, animdata) only touches the memory it needs.
+typedef struct {
+	uint32_t capacity;
+	uint16_t* sizex;
+	uint16_t* sizey;
+	uint32_t* animdata;
+	uint32_t* offset;
+} tiletable_t;
 
+// A unique tile seen by the duplicate finder
 typedef struct {
+	uint64_t hash;
+	uint32_t tilenum;		// first tile with these pixels, its PNG is shared
+	uint32_t picsize;
 	uint16_t sizex;
 	uint16_t sizey;
-	uint32_t animdata;
+	uint32_t dupcount;
+	uint32_t artnum;		// ART file and offset of its pixels, a match is compared against them
 	uint32_t offset;
-} tile_t;
+} uniquetile_t;
+
+// A tile whose PNG is shared with uniquetiles[unique]
+typedef struct {
+	uint32_t unique;
+	uint32_t tilenum;
+} duptile_t;
+
+// Growable text buffer, files are built in memory and written at once
+typedef struct {
+	char* data;
+	size_t length;
+	size_t capacity;
+} textbuf_t;
+
+// What a pipeline job carries
+typedef enum {
+	JOB_PNG,				// pixels to encode into a PNG
+	JOB_LINK,				// pixels that repeat the PNG of linkname
+	JOB_FILE,				// finished file contents (ini)
+	JOB_SHEET,				// tiles to lay out into a contact sheet, then a JOB_PNG
+	JOB_ANIM,				// tiles of an animation to put into one APNG
+	JOB_STOP				// tells the writer there is nothing left
+} jobkind_e;
+
+// One file on its way from the ART file to the output folder or tar
+typedef struct {
+	jobkind_e kind;
+	uint32_t seq;			// order the jobs were read in, the writer keeps it
+	uint16_t sizex;
+	uint16_t sizey;
+	uint8_t* data;			// pixels from the pool, or the file contents for JOB_FILE
+	uint32_t size;
+	uint32_t reserved;		// bytes counted against --max-memory
+	FIMEMORY* png;			// encoded PNG, filled in by an encoder
+	uint8_t* raw;			// or the encoded raw tile with --raw
+	uint32_t rawsize;
+	char name[32];
+	char linkname[32];
+	struct sheettile_s* sheet;	// the tiles of a contact sheet or animation, their pixels follow each other in data
+	uint32_t sheetcount;
+	uint32_t animdata;		// of the tile the animation belongs to
+} tilejob_t;
+
+// A tile on a contact sheet or in an animation
+typedef struct sheettile_s {
+	uint32_t tilenum;
+	uint16_t sizex;
+	uint16_t sizey;
+	int8_t xoffset;			// center offsets, the frames of an animation are lined up by them
+	int8_t yoffset;
+} sheettile_t;
+
+// Bounded lock-free queue of jobs, any number of producers and consumers.
+// Each cell's sequence number says whether it is ready to be written or read.
+typedef struct {
+	uint32_t sequence;
+	tilejob_t* job;
+} queuecell_t;
+
+typedef struct {
+	queuecell_t* cells;
+	uint32_t mask;
+	uint8_t pad0[64];		// keep both ends on their own cache line
+	uint32_t enqueuepos;
+	uint8_t pad1[64];
+	uint32_t dequeuepos;
+	uint8_t pad2[64];
+} jobqueue_t;
+
+// Free buffer of the pool, the link sits where the buffer's data goes
+typedef struct poolbuffer_s {
+	struct poolbuffer_s* next;
+} poolbuffer_t;
+
+// A palette every PNG is written in once more (--palettes), into a
+// subfolder of the same name
+typedef struct {
+	char name[16];
+	RGBQUAD colors[256];
+} exportpalette_t;
+
+// Encoded PNG kept by the tile server, the cache is a list in least
+// recently used order
+typedef struct cachedpng_s {
+	struct cachedpng_s* prev;	// towards the most recently used
+	struct cachedpng_s* next;
+	uint32_t tilenum;
+	uint32_t size;
+	uint8_t* data;				// follows the struct in the same allocation
+} cachedpng_t;
+
+// A tile of the set as the server sees it
+typedef struct {
+	const uint8_t* pixels;		// in the mapped ART file, NULL for an empty tile
+	uint16_t sizex;
+	uint16_t sizey;
+	uint32_t animdata;
+	cachedpng_t* png;			// its PNG in the cache, NULL if not cached
+} servetile_t;
+
+// How duplicate PNGs get their file
+typedef enum {
+	DEDUP_NONE,				// encode every tile
+	DEDUP_LINK,				// hardlink to the first PNG
+	DEDUP_REFLINK			// copy-on-write clone of the first PNG
+} dedupmode_e;
 
 #define		PATH_DELIMITER "/"
 
 #ifdef _WIN32		// If we're on Win32/Win64
 
 #include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#include <winsock2.h>
 #define GetCurrentDir _getcwd
 
+typedef SOCKET socket_t;
+#define CloseSocket closesocket
+
 #else				// If we're on *nix/Apple Mac OS X
 
+#include <signal.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #define GetCurrentDir getcwd
 
+typedef int socket_t;
+#define INVALID_SOCKET -1
+#define CloseSocket close
+
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>		// FICLONE
 #endif
 
 #ifndef __cplusplus
 typedef enum {false, true} bool;
 #endif
 
-#define MAX_NUMBER_OF_TILES 9216
+#include "artkernels.h"
 
 #define PALETTE_SIZE (256 * 3)
 
+#define TAR_BLOCK_SIZE 512
+
+#define POOL_MIN_SHIFT 8			// smallest buffer class, 256 bytes
+#define POOL_CLASSES 16				// up to 8 MB, bigger buffers skip the pool
+#define POOL_HEADER 16				// class number in front of every buffer
+
+// Raw tiles (--raw) start with a 16 byte header, all of it little-endian:
+// "BTIL", version 1, order, compression, 0, width (2), height (2), data size (4)
+#define RAW_HEADER_SIZE 16
+#define RAW_ORDER_COLUMNS 0			// column by column like the ART file
+#define RAW_ORDER_ROWS 1			// row by row from the top
+#define RAW_COMPRESSION_NONE 0
+#define RAW_COMPRESSION_RLE 1		// PackBits, see PackRLE()
+
+#define SHADE_SIZE 256				// one shade table of PALETTE.DAT or palswap of LOOKUP.DAT
+#define NUM_LOOKUP_PALETTES 4		// water, night, title and boss1 after the palswaps
+
+#define MAX_TILE_NUMBER 1048575		// far beyond any build game, header is garbage
+#define HTTP_REQUEST_SIZE 4096		// request line and headers, anything longer is cut off
+
+#define SHEET_COLUMNS 16			// thumbnails across a contact sheet
+#define SHEET_PADDING 2				// pixels around each thumbnail and its label
+#define LABEL_WIDTH 27				// seven digits of the 3x5 font, one pixel apart
+#define LABEL_HEIGHT 5
+
+#define ANIM_TICKS_PER_SECOND 120	// the engine's clock, a frame is shown for 1 << speed ticks
+#define MAX_ANIM_FRAMES 64			// tiles in an animation, the frame count has 6 bits
+
 #define VERSION "0.1.1"
 
 const char* animtypes[4] = {"none", "oscillation", "forward", "backward"};
+const char* lookuppalettes[NUM_LOOKUP_PALETTES] = {"water", "night", "title", "boss1"};
+
+// 3x5 digits for the contact sheet labels, in octal one digit per row from the top
+const uint16_t digitfont[10] = {
+	075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717
+};
 
 //
 // Global Variables
@@ -76,8 +250,9 @@ FILE* palfile = NULL;
 
 uint32_t numtiles = 0;
 uint32_t tilestartnum;
-uint32_t filenum = 0;
-tile_t TilesList[MAX_NUMBER_OF_TILES];
+uint32_t filenum = 0;				// number of the ART file being read
+const char* artdir = ".";			// and its folder
+tiletable_t Tiles;
 
 // Color palette
 uint8_t palette[PALETTE_SIZE];
@@ -85,16 +260,193 @@ uint8_t palette[PALETTE_SIZE];
 const char* artfilename;
 RGBQUAD rgbpal[256];
 
+// Duplicate finder, shared by all ART files of the set
+dedupmode_e dedupmode = DEDUP_NONE;
+bool finddups = false;
+uniquetile_t* uniquetiles = NULL;		// in the order they were found, duptiles index it
+uint32_t uniquecapacity = 0;
+uint32_t numunique = 0;
+uint32_t* uniqueslots = NULL;			// hash table of uniquetiles indices + 1, 0 marks a free slot
+uint32_t numslots = 0;
+duptile_t* duptiles = NULL;
+uint32_t numdups = 0;
+uint32_t dupcapacity = 0;
+
+// Set-wide animation manifest, replaces the adataXXX.ini files when asked for
+bool writemanifest = false;
+textbuf_t manifest = {NULL, 0, 0};
+uint32_t manifesttiles = 0;
+
+// Tar stream the PNGs and ini files go to instead of the output folder
+FILE* tarfile = NULL;
+const char* outputdir = ".";
+
+// Pipeline: the main thread reads the tiles, encoder threads turn them into
+// PNGs and the writer thread puts the files out in the order they were read
+uint32_t numencoders = 0;			// 0 does all of it on the main thread
+uint32_t queuedepth = 64;
+jobqueue_t encodequeue;
+jobqueue_t writequeue;
+pthread_t* encoders = NULL;
+pthread_t writer;
+tilejob_t** pending = NULL;			// jobs the writer got ahead of their turn
+tilejob_t stopencoder;				// pushed once per encoder to end it
+uint32_t jobsread = 0;
+uint32_t jobswritten = 0;			// only touched through __atomic builtins
+bool writefailed = false;
+
+// Tile buffers come from power of two size classes and go back to them, so
+// a run reuses a handful of buffers instead of calling malloc for each tile
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+poolbuffer_t* poolfree[POOL_CLASSES];
+uint64_t memorylimit = 0;			// --max-memory, 0 for no limit
+uint64_t memoryinflight = 0;		// only touched through __atomic builtins
+
+// Tiles can go out as raw palette indexes instead of PNGs, for tools that
+// only want the indexes and shouldn't pay for deflate and inflate
+bool writeraw = false;
+bool rawrle = false;
+bool rawrows = false;
+const char* tileext = "png";
+
+// Extra palettes: the PNG of a tile is encoded once and written again for
+// each of them with only the PLTE chunk swapped, the IDAT doesn't change
+exportpalette_t* exportpals = NULL;
+uint32_t numexportpals = 0;
+
+// Tile server (--serve): the ART files stay mapped, tiles are only encoded
+// when they are asked for and the PNGs are kept up to cachelimit bytes
+uint32_t serveport = 0;
+socket_t serversocket;
+servetile_t* servetiles = NULL;
+uint32_t numservetiles = 0;			// highest tile number + 1
+pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+cachedpng_t* cachehead = NULL;		// most recently used
+cachedpng_t* cachetail = NULL;
+uint64_t cachelimit = 64 << 20;		// --cache-size
+uint64_t cachebytes = 0;
+
+// Splitting a set across processes or machines: --plan cuts the tiles into
+// shards of about the same pixel count, each --shard run writes the PNGs of
+// one shard and --merge writes the animation data once they are all done
+uint32_t plancount = 0;				// --plan, 0 when not planning
+int32_t shardnum = -1;				// --shard, -1 when not a shard run
+bool mergeshards = false;
+uint32_t shardfirst = 0;			// tiles this run extracts
+uint32_t shardlast = 0xFFFFFFFF;
+uint32_t* planpixels = NULL;		// pixels of every tile of the set, for --plan
+uint32_t plancapacity = 0;
+uint32_t plantiles = 0;
+
+// Round trip check (--verify-roundtrip): each PNG is decoded again the way
+// png2art does it and each ini is parsed back, nothing gets written
+bool verifyroundtrip = false;
+uint32_t verifiedtiles = 0;			// only touched through __atomic builtins
+uint32_t mismatches = 0;				// tiles and animation data that differ
+
+// Contact sheets (--contact-sheet): the tiles are scaled down into a grid
+// with their numbers under them, one PNG per ART file or per sheettiles
+// tiles, laid out and encoded on the encoder threads
+bool contactsheet = false;
+uint32_t sheettiles = 0;				// --sheet-tiles, 0 for one sheet per ART file
+uint32_t thumbsize = 64;				// --thumb-size
+bool thumbbox = true;					// --thumb-filter box, or nearest
+uint8_t sheetpalette[PALETTE_SIZE];		// the palette as 8-bit RGB triplets
+uint8_t sheetbackground;				// palette indexes of the background and labels
+uint8_t sheetlabel;
+
+// Upscaling (--upscale): every tile is scaled up on the encoder threads
+// right before it is encoded, for hightile replacements. The edge filter
+// is Scale2x/Scale3x, 4x is Scale2x done twice
+uint32_t upscale = 1;					// --upscale, 1 when not scaling
+bool upscalenearest = false;			// --upscale-filter nearest, or scalex
+
+// Batch mode (--batch): the jobs of a job file run one after the other in
+// this process, on one pipeline
+uint32_t batchtiles = 0;				// tiles of the job that is running
+
+// Animations (--apng): every animated tile range also goes out as one APNG,
+// in the order and at the speed the engine plays it. The frames share the
+// palette and each one after the first only holds what changed
+bool writeapng = false;
+
 //
 // Function
 //
 
 // PROTOTYPES
+// Add a tile to the duplicate finder, returns the unique tile it repeats or NULL
+static uniquetile_t* AddUniqueTile(uint32_t ti, const uint8_t* ibuff);
+
+// printf() into a text buffer
+static bool AppendText(textbuf_t* tb, const char* format, ...);
+
+// Compare two duplicate tiles for the report order
+static int CompareDupTiles(const void* a, const void* b);
+
+// Compare pixels with those of a unique tile, read back from its ART file
+static bool SameTilePixels(const uniquetile_t* u, const uint8_t* pixels);
+
+// Lay out the thumbnails and labels of a sheet job and encode it, it is a JOB_PNG afterwards
+static bool ComposeSheet(tilejob_t* job);
+
+// Draw a tile number centered in width pixels
+static void DrawLabel(uint32_t number, uint8_t* canvas, uint32_t canvash, uint32_t left, uint32_t top, uint32_t width);
+
+// Draw a tile scaled down to fit thumbsize, centered in width pixels
+static bool DrawThumbnail(const uint8_t* pixels, uint32_t sizex, uint32_t sizey,
+	uint8_t* canvas, uint32_t canvash, uint32_t left, uint32_t top, uint32_t width);
+
+// Queue the contact sheets of the current ART file
+static bool MakeContactSheets(void);
+
+// Pick the contact sheet background and label colors out of the palette
+static void SetSheetColors(void);
+
+// Line up the frames of an animation job and encode them into an APNG
+static bool ComposeAnimation(tilejob_t* job);
+
+// Finish a PNG chunk whose data is already in place: length, type and crc
+static uint32_t EndPNGChunk(uint8_t* chunk, const char* type, uint32_t length);
+
+// Queue the animations of the current ART file
+static bool MakeAnimations(void);
+
 // Dump animation data into "adataXXX.ini"
-static bool DumpAnimationData(uint16_t an, char* od);
+static bool DumpAnimationData(uint16_t an);
+
+// Scale a center offset of tile ti by --upscale, clamped to what an ART file can hold
+static int32_t ScaleOffset(int8_t offset, uint32_t ti, const char* field);
+
+// Write the duplicate groups found in the set to a report file
+static bool DumpDuplicateReport(const char* reportname);
+
+// Add the animation data of the current ART file to the manifest
+static bool DumpManifestTiles(void);
+
+// Write the manifest of the whole set to a JSON file
+static bool WriteManifest(const char* manifestname);
+
+// Add the pixel counts of the current ART file to the shard plan
+static bool AddPlanTiles(void);
+
+// Cut the set into plancount shards and write the plan
+static bool WriteShardPlan(const char* planname);
+
+// Get the tile range of a shard and the number of shards from a plan
+static bool ReadShardPlan(const char* planname, uint32_t shard, uint32_t* first, uint32_t* last, uint32_t* count);
+
+// Encoder thread, turns JOB_PNG pixels into PNGs
+static void* EncoderThread(void* arg);
 
 // extract images from the ART file
-static bool ExtractImages(const char* od);
+static bool ExtractImages(void);
+
+// Extract the ART files 0 to artcount of dirin through the running pipeline
+static bool ExtractArtFiles(const char* dirin, uint32_t artcount);
+
+// Free a job and everything it carries
+static void FreeJob(tilejob_t* job);
 
 // Get a uint16_t from a little-endian ordered bufffer
 static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
@@ -102,322 +454,3787 @@ static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
 // Get a uint32_t from a little-endian ordered buffer
 static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
 
+// Get a uint32_t from a big-endian ordered buffer, as in PNG chunks
+static uint32_t GetBigEndianUInt32(const uint8_t* buffer);
+
+// Make room for count tiles in the tile table
+static bool GrowTileTable(tiletable_t* table, uint32_t count);
+
+// Hash the dimensions and pixels of a tile
+static uint64_t HashTile(uint16_t sizex, uint16_t sizey, const uint8_t* pixels, uint32_t len);
+
+// Set up an empty queue with room for at least depth jobs
+static bool InitJobQueue(jobqueue_t* q, uint32_t depth);
+
+// Parse a byte count with an optional K, M or G suffix
+static uint64_t ParseByteCount(const char* str);
+
+// Give dupname the contents of the PNG srcname without encoding it again
+static bool LinkPNG(const char* srcname, const char* dupname);
+
 // create the pictures list from the art header
 static bool GetPicturesList(void);
 
 // load the color palette from the palette.dat or palette.act file
 static bool LoadPalette(char *pfname);
 
+// Load the --palettes list from the shade tables of PALETTE.DAT and from LOOKUP.DAT
+static bool LoadExportPalettes(const char* pfname, const char* lookupname, const char* list);
+
+// Add a palette to the export list, map (if any) picks its colors out of the 6 bit colors
+static bool AddExportPalette(const char* name, const uint8_t* colors, const uint8_t* map);
+
+// Read a whole file into a new buffer
+static uint8_t* ReadWholeFile(const char* filename, uint32_t* size);
+
+// Find a chunk of an encoded PNG, returns its offset or 0
+static uint32_t FindPNGChunk(const uint8_t* data, uint32_t size, const char* type, uint32_t* length);
+
+// Write the PNG of a job once more for every extra palette
+static bool WritePaletteVariants(const tilejob_t* job, const uint8_t* data, uint32_t size);
+
+// Link the extra palette PNGs of a duplicate tile like its PNG
+static bool LinkPaletteVariants(const tilejob_t* job);
+
+// Put other colors into the PLTE chunk of an encoded PNG and fix its crc
+static bool SetPNGPalette(uint8_t* data, uint32_t size, const RGBQUAD* colors);
+
+// Map an ART file for the server and add its tiles to the server's table
+static bool LoadServeFile(const char* artname);
+
+// Map a whole file read-only (read into memory on Windows)
+static uint8_t* MapArtFile(FILE* file, size_t size);
+
+// Listen on serveport and answer requests until the process is ended
+static bool ServeTiles(void);
+
+// Server thread, accepts connections and answers them one by one
+static void* ServerThread(void* arg);
+
+// Read one HTTP request and answer it
+static void HandleRequest(socket_t client);
+
+// Get a copy of the PNG of a tile, from the cache or freshly encoded
+static uint8_t* GetTilePNG(uint32_t tilenum, uint32_t* size);
+
+// Find the palette asked for by the pal= query parameter, -1 if unknown
+static int32_t FindServePalette(const char* query);
+
+// Add the size and animation data of a tile as a json object
+static bool AppendServeTile(textbuf_t* tb, uint32_t tilenum);
+
+// Send a complete HTTP response and nothing else
+static bool SendResponse(socket_t client, const char* status, const char* type, const uint8_t* data, uint32_t size);
+
+// Send all of size bytes
+static bool SendAll(socket_t client, const uint8_t* data, uint32_t size);
+
+// Get a buffer of at least size bytes from the pool
+static uint8_t* PoolAlloc(uint32_t size);
+
+// Give a PoolAlloc() buffer back to the pool
+static void PoolFree(uint8_t* buffer);
+
+// Free the buffers the pool keeps for reuse
+static void PoolReset(void);
+
+// Pop a job, waits while the queue is empty
+static tilejob_t* PopJob(jobqueue_t* q);
+
+// Push a job, waits while the queue is full
+static void PushJob(jobqueue_t* q, tilejob_t* job);
+
+// Read the pixels of tile ti into a new buffer
+static uint8_t* ReadTile(uint32_t ti, const char* picname);
+
+// Give back bytes counted by ReserveMemory()
+static void ReleaseMemory(uint32_t bytes);
+
+// Count bytes against --max-memory, waits while the tiles in flight use too much
+static void ReserveMemory(uint32_t bytes);
+
 // Set a uint16_t into a little-endian ordered buffer
 static void SetLittleEndianUInt16(uint16_t number, uint8_t* buffer);
 
-// Extract the picture at tileslist[tileindex] and save it as picname
-static bool SpawnPNG(uint32_t ti, const char* picname, const char* outdir);
+// Set a uint32_t into a little-endian ordered buffer
+static void SetLittleEndianUInt32(uint32_t number, uint8_t* buffer);
+
+// Set a uint16_t into a big-endian ordered buffer
+static void SetBigEndianUInt16(uint16_t number, uint8_t* buffer);
+
+// Set a uint32_t into a big-endian ordered buffer
+static void SetBigEndianUInt32(uint32_t number, uint8_t* buffer);
+
+// Turn the pixels of a job into a PNG in memory
+static bool SpawnPNG(tilejob_t* job);
+
+// Scale3x of a column-major tile into dst, which is 3 * sizex by 3 * sizey
+static void Scale3xTile(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst);
+
+// Turn a job's pixels into a raw tile
+static bool SpawnRaw(tilejob_t* job);
+
+// PackBits compress len bytes of src into dst, returns the compressed size.
+// dst needs len + len / 128 + 1 bytes at worst.
+static uint32_t PackRLE(const uint8_t* src, uint32_t len, uint8_t* dst);
+
+// Start the encoder and writer threads
+static bool StartPipeline(void);
+
+// Wait for every job to be written and end the threads
+static bool StopPipeline(void);
+
+// Wait until every job read so far is written
+static void DrainPipeline(void);
+
+// Run the jobs of a --batch file, returns false if any of them failed
+static bool RunBatch(const char* batchname, const char* cwd);
+
+// Hand a job to the pipeline, waits when the writer is too far behind
+static void SubmitJob(tilejob_t* job);
+
+// Try to pop a job, NULL if the queue is empty
+static tilejob_t* TryPopJob(jobqueue_t* q);
+
+// Try to push a job, false if the queue is full
+static bool TryPushJob(jobqueue_t* q, tilejob_t* job);
+
+// Parse the animation data ini back like png2art and compare it with the ART header
+static bool VerifyAnimationData(const char* text);
+
+// Replace the pixels of a job with the tile scaled upscale times
+static bool UpscaleTile(tilejob_t* job);
+
+// Decode the PNG of a job like png2art and compare it with the tile
+static bool VerifyPNG(tilejob_t* job);
+
+// Back off a little longer each time a queue was full or empty
+static void WaitForQueue(uint32_t spins);
+
+// Write a finished job to the output folder or the tar stream
+static bool WriteJob(tilejob_t* job);
+
+// Write one file to the output folder or the tar stream
+static bool WriteOutput(const char* name, const uint8_t* data, uint32_t size, bool text);
+
+// Writer thread, writes the jobs in the order they were read
+static void* WriterThread(void* arg);
+
+// Write one file (or a hardlink to linkname) to the tar stream
+static bool WriteTarEntry(const char* name, const uint8_t* data, uint32_t size, const char* linkname);
 
 // Implementations
-static bool DumpAnimationData(uint16_t an, char* od)
+static uniquetile_t* AddUniqueTile(uint32_t ti, const uint8_t* ibuff)
 {
-	// Variables
-	FILE* animDataFile;
-	uint32_t i;
-	char str[FILENAME_MAX];
+	uniquetile_t* newtiles;
+	uniquetile_t* u;
+	uint32_t* newslots;
+	uint64_t hash;
+	uint32_t i, slot, picsize;
 
-	sprintf(str, "%s%sadata%03u.ini", od, PATH_DELIMITER, an);
-
-	animDataFile = fopen(str, "wt");
-	if (animDataFile == NULL)
+	// keep the hash table at most half full
+	if ((numunique + 1) * 2 > numslots)
 	{
-		printf("Error: cannot create animdata data file\n");
-		return false;
+		uint32_t newcount = numslots ? numslots * 2 : 4096;
+
+		newslots = calloc(newcount, sizeof(uint32_t));
+		if (newslots == NULL)
+			return NULL;
+
+		for (i = 0; i < numunique; i++)
+		{
+			slot = (uint32_t)uniquetiles[i].hash & (newcount - 1);
+			while (newslots[slot] != 0)
+				slot = (slot + 1) & (newcount - 1);
+			newslots[slot] = i + 1;
+		}
+
+		free(uniqueslots);
+		uniqueslots = newslots;
+		numslots = newcount;
 	}
 
-	printf("Creating animation data ini file...");
-	fflush(stdout);
+	if (numunique == uniquecapacity)
+	{
+		uint32_t newcapacity = uniquecapacity ? uniquecapacity * 2 : 2048;
 
-	fprintf(animDataFile,
-		"; this file contains animation data from \"%s\"\n"
-		"; extracted by art2png version " VERSION "\n"
-		"\n",
-		artfilename
-		);
+		newtiles = realloc(uniquetiles, newcapacity * sizeof(uniquetile_t));
+		if (newtiles == NULL)
+			return NULL;
+		uniquetiles = newtiles;
+		uniquecapacity = newcapacity;
+	}
 
-	// For each tile
-	for (i = 0; i < numtiles; i++)
+	picsize = Tiles.sizex[ti] * Tiles.sizey[ti];
+	hash = HashTile(Tiles.sizex[ti], Tiles.sizey[ti], ibuff, picsize);
+
+	// the hash and dimensions only pick the candidates, the pixels decide
+	for (slot = (uint32_t)hash & (numslots - 1); uniqueslots[slot] != 0; slot = (slot + 1) & (numslots - 1))
 	{
-		// if it has animation data...
-		if (TilesList[i].animdata != 0)
+		u = &uniquetiles[uniqueslots[slot] - 1];
+		if (u->hash == hash && u->sizex == Tiles.sizex[ti] && u->sizey == Tiles.sizey[ti] &&
+			SameTilePixels(u, ibuff))
 		{
-			// if the tile has animation data
-			// print them first...
-			if (((TilesList[i].animdata >> 0) & 0x3F) != 0 ||
-				((TilesList[i].animdata >> 6) & 0x03) != 0 ||
-				((TilesList[i].animdata >> 24) & 0x0F) != 0)
+			if (numdups == dupcapacity)
 			{
-				fprintf(animDataFile, "[tile%04u.png -> tile%04u.png]\n",
-					i + tilestartnum, i + tilestartnum + (TilesList[i].animdata & 0x3F));
-				fprintf(animDataFile, "    AnimationType=%s\n",
-					animtypes[(TilesList[i].animdata >> 6) & 0x03]);
-				fprintf(animDataFile, "    AnimationSpeed=%u\n",
-					(TilesList[i].animdata >> 24) & 0x0F);
-				fprintf(animDataFile, "\n");
-			}
+				duptile_t* newdups;
+				uint32_t newcapacity = dupcapacity ? dupcapacity * 2 : 1024;
 
-			fprintf(animDataFile, "[tile%04u.png]\n", i + tilestartnum);
+				newdups = realloc(duptiles, newcapacity * sizeof(duptile_t));
+				if (newdups == NULL)
+					return NULL;
+				duptiles = newdups;
+				dupcapacity = newcapacity;
+			}
 
-			fprintf(animDataFile, "    XCenterOffset=%d\n",
-				(int8_t)((TilesList[i].animdata >> 8) & 0xFF));
-			fprintf(animDataFile, "    YCenterOffset=%d\n",
-				(int8_t)((TilesList[i].animdata >> 16) & 0xFF));
-			fprintf(animDataFile, "    OtherFlags=%u\n",
-				TilesList[i].animdata >> 28);
-			fprintf(animDataFile, "\n");
+			// the slots move when the table grows, the array index stays
+			duptiles[numdups].unique = uniqueslots[slot] - 1;
+			duptiles[numdups].tilenum = ti + tilestartnum;
+			numdups++;
+			u->dupcount++;
+			return u;
 		}
 	}
 
-	fclose(animDataFile);
-	printf(" done\n\n");
-	return true;
-}
+	uniqueslots[slot] = numunique + 1;
+	u = &uniquetiles[numunique++];
+	u->hash = hash;
+	u->tilenum = ti + tilestartnum;
+	u->picsize = picsize;
+	u->sizex = Tiles.sizex[ti];
+	u->sizey = Tiles.sizey[ti];
+	u->dupcount = 0;
+	u->artnum = filenum;
+	u->offset = Tiles.offset[ti];
 
-// ExtractImages - extract pictures from the ART file
+	return NULL;
+}
 
-static bool ExtractImages(const char* od)
+static bool AppendText(textbuf_t* tb, const char* format, ...)
 {
-	uint32_t i;
-	char imagefilename[13];
-
-	// a little counter
-	printf("Extracting images:        0");
-	fflush(stdout);
+	va_list args;
+	int len;
+	char* newdata;
 
-	for (i = 0; i < numtiles; i++)
+	for (;;)
 	{
-		// updating counter
-		printf("\b\b\b\b%4u", i);
-		fflush(stdout);
+		va_start(args, format);
+		len = vsnprintf(tb->data + tb->length, tb->capacity - tb->length, format, args);
+		va_end(args);
+
+		if (len < 0)
+			return false;
+		if (tb->length + len < tb->capacity)
+			break;
 
-		sprintf(imagefilename, "tile%04u.png", i + tilestartnum);
-		SpawnPNG(i, imagefilename, od);
+		newdata = realloc(tb->data, tb->capacity * 2 + len + 1);
+		if (newdata == NULL)
+			return false;
+		tb->data = newdata;
+		tb->capacity = tb->capacity * 2 + len + 1;
 	}
 
-	printf("\b\b\b\bdone\n\n");
+	tb->length += len;
 	return true;
 }
 
-static bool GetPicturesList(void)
+static int CompareDupTiles(const void* a, const void* b)
 {
-	// Veriables
-	uint8_t buffer[MAX_NUMBER_OF_TILES * 4];
-	uint32_t ver, tileendnum;
-	uint32_t i;
-	size_t crtoffset;
-
-	if (fread(buffer, 1, 16, artfile) != 16)
-	{
-		printf("Error: invalid ART file: not enough header data\n");
-		return false;
-	}
-	ver	= GetLittleEndianUInt32(&buffer[0]);
-	numtiles = GetLittleEndianUInt32(&buffer[4]);
-	tilestartnum = GetLittleEndianUInt32(&buffer[8]);
-	tileendnum = GetLittleEndianUInt32(&buffer[12]);
-
-	numtiles = tileendnum - tilestartnum + 1;
-
-	if (ver != 1)
-	{
-		printf("error: invalid ART file: invalid version number(%u)\n", ver);
-		return false;
-	}
+	const duptile_t* da = a;
+	const duptile_t* db = b;
 
-	printf("%u tiles declared in the ART header\n", numtiles);
+	if (uniquetiles[da->unique].tilenum != uniquetiles[db->unique].tilenum)
+		return uniquetiles[da->unique].tilenum < uniquetiles[db->unique].tilenum ? -1 : 1;
 
-	// Extract sizes
-	fread(buffer, 1, numtiles * 2, artfile);
-	for (i = 0; i < numtiles; i++)
-		TilesList[i].sizex = GetLittleEndianUInt16(&buffer[i * 2]);
-	fread(buffer, 1, numtiles * 2, artfile);
-	for (i = 0; i < numtiles; i++)
-		TilesList[i].sizey = GetLittleEndianUInt16(&buffer[i * 2]);
+	return da->tilenum < db->tilenum ? -1 : (da->tilenum > db->tilenum);
+}
 
-	fread(buffer, 1, numtiles * 4, artfile);
-	for (i = 0; i < numtiles; i++)
-		TilesList[i].animdata = GetLittleEndianUInt32(&buffer[i * 4]);
+static bool SameTilePixels(const uniquetile_t* u, const uint8_t* pixels)
+{
+	char path[FILENAME_MAX];
+	FILE* file = artfile;
+	uint8_t* first;
+	bool same;
 
-	crtoffset = 16 + numtiles * (2 + 2 + 4);
-	for (i = 0; i < numtiles; i++)
+	// the first tile may be in an ART file that is closed already
+	if (u->artnum != filenum)
 	{
-		TilesList[i].offset = crtoffset;
-		crtoffset += TilesList[i].sizex * TilesList[i].sizey;
+		sprintf(path, "%s%sTILES%03u.ART", artdir, PATH_DELIMITER, u->artnum);
+		file = fopen(path, "rb");
+		if (file == NULL)
+			return false;
 	}
 
-	return true;
+	first = malloc(u->picsize);
+	same = first != NULL && fseek(file, u->offset, SEEK_SET) == 0 &&
+		fread(first, 1, u->picsize, file) == u->picsize && memcmp(first, pixels, u->picsize) == 0;
+
+	free(first);
+	if (file != artfile)
+		fclose(file);
+	return same;
 }
 
-static bool LoadPalette(char *pfname)
+static bool ComposeSheet(tilejob_t* job)
 {
-	// variables
-	FILE* pfile;
+	uint8_t* canvas;
+	const uint8_t* pixels = job->data;
+	uint32_t columns, rows, cellw, cellh, width, height, i, left, top;
+	bool ok = true;
 
-	uint32_t i;
-	uint8_t color;
+	job->kind = JOB_PNG;
 
-	pfile = fopen(pfname, "rb");
-	if (pfile == NULL)
+	columns = job->sheetcount < SHEET_COLUMNS ? job->sheetcount : SHEET_COLUMNS;
+	rows = (job->sheetcount + columns - 1) / columns;
+	cellw = (thumbsize > LABEL_WIDTH ? thumbsize : LABEL_WIDTH) + SHEET_PADDING * 2;
+	cellh = thumbsize + LABEL_HEIGHT + SHEET_PADDING * 3;
+	width = columns * cellw;
+	height = rows * cellh;
+
+	if (width > 0xFFFF || height > 0xFFFF)
 	{
-		printf("warning: cannot open palette.dat\n");
+		printf("\nerror: %s would be %ux%u, use fewer --sheet-tiles\n", job->name, width, height);
 		return false;
 	}
 
-	// read palette
-	if (fread(palette, 1, PALETTE_SIZE, pfile) != PALETTE_SIZE)
+	canvas = PoolAlloc(width * height);
+	if (canvas == NULL)
 	{
-		printf("warning: cannot read the whole palette from palette.dat file\n");
-		fclose(pfile);
+		printf("\nerror: cannot alloc enough memory for %s\n", job->name);
 		return false;
 	}
+	memset(canvas, sheetbackground, width * height);
 
-	for (i = 0; i < PALETTE_SIZE; i += 3)
+	// cells go row by row in tile order, the canvas is column-major like a tile
+	for (i = 0; i < job->sheetcount; i++)
 	{
-		rgbpal[i/3].rgbRed = palette[i] * 4;
-		rgbpal[i/3].rgbGreen = palette[i + 1] * 4;
-		rgbpal[i/3].rgbBlue = palette[i + 2] * 4;
+		left = (i % columns) * cellw + SHEET_PADDING;
+		top = (i / columns) * cellh + SHEET_PADDING;
+
+		if (job->sheet[i].sizex != 0 && job->sheet[i].sizey != 0)
+			ok &= DrawThumbnail(pixels, job->sheet[i].sizex, job->sheet[i].sizey,
+				canvas, height, left, top, cellw - SHEET_PADDING * 2);
+		DrawLabel(job->sheet[i].tilenum, canvas, height, left, top + thumbsize + SHEET_PADDING,
+			cellw - SHEET_PADDING * 2);
+
+		pixels += job->sheet[i].sizex * job->sheet[i].sizey;
 	}
-	
+
+	PoolFree(job->data);
+	job->data = canvas;
+	job->size = width * height;
+	job->sizex = (uint16_t)width;
+	job->sizey = (uint16_t)height;
+
+	if (!ok)
+		printf("\nerror: not enough memory to scale the tiles of %s\n", job->name);
+	return ok && SpawnPNG(job);
 }
 
-int main (int argc, char* argv[])
+static void DrawLabel(uint32_t number, uint8_t* canvas, uint32_t canvash, uint32_t left, uint32_t top, uint32_t width)
 {
-	char* numarg;
-	char* palfilestr;
-	char* dirinstr;
-	char* diroutstr;
-	char cdout[FILENAME_MAX];
-	char currfile[FILENAME_MAX];
-	char path[FILENAME_MAX];
-	char cwd[FILENAME_MAX];
-	char palfile[FILENAME_MAX];
-	char dirout[FILENAME_MAX];
-	char dirin[FILENAME_MAX];
-	uint32_t artn;
-	uint32_t extpos = 8;
-	uint32_t artcount;
+	char digits[12];
+	uint32_t length, i, row, col, glyph;
 
-	// header
-	printf("\n"
-			"Art2PNG version " VERSION " by SanyaWaffles\n"
-			"Based on Art2TGA by Mathieu Olivier\n"
-			"===================================\n\n"
-			);
+	length = sprintf(digits, "%u", number);
+	if (length * 4 - 1 > width)
+		return;
+	left += (width - (length * 4 - 1)) / 2;
 
-	if (argc != 5)
+	for (i = 0; i < length; i++, left += 4)
 	{
-		printf("Syntax: art2png <num> <palette> <folder in> <folder out>\n"
-				"	Extract pictures from art files in a folder to another folder as pngs\n"
-				"	eg: art2png 19 palette.dat folderin folderout\n");
-		FreeImage_DeInitialise();
-		return EXIT_FAILURE;
+		glyph = digitfont[digits[i] - '0'];
+		for (row = 0; row < LABEL_HEIGHT; row++)
+			for (col = 0; col < 3; col++)
+				if ((glyph >> ((LABEL_HEIGHT - 1 - row) * 3 + 2 - col)) & 1)
+					canvas[(left + col) * canvash + top + row] = sheetlabel;
 	}
+}
 
-	FreeImage_Initialise(0);
+static bool DrawThumbnail(const uint8_t* pixels, uint32_t sizex, uint32_t sizey,
+	uint8_t* canvas, uint32_t canvash, uint32_t left, uint32_t top, uint32_t width)
+{
+	uint32_t thumbx, thumby, x, y, x0, x1, y0, y1, sx, sy, opaque, count, n;
+	uint32_t red, green, blue;
+	uint8_t* rgb;
+	uint8_t* covered;
+	uint8_t* indexes;
+	uint8_t index;
 
-	GetCurrentDir(cwd, sizeof(cwd));
+	// never scaled up, bigger tiles keep their aspect
+	thumbx = sizex;
+	thumby = sizey;
+	if (sizex > thumbsize || sizey > thumbsize)
+	{
+		thumbx = sizex >= sizey ? thumbsize : sizex * thumbsize / sizey;
+		thumby = sizey >= sizex ? thumbsize : sizey * thumbsize / sizex;
+		thumbx += thumbx == 0;
+		thumby += thumby == 0;
+	}
+	left += (width - thumbx) / 2;
+	top += (thumbsize - thumby) / 2;
 
-	numarg = argv[1];
-	palfilestr = argv[2];
-	dirinstr = argv[3];
-	diroutstr = argv[4];
+	// palette space: every thumbnail pixel is one of the tile's pixels
+	if (!thumbbox || (thumbx == sizex && thumby == sizey))
+	{
+		for (x = 0; x < thumbx; x++)
+		{
+			for (y = 0; y < thumby; y++)
+			{
+				index = pixels[(x * sizex / thumbx) * sizey + y * sizey / thumby];
+				if (index != 255)
+					canvas[(left + x) * canvash + top + y] = index;
+			}
+		}
+		return true;
+	}
+
+	// box filter: the average color of the opaque pixels under each
+	// thumbnail pixel, mapped back to the palette in one go
+	rgb = malloc(thumbx * thumby * 5);
+	if (rgb == NULL)
+		return false;
+	covered = rgb + thumbx * thumby * 3;
+	indexes = covered + thumbx * thumby;
+
+	for (x = 0, count = 0; x < thumbx; x++)
+	{
+		x0 = x * sizex / thumbx;
+		x1 = (x + 1) * sizex / thumbx;
+		for (y = 0; y < thumby; y++)
+		{
+			y0 = y * sizey / thumby;
+			y1 = (y + 1) * sizey / thumby;
+
+			red = green = blue = opaque = 0;
+			for (sx = x0; sx < x1; sx++)
+			{
+				for (sy = y0; sy < y1; sy++)
+				{
+					index = pixels[sx * sizey + sy];
+					if (index == 255)
+						continue;
+					red += sheetpalette[index * 3];
+					green += sheetpalette[index * 3 + 1];
+					blue += sheetpalette[index * 3 + 2];
+					opaque++;
+				}
+			}
+
+			// mostly see-through stays see-through
+			covered[x * thumby + y] = opaque * 2 >= (x1 - x0) * (y1 - y0);
+			if (covered[x * thumby + y])
+			{
+				rgb[count * 3] = (uint8_t)(red / opaque);
+				rgb[count * 3 + 1] = (uint8_t)(green / opaque);
+				rgb[count * 3 + 2] = (uint8_t)(blue / opaque);
+				count++;
+			}
+		}
+	}
+
+	ArtKernels.NearestColors(sheetpalette, 255, rgb, indexes, count);
+
+	for (x = 0, n = 0; x < thumbx; x++)
+		for (y = 0; y < thumby; y++)
+			if (covered[x * thumby + y])
+				canvas[(left + x) * canvash + top + y] = indexes[n++];
+
+	free(rgb);
+	return true;
+}
+
+static bool MakeContactSheets(void)
+{
+	tilejob_t* job;
+	uint32_t first, count, last, size, i, pertile;
+
+	pertile = sheettiles != 0 ? sheettiles : numtiles;
+
+	printf("Queueing contact sheets...");
+	fflush(stdout);
+
+	for (first = 0; first < numtiles; first += pertile)
+	{
+		count = numtiles - first < pertile ? numtiles - first : pertile;
+		last = first + count - 1;
+
+		// the tiles of a range follow each other in the ART file
+		size = Tiles.offset[last] + Tiles.sizex[last] * Tiles.sizey[last] - Tiles.offset[first];
+
+		job = calloc(1, sizeof(tilejob_t));
+		if (job == NULL || (job->sheet = malloc(count * sizeof(sheettile_t))) == NULL)
+		{
+			printf("error: cannot alloc enough memory for a contact sheet\n");
+			free(job);
+			return false;
+		}
+		sprintf(job->name, "sheet%04u-%04u.png", first + tilestartnum, last + tilestartnum);
+
+		// the tiles and, at worst, a sheet and PNG as big again
+		job->reserved = size * 2;
+		ReserveMemory(job->reserved);
+
+		job->data = PoolAlloc(size + 1);
+		fseek(artfile, Tiles.offset[first], SEEK_SET);
+		if (job->data == NULL || fread(job->data, 1, size, artfile) != size)
+		{
+			printf("error: cannot read the tiles of %s\n", job->name);
+			FreeJob(job);
+			return false;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			job->sheet[i].tilenum = first + i + tilestartnum;
+			job->sheet[i].sizex = Tiles.sizex[first + i];
+			job->sheet[i].sizey = Tiles.sizey[first + i];
+		}
+
+		job->kind = JOB_SHEET;
+		job->size = size;
+		job->sheetcount = count;
+		SubmitJob(job);
+	}
+
+	printf(" done\n\n");
+	return true;
+}
+
+static void SetSheetColors(void)
+{
+	// dark gray cells and white labels, from the palette itself
+	static const uint8_t sheetcolors[6] = {40, 40, 40, 255, 255, 255};
+	uint8_t picked[2];
+	uint32_t i;
+
+	for (i = 0; i < 256; i++)
+	{
+		sheetpalette[i * 3] = rgbpal[i].rgbRed;
+		sheetpalette[i * 3 + 1] = rgbpal[i].rgbGreen;
+		sheetpalette[i * 3 + 2] = rgbpal[i].rgbBlue;
+	}
+	ArtKernels.NearestColors(sheetpalette, 255, sheetcolors, picked, 2);
+	sheetbackground = picked[0];
+	sheetlabel = picked[1];
+}
+
+static bool ComposeAnimation(tilejob_t* job)
+{
+	uint32_t order[MAX_ANIM_FRAMES * 2];
+	uint32_t start[MAX_ANIM_FRAMES];
+	int32_t left[MAX_ANIM_FRAMES], top[MAX_ANIM_FRAMES];
+	int32_t anchorx = -0x10000, anchory = -0x10000;
+	uint32_t frames, count, width = 0, height = 0, i, f, x, y, x0, x1, y0, y1, rw, rh;
+	uint32_t pos, capacity, bound, length, seq = 0;
+	const sheettile_t* tile;
+	uint8_t* canvases;
+	uint8_t* current;
+	uint8_t* previous;
+	uint8_t* scan;
+	uint8_t* out;
+	void* p;
+
+	frames = job->sheetcount - 1;
+
+	// one loop of what the engine shows, backward ranges end at their own tile
+	count = 0;
+	if (((job->animdata >> 6) & 0x03) == 1)
+	{
+		for (i = 0; i <= frames; i++)
+			order[count++] = i;
+		for (i = frames - 1; i > 0; i--)
+			order[count++] = i;
+	}
+	else if (((job->animdata >> 6) & 0x03) == 2)
+	{
+		for (i = 0; i <= frames; i++)
+			order[count++] = i;
+	}
+	else
+	{
+		for (i = 0; i <= frames; i++)
+			order[count++] = frames - i;
+	}
+
+	// the engine draws a tile with its center, moved by the offsets, on the
+	// spot it is put at; the frames share that spot on the canvas
+	for (i = 0, length = 0; i <= frames; i++)
+	{
+		tile = &job->sheet[i];
+		start[i] = length;
+		length += tile->sizex * tile->sizey;
+		if (tile->sizex == 0 || tile->sizey == 0)
+			continue;
+		if (tile->sizex / 2 + tile->xoffset > anchorx)
+			anchorx = tile->sizex / 2 + tile->xoffset;
+		if (tile->sizey / 2 + tile->yoffset > anchory)
+			anchory = tile->sizey / 2 + tile->yoffset;
+	}
+	for (i = 0; i <= frames; i++)
+	{
+		tile = &job->sheet[i];
+		left[i] = anchorx - (tile->sizex / 2 + tile->xoffset);
+		top[i] = anchory - (tile->sizey / 2 + tile->yoffset);
+
+		// the anchor is the furthest of the drawn tiles, so theirs aren't negative
+		if (tile->sizex != 0 && tile->sizey != 0 && (uint32_t)(left[i] + tile->sizex) > width)
+			width = left[i] + tile->sizex;
+		if (tile->sizex != 0 && tile->sizey != 0 && (uint32_t)(top[i] + tile->sizey) > height)
+			height = top[i] + tile->sizey;
+	}
+
+	if (width > 0xFFFF || height > 0xFFFF)
+	{
+		printf("\nerror: %s would be %ux%u\n", job->name, width, height);
+		return false;
+	}
+
+	// two canvases to compare and the scanlines of the part that changed
+	canvases = malloc(width * height * 2 + (width + 1) * height);
+	if (canvases == NULL)
+	{
+		printf("\nerror: cannot alloc enough memory for %s\n", job->name);
+		return false;
+	}
+	scan = canvases + width * height * 2;
+
+	// signature, IHDR, acTL, PLTE, tRNS and IEND
+	capacity = 8 + 25 + 20 + 12 + PALETTE_SIZE + 12 + 256 + 12;
+	out = malloc(capacity);
+	if (out == NULL)
+	{
+		printf("\nerror: cannot alloc enough memory for %s\n", job->name);
+		free(canvases);
+		return false;
+	}
+
+	memcpy(out, "\x89PNG\r\n\x1A\n", 8);
+	pos = 8;
+	SetBigEndianUInt32(width, &out[pos + 8]);
+	SetBigEndianUInt32(height, &out[pos + 12]);
+	memcpy(&out[pos + 16], "\x08\x03\x00\x00\x00", 5);		// 8-bit palette, not interlaced
+	pos += EndPNGChunk(&out[pos], "IHDR", 13);
+	SetBigEndianUInt32(count, &out[pos + 8]);
+	SetBigEndianUInt32(0, &out[pos + 12]);					// loops forever
+	pos += EndPNGChunk(&out[pos], "acTL", 8);
+	for (i = 0; i < 256; i++)
+	{
+		out[pos + 8 + i * 3] = rgbpal[i].rgbRed;
+		out[pos + 8 + i * 3 + 1] = rgbpal[i].rgbGreen;
+		out[pos + 8 + i * 3 + 2] = rgbpal[i].rgbBlue;
+	}
+	pos += EndPNGChunk(&out[pos], "PLTE", PALETTE_SIZE);
+	memset(&out[pos + 8], 255, 255);
+	out[pos + 8 + 255] = 0;
+	pos += EndPNGChunk(&out[pos], "tRNS", 256);
+
+	for (f = 0; f < count; f++)
+	{
+		current = canvases + (f & 1) * width * height;
+		previous = canvases + ((f & 1) ^ 1) * width * height;
+		tile = &job->sheet[order[f]];
+
+		memset(current, 255, width * height);
+		for (x = 0; x < tile->sizex; x++)
+			memcpy(&current[(left[order[f]] + x) * height + top[order[f]]],
+				&job->data[start[order[f]] + x * tile->sizey], tile->sizey);
+
+		// the first frame is all of it, the others only the box that changed
+		x0 = 0;
+		y0 = 0;
+		x1 = width;
+		y1 = height;
+		if (f > 0)
+		{
+			x0 = width;
+			y0 = height;
+			x1 = 0;
+			y1 = 0;
+			for (x = 0; x < width; x++)
+			{
+				if (memcmp(&current[x * height], &previous[x * height], height) == 0)
+					continue;
+				for (y = 0; current[x * height + y] == previous[x * height + y]; y++)
+					;
+				y0 = y < y0 ? y : y0;
+				for (y = height; current[x * height + y - 1] == previous[x * height + y - 1]; y--)
+					;
+				y1 = y > y1 ? y : y1;
+				x0 = x < x0 ? x : x0;
+				x1 = x + 1;
+			}
+
+			// a frame can't be empty, an unchanged one repeats a pixel
+			if (x1 == 0)
+			{
+				x0 = 0;
+				y0 = 0;
+				x1 = 1;
+				y1 = 1;
+			}
+		}
+		rw = x1 - x0;
+		rh = y1 - y0;
+
+		// filter type none on every scanline, it suits palette images
+		ArtKernels.Transpose(&current[x0 * height + y0], height, scan + 1, rw + 1, rw, rh);
+		for (y = 0; y < rh; y++)
+			scan[y * (rw + 1)] = 0;
+
+		// fcTL, then IDAT or fdAT as deflate may leave them, and IEND
+		bound = rh * (rw + 1) + rh * (rw + 1) / 1024 + 64;
+		if (pos + 38 + 16 + bound + 12 > capacity)
+		{
+			capacity = (pos + 38 + 16 + bound + 12) * 2;
+			if ((p = realloc(out, capacity)) == NULL)
+				break;
+			out = p;
+		}
+
+		SetBigEndianUInt32(seq++, &out[pos + 8]);
+		SetBigEndianUInt32(rw, &out[pos + 12]);
+		SetBigEndianUInt32(rh, &out[pos + 16]);
+		SetBigEndianUInt32(x0, &out[pos + 20]);
+		SetBigEndianUInt32(y0, &out[pos + 24]);
+		SetBigEndianUInt16((uint16_t)(1 << ((job->animdata >> 24) & 0x0F)), &out[pos + 28]);
+		SetBigEndianUInt16(ANIM_TICKS_PER_SECOND, &out[pos + 30]);
+		out[pos + 32] = 0;				// dispose: leave the canvas as it is
+		out[pos + 33] = 0;				// blend: replace, so pixels can turn see-through
+		pos += EndPNGChunk(&out[pos], "fcTL", 26);
+
+		// the first frame is the default image too
+		if (f == 0)
+		{
+			length = FreeImage_ZLibCompress(&out[pos + 8], bound, scan, rh * (rw + 1));
+			if (length == 0)
+				break;
+			pos += EndPNGChunk(&out[pos], "IDAT", length);
+		}
+		else
+		{
+			SetBigEndianUInt32(seq++, &out[pos + 8]);
+			length = FreeImage_ZLibCompress(&out[pos + 12], bound, scan, rh * (rw + 1));
+			if (length == 0)
+				break;
+			pos += EndPNGChunk(&out[pos], "fdAT", length + 4);
+		}
+	}
+
+	free(canvases);
+
+	if (f < count)
+	{
+		printf("\nerror: cannot encode %s\n", job->name);
+		free(out);
+		return false;
+	}
+
+	pos += EndPNGChunk(&out[pos], "IEND", 0);
+
+	job->raw = out;
+	job->rawsize = pos;
+	return true;
+}
+
+static uint32_t EndPNGChunk(uint8_t* chunk, const char* type, uint32_t length)
+{
+	SetBigEndianUInt32(length, &chunk[0]);
+	memcpy(&chunk[4], type, 4);
+	SetBigEndianUInt32(FreeImage_ZLibCRC32(0, &chunk[4], length + 4), &chunk[8 + length]);
+
+	return 12 + length;
+}
+
+static bool MakeAnimations(void)
+{
+	tilejob_t* job;
+	uint32_t i, k, frames, first, last, size;
+
+	printf("Queueing animations...");
+	fflush(stdout);
+
+	for (i = 0; i < numtiles; i++)
+	{
+		frames = Tiles.animdata[i] & 0x3F;
+		if (frames == 0 || ((Tiles.animdata[i] >> 6) & 0x03) == 0)
+			continue;
+
+		// another shard's animation
+		if (i + tilestartnum < shardfirst || i + tilestartnum > shardlast)
+			continue;
+
+		// backward animations play the tiles before their own
+		first = ((Tiles.animdata[i] >> 6) & 0x03) == 3 ? i - frames : i;
+		last = first + frames;
+		if (first > i || last >= numtiles)
+		{
+			printf("\nwarning: the animation of tile%04u runs past %s, skipped\n", i + tilestartnum, artfilename);
+			continue;
+		}
+
+		// the tiles of a range follow each other in the ART file
+		size = Tiles.offset[last] + Tiles.sizex[last] * Tiles.sizey[last] - Tiles.offset[first];
+		if (size == 0)
+			continue;
+
+		job = calloc(1, sizeof(tilejob_t));
+		if (job == NULL || (job->sheet = malloc((frames + 1) * sizeof(sheettile_t))) == NULL)
+		{
+			printf("error: cannot alloc enough memory for an animation\n");
+			free(job);
+			return false;
+		}
+		sprintf(job->name, "anim%04u.png", i + tilestartnum);
+
+		// the tiles and, at worst, an APNG as big again
+		job->reserved = size * 2;
+		ReserveMemory(job->reserved);
+
+		job->data = PoolAlloc(size + 1);
+		fseek(artfile, Tiles.offset[first], SEEK_SET);
+		if (job->data == NULL || fread(job->data, 1, size, artfile) != size)
+		{
+			printf("error: cannot read the tiles of %s\n", job->name);
+			FreeJob(job);
+			return false;
+		}
+
+		for (k = 0; k <= frames; k++)
+		{
+			job->sheet[k].tilenum = first + k + tilestartnum;
+			job->sheet[k].sizex = Tiles.sizex[first + k];
+			job->sheet[k].sizey = Tiles.sizey[first + k];
+			job->sheet[k].xoffset = (int8_t)((Tiles.animdata[first + k] >> 8) & 0xFF);
+			job->sheet[k].yoffset = (int8_t)((Tiles.animdata[first + k] >> 16) & 0xFF);
+		}
+
+		job->kind = JOB_ANIM;
+		job->size = size;
+		job->sheetcount = frames + 1;
+		job->animdata = Tiles.animdata[i];
+		SubmitJob(job);
+	}
+
+	printf(" done\n\n");
+	return true;
+}
+
+static bool DumpAnimationData(uint16_t an)
+{
+	// Variables
+	textbuf_t text = {NULL, 0, 0};
+	tilejob_t* job;
+	uint32_t i;
+	int32_t xoffset, yoffset;
+	bool ok = true;
+
+	if (!verifyroundtrip)
+	{
+		printf("Creating animation data ini file...");
+		fflush(stdout);
+	}
+
+	ok &= AppendText(&text,
+		"; this file contains animation data from \"%s\"\n"
+		"; extracted by art2png version " VERSION "\n"
+		"\n",
+		artfilename
+		);
+
+	// For each tile
+	for (i = 0; i < numtiles; i++)
+	{
+		// if it has animation data...
+		if (Tiles.animdata[i] != 0)
+		{
+			// if the tile has animation data
+			// print them first...
+			if (((Tiles.animdata[i] >> 0) & 0x3F) != 0 ||
+				((Tiles.animdata[i] >> 6) & 0x03) != 0 ||
+				((Tiles.animdata[i] >> 24) & 0x0F) != 0)
+			{
+				ok &= AppendText(&text,
+					"[tile%04u.png -> tile%04u.png]\n"
+					"    AnimationType=%s\n"
+					"    AnimationSpeed=%u\n"
+					"\n",
+					i + tilestartnum, i + tilestartnum + (Tiles.animdata[i] & 0x3F),
+					animtypes[(Tiles.animdata[i] >> 6) & 0x03],
+					(Tiles.animdata[i] >> 24) & 0x0F);
+			}
+
+			xoffset = ScaleOffset((int8_t)((Tiles.animdata[i] >> 8) & 0xFF), i, "XCenterOffset");
+			yoffset = ScaleOffset((int8_t)((Tiles.animdata[i] >> 16) & 0xFF), i, "YCenterOffset");
+			ok &= AppendText(&text,
+				"[tile%04u.png]\n"
+				"    XCenterOffset=%d\n"
+				"    YCenterOffset=%d\n"
+				"    OtherFlags=%u\n"
+				"\n",
+				i + tilestartnum, xoffset, yoffset,
+				Tiles.animdata[i] >> 28);
+		}
+	}
+
+	// parsed back right here instead of written
+	if (ok && verifyroundtrip)
+	{
+		ok = VerifyAnimationData(text.data);
+		free(text.data);
+		return ok;
+	}
+
+	job = calloc(1, sizeof(tilejob_t));
+	if (!ok || job == NULL)
+	{
+		printf("Error: cannot alloc enough memory for the animdata data file\n");
+		free(text.data);
+		free(job);
+		return false;
+	}
+
+	// the writer puts it out after the last tile of the file
+	job->kind = JOB_FILE;
+	job->data = (uint8_t*)text.data;
+	job->size = text.length;
+	sprintf(job->name, "adata%03u.ini", an);
+	SubmitJob(job);
+
+	printf(" done\n\n");
+	return true;
+}
+
+static int32_t ScaleOffset(int8_t offset, uint32_t ti, const char* field)
+{
+	int32_t scaled = offset * (int32_t)upscale;
+
+	if (scaled >= -128 && scaled <= 127)
+		return scaled;
+
+	// png2art reads the offsets back as int8_t, more would wrap around
+	printf("\nwarning: the %s of tile%04u is %d once scaled, clamped to %d\n",
+		field, ti + tilestartnum, scaled, scaled < 0 ? -128 : 127);
+	return scaled < 0 ? -128 : 127;
+}
+
+static bool DumpManifestTiles(void)
+{
+	uint32_t i;
+	int32_t xoffset, yoffset;
+	bool ok = true;
+
+	// one tile per line, written in tile order so diffs stay readable
+	for (i = 0; i < numtiles; i++)
+	{
+		if (Tiles.animdata[i] == 0)
+			continue;
+
+		xoffset = ScaleOffset((int8_t)((Tiles.animdata[i] >> 8) & 0xFF), i, "xoffset");
+		yoffset = ScaleOffset((int8_t)((Tiles.animdata[i] >> 16) & 0xFF), i, "yoffset");
+		ok &= AppendText(&manifest,
+			"%s\t\t{\"tile\": %u, \"frames\": %u, \"type\": \"%s\", \"speed\": %u, "
+			"\"xoffset\": %d, \"yoffset\": %d, \"flags\": %u}",
+			manifesttiles != 0 ? ",\n" : "",
+			i + tilestartnum,
+			Tiles.animdata[i] & 0x3F,
+			animtypes[(Tiles.animdata[i] >> 6) & 0x03],
+			(Tiles.animdata[i] >> 24) & 0x0F,
+			xoffset, yoffset,
+			Tiles.animdata[i] >> 28);
+		manifesttiles++;
+	}
+
+	if (!ok)
+		printf("Error: cannot alloc enough memory for the animation manifest\n");
+	return ok;
+}
+
+static bool DumpDuplicateReport(const char* reportname)
+{
+	FILE* reportfile;
+	uniquetile_t* u;
+	uint32_t i, groups;
+	uint64_t wasted;
+
+	reportfile = fopen(reportname, "wt");
+	if (reportfile == NULL)
+	{
+		printf("Error: cannot create duplicate report %s\n", reportname);
+		return false;
+	}
+
+	// group the duplicates under the tile they repeat
+	qsort(duptiles, numdups, sizeof(duptile_t), CompareDupTiles);
+
+	fprintf(reportfile,
+		"; duplicate tiles found by art2png version " VERSION "\n"
+		"\n");
+
+	groups = 0;
+	wasted = 0;
+	for (i = 0; i < numdups; i++)
+	{
+		u = &uniquetiles[duptiles[i].unique];
+		if (i == 0 || duptiles[i - 1].unique != duptiles[i].unique)
+		{
+			fprintf(reportfile, "[tile%04u.png]\n", u->tilenum);
+			fprintf(reportfile, "    Size=%ux%u\n", u->sizex, u->sizey);
+			fprintf(reportfile, "    WastedBytes=%u\n", u->picsize * u->dupcount);
+			fprintf(reportfile, "    Duplicates=");
+			groups++;
+			wasted += (uint64_t)u->picsize * u->dupcount;
+		}
+
+		fprintf(reportfile, "tile%04u.png", duptiles[i].tilenum);
+		if (i + 1 == numdups || duptiles[i + 1].unique != duptiles[i].unique)
+			fprintf(reportfile, "\n\n");
+		else
+			fprintf(reportfile, " ");
+	}
+
+	fprintf(reportfile, "; %u duplicate tiles in %u groups, %" PRIu64 " bytes of pixel data\n",
+		numdups, groups, wasted);
+	fclose(reportfile);
+
+	printf("%u duplicate tiles in %u groups (%" PRIu64 " bytes), see %s\n\n",
+		numdups, groups, wasted, reportname);
+	return true;
+}
+
+// ExtractImages - extract pictures from the ART file
+
+static bool ExtractImages(void)
+{
+	uint32_t i;
+	uint8_t* ibuff;
+	uniquetile_t* dup;
+	tilejob_t* job;
+
+	// a little counter
+	printf("Extracting images:        0");
+	fflush(stdout);
+
+	for (i = 0; i < numtiles; i++)
+	{
+		// updating counter
+		printf("\b\b\b\b%4u", i);
+		fflush(stdout);
+
+		if (Tiles.sizex[i] == 0 || Tiles.sizey[i] == 0)
+			continue;
+
+		// another shard's tile
+		if (i + tilestartnum < shardfirst || i + tilestartnum > shardlast)
+			continue;
+
+		job = calloc(1, sizeof(tilejob_t));
+		if (job == NULL)
+		{
+			printf("error: cannot alloc enough memory to load tile%04u.png\n", i + tilestartnum);
+			continue;
+		}
+		sprintf(job->name, "tile%04u.%s", i + tilestartnum, tileext);
+
+		// the pixels and, at worst, a PNG of the same size, upscaled
+		job->reserved = Tiles.sizex[i] * Tiles.sizey[i] * 2 * upscale * upscale;
+		ReserveMemory(job->reserved);
+
+		ibuff = ReadTile(i, job->name);
+		if (ibuff == NULL)
+		{
+			ReleaseMemory(job->reserved);
+			free(job);
+			continue;
+		}
+
+		job->kind = JOB_PNG;
+		job->sizex = Tiles.sizex[i];
+		job->sizey = Tiles.sizey[i];
+		job->data = ibuff;
+		job->size = Tiles.sizex[i] * Tiles.sizey[i];
+
+		// the writer links it once the first PNG is out
+		dup = finddups ? AddUniqueTile(i, ibuff) : NULL;
+		if (dup != NULL && dedupmode != DEDUP_NONE)
+		{
+			job->kind = JOB_LINK;
+			sprintf(job->linkname, "tile%04u.%s", dup->tilenum, tileext);
+		}
+
+		SubmitJob(job);
+	}
+
+	printf("\b\b\b\bdone\n\n");
+	return true;
+}
+
+static bool ExtractArtFiles(const char* dirin, uint32_t artcount)
+{
+	char currfile[FILENAME_MAX];
+	uint32_t artn;
+
+	for (artn = 0; artn <= artcount; artn++)
+	{
+		sprintf(currfile, "%s%sTILES%03u.ART", dirin, PATH_DELIMITER, artn);
+		artfilename = currfile + strlen(dirin) + strlen(PATH_DELIMITER);
+		artdir = dirin;
+		filenum = artn;
+		artfile = fopen(currfile, "rb");
+		if (artfile == NULL)
+		{
+			printf("error: cannot open %s\n", currfile);
+			return false;
+		}
+
+		// buffers kept from the last file may be the wrong sizes for this one
+		PoolReset();
+
+		// the animation data is written once, by --merge
+		if (!GetPicturesList() || (contactsheet && !MakeContactSheets()) ||
+			(!contactsheet && !mergeshards && !ExtractImages()) ||
+			(writeapng && !contactsheet && !verifyroundtrip && !mergeshards && !MakeAnimations()) ||
+			(!contactsheet && shardnum < 0 && !(writemanifest ? DumpManifestTiles() : DumpAnimationData(artn))))
+		{
+			fclose(artfile);
+			return false;
+		}
+
+		batchtiles += numtiles;
+		fclose(artfile);
+	}
+
+	return true;
+}
+
+static void* EncoderThread(void* arg)
+{
+	tilejob_t* job;
+
+	(void)arg;
+
+	while ((job = PopJob(&encodequeue)) != &stopencoder)
+	{
+		if (job->kind == JOB_SHEET)
+			ComposeSheet(job);
+		else if (job->kind == JOB_ANIM)
+			ComposeAnimation(job);
+		else if (job->kind == JOB_PNG)
+		{
+			SpawnPNG(job);
+			if (verifyroundtrip)
+				VerifyPNG(job);
+		}
+		PushJob(&writequeue, job);
+	}
+
+	return NULL;
+}
+
+static void FreeJob(tilejob_t* job)
+{
+	if (job->png != NULL)
+		FreeImage_CloseMemory(job->png);
+	free(job->raw);
+	free(job->sheet);
+	if (job->kind == JOB_FILE)
+		free(job->data);
+	else if (job->data != NULL)
+		PoolFree(job->data);
+	ReleaseMemory(job->reserved);
+	free(job);
+}
+
+static bool GetPicturesList(void)
+{
+	// Veriables
+	uint8_t header[16];
+	uint8_t* buffer;
+	uint32_t ver, tileendnum;
+	uint32_t i;
+	size_t crtoffset;
+	long filesize;
+
+	if (fread(header, 1, 16, artfile) != 16)
+	{
+		printf("Error: invalid ART file: not enough header data\n");
+		return false;
+	}
+	ver	= GetLittleEndianUInt32(&header[0]);
+	numtiles = GetLittleEndianUInt32(&header[4]);
+	tilestartnum = GetLittleEndianUInt32(&header[8]);
+	tileendnum = GetLittleEndianUInt32(&header[12]);
+
+	if (ver != 1)
+	{
+		printf("error: invalid ART file: invalid version number(%u)\n", ver);
+		return false;
+	}
+
+	if (tileendnum < tilestartnum)
+	{
+		printf("error: invalid ART file: last tile (%u) before first tile (%u)\n",
+			tileendnum, tilestartnum);
+		return false;
+	}
+	if (tileendnum > MAX_TILE_NUMBER)
+	{
+		printf("error: invalid ART file: last tile (%u) past %u\n", tileendnum, MAX_TILE_NUMBER);
+		return false;
+	}
+
+	numtiles = tileendnum - tilestartnum + 1;
+
+	// don't trust the count until we know the header is really there
+	fseek(artfile, 0, SEEK_END);
+	filesize = ftell(artfile);
+	fseek(artfile, 16, SEEK_SET);
+	if (filesize < 16 || (unsigned long)(filesize - 16) / (2 + 2 + 4) < numtiles)
+	{
+		printf("error: invalid ART file: %u tiles declared but the header is truncated\n", numtiles);
+		return false;
+	}
+
+	printf("%u tiles declared in the ART header\n", numtiles);
+
+	buffer = malloc(numtiles * (2 + 2 + 4));
+	if (buffer == NULL || !GrowTileTable(&Tiles, numtiles))
+	{
+		printf("error: cannot alloc enough memory for %u tiles\n", numtiles);
+		free(buffer);
+		return false;
+	}
+
+	// sizex[], sizey[] and animdata[] follow each other, read them at once
+	if (fread(buffer, 1, numtiles * (2 + 2 + 4), artfile) != numtiles * (2 + 2 + 4))
+	{
+		printf("error: invalid ART file: cannot read the tile header\n");
+		free(buffer);
+		return false;
+	}
+
+	for (i = 0; i < numtiles; i++)
+		Tiles.sizex[i] = GetLittleEndianUInt16(&buffer[i * 2]);
+	for (i = 0; i < numtiles; i++)
+		Tiles.sizey[i] = GetLittleEndianUInt16(&buffer[numtiles * 2 + i * 2]);
+	for (i = 0; i < numtiles; i++)
+		Tiles.animdata[i] = GetLittleEndianUInt32(&buffer[numtiles * 4 + i * 4]);
+
+	free(buffer);
+
+	crtoffset = 16 + numtiles * (2 + 2 + 4);
+	for (i = 0; i < numtiles; i++)
+	{
+		Tiles.offset[i] = crtoffset;
+		crtoffset += Tiles.sizex[i] * Tiles.sizey[i];
+	}
+
+	if (crtoffset > (size_t)filesize)
+	{
+		printf("error: invalid ART file: tile data runs past the end of the file\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool GrowTileTable(tiletable_t* table, uint32_t count)
+{
+	uint32_t newcapacity;
+	void* p;
+
+	if (count <= table->capacity)
+		return true;
+	if (count > MAX_TILE_NUMBER + 1)
+		return false;
+
+	newcapacity = table->capacity ? table->capacity : 256;
+	while (newcapacity < count)
+		newcapacity *= 2;
+
+	if ((p = realloc(table->sizex, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	table->sizex = p;
+	if ((p = realloc(table->sizey, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	table->sizey = p;
+	if ((p = realloc(table->animdata, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	table->animdata = p;
+	if ((p = realloc(table->offset, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	table->offset = p;
+
+	table->capacity = newcapacity;
+	return true;
+}
+
+static uint64_t HashTile(uint16_t sizex, uint16_t sizey, const uint8_t* pixels, uint32_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)sizex << 16) ^ sizey;
+	uint64_t w;
+	uint32_t i;
+
+	// eight bytes at a time, multiply-rotate mixing
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&w, &pixels[i], 8);
+		h ^= w * 0x87C37B91114253D5ULL;
+		h = ((h << 31) | (h >> 33)) * 0x4CF5AD432745937FULL;
+	}
+
+	w = 0;
+	memcpy(&w, &pixels[i], len - i);
+	h ^= (w * 0x87C37B91114253D5ULL) ^ len;
+
+	// final avalanche so the low bits can index the table
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	return h ? h : 1;
+}
+
+static bool WriteManifest(const char* manifestname)
+{
+	FILE* manifestfile;
+	bool ok;
+
+	manifestfile = fopen(manifestname, "wt");
+	if (manifestfile == NULL)
+	{
+		printf("Error: cannot create animation manifest %s\n", manifestname);
+		return false;
+	}
+
+	fprintf(manifestfile,
+		"{\n"
+		"\t\"creator\": \"art2png version " VERSION "\",\n"
+		"\t\"version\": 1,\n"
+		"\t\"tiles\": [\n");
+	if (manifest.length != 0)
+		fwrite(manifest.data, 1, manifest.length, manifestfile);
+	fprintf(manifestfile, "%s\t]\n}\n", manifesttiles != 0 ? "\n" : "");
+
+	ok = !ferror(manifestfile);
+	if (fclose(manifestfile) != 0 || !ok)
+	{
+		printf("Error: cannot write animation manifest %s\n", manifestname);
+		return false;
+	}
+
+	printf("%u animated tiles written to %s\n\n", manifesttiles, manifestname);
+	return true;
+}
+
+static bool AddPlanTiles(void)
+{
+	uint32_t i, newcapacity;
+	uint32_t* p;
+
+	if (tilestartnum + numtiles > MAX_TILE_NUMBER + 1)
+	{
+		printf("error: tile numbers past %u\n", MAX_TILE_NUMBER);
+		return false;
+	}
+
+	if (tilestartnum + numtiles > plancapacity)
+	{
+		newcapacity = plancapacity ? plancapacity : 256;
+		while (newcapacity < tilestartnum + numtiles)
+			newcapacity *= 2;
+		p = realloc(planpixels, newcapacity * sizeof(uint32_t));
+		if (p == NULL)
+		{
+			printf("error: cannot alloc enough memory for the shard plan\n");
+			return false;
+		}
+		memset(&p[plancapacity], 0, (newcapacity - plancapacity) * sizeof(uint32_t));
+		planpixels = p;
+		plancapacity = newcapacity;
+	}
+
+	for (i = 0; i < numtiles; i++)
+		planpixels[tilestartnum + i] = Tiles.sizex[i] * Tiles.sizey[i];
+	if (tilestartnum + numtiles > plantiles)
+		plantiles = tilestartnum + numtiles;
+
+	return true;
+}
+
+static bool WriteShardPlan(const char* planname)
+{
+	FILE* planfile;
+	uint64_t total, done;
+	uint32_t shard, first, last, count;
+	bool ok;
+
+	count = plancount;
+	if (count > plantiles)
+	{
+		printf("warning: only %u tiles, planning %u shards\n", plantiles, plantiles);
+		count = plantiles;
+	}
+
+	planfile = fopen(planname, "wt");
+	if (planfile == NULL)
+	{
+		printf("error: cannot create shard plan %s\n", planname);
+		return false;
+	}
+
+	for (total = 0, last = 0; last < plantiles; last++)
+		total += planpixels[last];
+
+	fprintf(planfile,
+		"; shard plan written by art2png version " VERSION "\n"
+		"; run art2png --shard k for every shard with the same arguments, then --merge\n"
+		"\n"
+		"[shards]\n"
+		"    Count=%u\n"
+		"    Pixels=%" PRIu64 "\n"
+		"\n",
+		count, total);
+
+	// each shard ends once it has its share of the pixels, the cuts only
+	// depend on the tile sizes so every run of the plan agrees on them
+	first = 0;
+	done = 0;
+	for (shard = 0; shard < count; shard++)
+	{
+		last = first;
+		done += planpixels[first];
+		while (last + 1 < plantiles && plantiles - (last + 1) > count - shard - 1 &&
+			(shard + 1 == count || done + planpixels[last + 1] <= total * (shard + 1) / count))
+		{
+			last++;
+			done += planpixels[last];
+		}
+
+		fprintf(planfile,
+			"[shard%u]\n"
+			"    FirstTile=%u\n"
+			"    LastTile=%u\n"
+			"\n",
+			shard, first, last);
+		printf("shard %u: tiles %u-%u\n", shard, first, last);
+		first = last + 1;
+	}
+
+	ok = !ferror(planfile);
+	if (fclose(planfile) != 0 || !ok)
+	{
+		printf("error: cannot write shard plan %s\n", planname);
+		return false;
+	}
+
+	printf("\n%u shards planned in %s\n\n", count, planname);
+	return true;
+}
+
+static bool ReadShardPlan(const char* planname, uint32_t shard, uint32_t* first, uint32_t* last, uint32_t* count)
+{
+	FILE* planfile;
+	char line[256];
+	uint32_t value;
+	int32_t section = -1;		// shard of the current section, -1 outside of one
+	bool foundfirst = false, foundlast = false;
+
+	planfile = fopen(planname, "rt");
+	if (planfile == NULL)
+	{
+		printf("error: cannot open shard plan %s, run --plan first\n", planname);
+		return false;
+	}
+
+	*count = 0;
+	while (fgets(line, sizeof(line), planfile) != NULL)
+	{
+		if (sscanf(line, " [shard%u]", &value) == 1)
+			section = value;
+		else if (line[strspn(line, " \t")] == '[')
+			section = -1;
+		else if (sscanf(line, " Count=%u", &value) == 1)
+			*count = value;
+		else if (section == (int32_t)shard && sscanf(line, " FirstTile=%u", first) == 1)
+			foundfirst = true;
+		else if (section == (int32_t)shard && sscanf(line, " LastTile=%u", last) == 1)
+			foundlast = true;
+	}
+	fclose(planfile);
+
+	if (*count == 0 || (shard < *count && (!foundfirst || !foundlast)))
+	{
+		printf("error: %s is not a valid shard plan\n", planname);
+		return false;
+	}
+	if (shard >= *count)
+	{
+		printf("error: the plan only has shards 0 to %u\n", *count - 1);
+		return false;
+	}
+
+	return true;
+}
+
+static bool InitJobQueue(jobqueue_t* q, uint32_t depth)
+{
+	uint32_t i, size;
+
+	// the cell index wraps with a mask, so the size is a power of two
+	for (size = 2; size < depth; size *= 2)
+		;
+
+	q->cells = malloc(size * sizeof(queuecell_t));
+	if (q->cells == NULL)
+		return false;
+
+	for (i = 0; i < size; i++)
+		q->cells[i].sequence = i;
+	q->mask = size - 1;
+	q->enqueuepos = 0;
+	q->dequeuepos = 0;
+
+	return true;
+}
+
+static bool LinkPNG(const char* srcname, const char* dupname)
+{
+	FILE* src;
+	FILE* dst;
+	char buffer[65536];
+	size_t len;
+	bool ok = true;
+
+	remove(dupname);
+
+#ifndef _WIN32
+	if (dedupmode == DEDUP_LINK && link(srcname, dupname) == 0)
+		return true;
+#endif
+
+	src = fopen(srcname, "rb");
+	if (src == NULL)
+		return false;
+
+	dst = fopen(dupname, "wb");
+	if (dst == NULL)
+	{
+		fclose(src);
+		return false;
+	}
+
+#ifdef FICLONE
+	// shares the blocks of the first PNG until one of them is edited
+	if (ioctl(fileno(dst), FICLONE, fileno(src)) == 0)
+	{
+		fclose(src);
+		return fclose(dst) == 0;
+	}
+#endif
+
+	// no link or clone possible here, a plain copy still beats encoding
+	while ((len = fread(buffer, 1, sizeof(buffer), src)) > 0)
+		if (fwrite(buffer, 1, len, dst) != len)
+			ok = false;
+
+	fclose(src);
+	if (fclose(dst) != 0)
+		ok = false;
+
+	return ok;
+}
+
+static bool LoadPalette(char *pfname)
+{
+	// variables
+	FILE* pfile;
+
+	uint32_t i;
+	uint8_t color;
+
+	pfile = fopen(pfname, "rb");
+	if (pfile == NULL)
+	{
+		printf("warning: cannot open palette.dat\n");
+		return false;
+	}
+
+	// read palette
+	if (fread(palette, 1, PALETTE_SIZE, pfile) != PALETTE_SIZE)
+	{
+		printf("warning: cannot read the whole palette from palette.dat file\n");
+		fclose(pfile);
+		return false;
+	}
+
+	for (i = 0; i < PALETTE_SIZE; i += 3)
+	{
+		rgbpal[i/3].rgbRed = palette[i] * 4;
+		rgbpal[i/3].rgbGreen = palette[i + 1] * 4;
+		rgbpal[i/3].rgbBlue = palette[i + 2] * 4;
+	}
+
+	fclose(pfile);
+	return true;
+}
+
+static bool LoadExportPalettes(const char* pfname, const char* lookupname, const char* list)
+{
+	char names[FILENAME_MAX];
+	char name[16];
+	char* token;
+	uint8_t* paldat;
+	uint8_t* lookup = NULL;
+	uint32_t palsize, lookupsize = 0;
+	uint32_t numshades = 0, numswaps = 0, numlookuppals = 0;
+	uint32_t number, i, pi, swaps = 0;
+	int namelen;
+	bool ok = true;
+
+	paldat = ReadWholeFile(pfname, &palsize);
+	if (paldat == NULL || palsize < PALETTE_SIZE)
+	{
+		printf("error: cannot read the palette from %s\n", pfname);
+		free(paldat);
+		return false;
+	}
+
+	// PALETTE.DAT: palette, number of shades (2 bytes), a 256 byte table per shade
+	if (palsize >= PALETTE_SIZE + 2)
+	{
+		numshades = GetLittleEndianUInt16(&paldat[PALETTE_SIZE]);
+		if (numshades > (palsize - PALETTE_SIZE - 2) / SHADE_SIZE)
+			numshades = (palsize - PALETTE_SIZE - 2) / SHADE_SIZE;
+	}
+
+	// LOOKUP.DAT: count, (id, 256 byte table) for each palswap, then the
+	// water, night, title and boss1 palettes
+	if (lookupname != NULL)
+	{
+		lookup = ReadWholeFile(lookupname, &lookupsize);
+		if (lookup == NULL || lookupsize == 0)
+		{
+			printf("error: cannot read %s\n", lookupname);
+			free(lookup);
+			free(paldat);
+			return false;
+		}
+		numswaps = lookup[0];
+		if (numswaps > (lookupsize - 1) / (SHADE_SIZE + 1))
+			numswaps = (lookupsize - 1) / (SHADE_SIZE + 1);
+		swaps = 1 + numswaps * (SHADE_SIZE + 1);
+		numlookuppals = (lookupsize - swaps) / PALETTE_SIZE;
+		if (numlookuppals > NUM_LOOKUP_PALETTES)
+			numlookuppals = NUM_LOOKUP_PALETTES;
+	}
+
+	sprintf(names, "%.*s", FILENAME_MAX - 1, list);
+	for (token = strtok(names, ","); token != NULL && ok; token = strtok(NULL, ","))
+	{
+		namelen = 0;
+		for (pi = 0; pi < NUM_LOOKUP_PALETTES && strcmp(token, lookuppalettes[pi]) != 0; pi++)
+			;
+
+		if (strcmp(token, "shades") == 0)
+		{
+			for (i = 0; i < numshades && ok; i++)
+			{
+				sprintf(name, "shade%u", i);
+				ok = AddExportPalette(name, paldat, &paldat[PALETTE_SIZE + 2 + i * SHADE_SIZE]);
+			}
+		}
+		else if (sscanf(token, "shade%u%n", &number, &namelen) == 1 && token[namelen] == '\0')
+		{
+			if (number < numshades)
+				ok = AddExportPalette(token, paldat, &paldat[PALETTE_SIZE + 2 + number * SHADE_SIZE]);
+			else
+			{
+				printf("error: %s has no shade %u\n", pfname, number);
+				ok = false;
+			}
+		}
+		else if (lookup == NULL && (strncmp(token, "swap", 4) == 0 || pi < NUM_LOOKUP_PALETTES))
+		{
+			printf("error: palette %s needs --lookup\n", token);
+			ok = false;
+		}
+		else if (strcmp(token, "swaps") == 0)
+		{
+			for (i = 0; i < numswaps && ok; i++)
+			{
+				sprintf(name, "swap%u", lookup[1 + i * (SHADE_SIZE + 1)]);
+				ok = AddExportPalette(name, paldat, &lookup[2 + i * (SHADE_SIZE + 1)]);
+			}
+		}
+		else if (sscanf(token, "swap%u%n", &number, &namelen) == 1 && token[namelen] == '\0')
+		{
+			for (i = 0; i < numswaps && lookup[1 + i * (SHADE_SIZE + 1)] != number; i++)
+				;
+			if (i < numswaps)
+				ok = AddExportPalette(token, paldat, &lookup[2 + i * (SHADE_SIZE + 1)]);
+			else
+			{
+				printf("error: palswap %u not found in %s\n", number, lookupname);
+				ok = false;
+			}
+		}
+		else if (pi < numlookuppals)
+			ok = AddExportPalette(token, &lookup[swaps + pi * PALETTE_SIZE], NULL);
+		else
+		{
+			if (pi < NUM_LOOKUP_PALETTES)
+				printf("error: %s has no %s palette\n", lookupname, token);
+			else
+				printf("error: unknown palette %s\n", token);
+			ok = false;
+		}
+	}
+
+	free(lookup);
+	free(paldat);
+	return ok;
+}
+
+static bool AddExportPalette(const char* name, const uint8_t* colors, const uint8_t* map)
+{
+	exportpalette_t* newpals;
+	exportpalette_t* pal;
+	uint32_t i, c;
+
+	newpals = realloc(exportpals, (numexportpals + 1) * sizeof(exportpalette_t));
+	if (newpals == NULL)
+	{
+		printf("error: not enough memory for palette %s\n", name);
+		return false;
+	}
+	exportpals = newpals;
+	pal = &exportpals[numexportpals++];
+
+	sprintf(pal->name, "%.15s", name);
+	for (i = 0; i < 256; i++)
+	{
+		c = (map != NULL ? map[i] : i) * 3;
+		pal->colors[i].rgbRed = colors[c] * 4;
+		pal->colors[i].rgbGreen = colors[c + 1] * 4;
+		pal->colors[i].rgbBlue = colors[c + 2] * 4;
+		pal->colors[i].rgbReserved = 0;
+	}
+
+	return true;
+}
+
+static uint8_t* ReadWholeFile(const char* filename, uint32_t* size)
+{
+	FILE* file;
+	uint8_t* data;
+	long length;
+
+	file = fopen(filename, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = length >= 0 ? malloc(length + 1) : NULL;
+	if (data == NULL || fread(data, 1, length, file) != (size_t)length)
+	{
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+
+	fclose(file);
+	*size = (uint32_t)length;
+	return data;
+}
+
+static uint32_t FindPNGChunk(const uint8_t* data, uint32_t size, const char* type, uint32_t* length)
+{
+	uint32_t pos = 8;			// past the signature
+	uint32_t len;
+
+	// length, type, data, crc
+	while (pos + 12 <= size)
+	{
+		len = GetBigEndianUInt32(&data[pos]);
+		if (len > size - pos - 12)
+			return 0;
+		if (memcmp(&data[pos + 4], type, 4) == 0)
+		{
+			*length = len;
+			return pos;
+		}
+		pos += 12 + len;
+	}
+
+	return 0;
+}
+
+static bool WritePaletteVariants(const tilejob_t* job, const uint8_t* data, uint32_t size)
+{
+	char name[FILENAME_MAX];
+	uint8_t* variant;
+	uint32_t i;
+	bool ok = true;
+
+	variant = malloc(size);
+	if (variant == NULL)
+	{
+		printf("error: not enough memory to write the palettes of %s\n", job->name);
+		return false;
+	}
+	memcpy(variant, data, size);
+
+	for (i = 0; i < numexportpals; i++)
+	{
+		if (!SetPNGPalette(variant, size, exportpals[i].colors))
+		{
+			printf("error: cannot find the palette of %s\n", job->name);
+			ok = false;
+			break;
+		}
+
+		sprintf(name, "%s/%s", exportpals[i].name, job->name);
+		if (!WriteOutput(name, variant, size, false))
+			ok = false;
+	}
+
+	free(variant);
+	return ok;
+}
+
+static bool SetPNGPalette(uint8_t* data, uint32_t size, const RGBQUAD* colors)
+{
+	uint32_t pos, length, c;
+
+	pos = FindPNGChunk(data, size, "PLTE", &length);
+	if (pos == 0 || length % 3 != 0 || length > PALETTE_SIZE)
+		return false;
+
+	// the tRNS chunk goes by index, only the colors and their crc change
+	for (c = 0; c < length / 3; c++)
+	{
+		data[pos + 8 + c * 3] = colors[c].rgbRed;
+		data[pos + 8 + c * 3 + 1] = colors[c].rgbGreen;
+		data[pos + 8 + c * 3 + 2] = colors[c].rgbBlue;
+	}
+	SetBigEndianUInt32(FreeImage_ZLibCRC32(0, &data[pos + 4], length + 4), &data[pos + 8 + length]);
+
+	return true;
+}
+
+static bool LinkPaletteVariants(const tilejob_t* job)
+{
+	char name[FILENAME_MAX];
+	char linkname[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	char srcname[FILENAME_MAX];
+	uint32_t i;
+	bool ok = true;
+
+	for (i = 0; i < numexportpals; i++)
+	{
+		sprintf(name, "%s/%s", exportpals[i].name, job->name);
+		sprintf(linkname, "%s/%s", exportpals[i].name, job->linkname);
+
+		if (tarfile != NULL)
+		{
+			if (!WriteTarEntry(name, NULL, 0, linkname))
+				ok = false;
+			continue;
+		}
+
+		sprintf(srcname, "%s%s%s", outputdir, PATH_DELIMITER, linkname);
+		sprintf(path, "%s%s%s", outputdir, PATH_DELIMITER, name);
+		if (!LinkPNG(srcname, path))
+		{
+			printf("error: cannot write %s\n", path);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static bool LoadServeFile(const char* artname)
+{
+	servetile_t* newtiles;
+	servetile_t* st;
+	uint8_t* image;
+	uint32_t i;
+	long filesize;
+
+	artfile = fopen(artname, "rb");
+	if (artfile == NULL)
+	{
+		printf("error: cannot open %s\n", artname);
+		return false;
+	}
+
+	if (!GetPicturesList())
+	{
+		fclose(artfile);
+		return false;
+	}
+
+	if (tilestartnum > MAX_TILE_NUMBER || numtiles > MAX_TILE_NUMBER + 1 - tilestartnum)
+	{
+		printf("error: %s has tile numbers past %u\n", artname, MAX_TILE_NUMBER);
+		fclose(artfile);
+		return false;
+	}
+
+	fseek(artfile, 0, SEEK_END);
+	filesize = ftell(artfile);
+	image = MapArtFile(artfile, (size_t)filesize);
+	fclose(artfile);
+	if (image == NULL)
+	{
+		printf("error: cannot map %s\n", artname);
+		return false;
+	}
+
+	if (tilestartnum + numtiles > numservetiles)
+	{
+		newtiles = realloc(servetiles, (tilestartnum + numtiles) * sizeof(servetile_t));
+		if (newtiles == NULL)
+		{
+			printf("error: cannot alloc enough memory for %u tiles\n", tilestartnum + numtiles);
+			return false;
+		}
+		memset(&newtiles[numservetiles], 0, (tilestartnum + numtiles - numservetiles) * sizeof(servetile_t));
+		servetiles = newtiles;
+		numservetiles = tilestartnum + numtiles;
+	}
+
+	// the file stays mapped for as long as the server runs
+	for (i = 0; i < numtiles; i++)
+	{
+		st = &servetiles[tilestartnum + i];
+		st->sizex = Tiles.sizex[i];
+		st->sizey = Tiles.sizey[i];
+		st->animdata = Tiles.animdata[i];
+		st->pixels = Tiles.sizex[i] != 0 && Tiles.sizey[i] != 0 ? &image[Tiles.offset[i]] : NULL;
+	}
+
+	return true;
+}
+
+static uint8_t* MapArtFile(FILE* file, size_t size)
+{
+	uint8_t* image;
+
+#ifdef _WIN32
+	image = malloc(size);
+	fseek(file, 0, SEEK_SET);
+	if (image != NULL && fread(image, 1, size, file) != size)
+	{
+		free(image);
+		image = NULL;
+	}
+#else
+	image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (image == MAP_FAILED)
+		image = NULL;
+#endif
+
+	return image;
+}
+
+static bool ServeTiles(void)
+{
+	struct sockaddr_in addr;
+	pthread_t* servers;
+	uint32_t i, count, tiles;
+	int yes = 1;
+
+#ifdef _WIN32
+	WSADATA wsadata;
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsadata) != 0)
+	{
+		printf("error: cannot start winsock\n");
+		return false;
+	}
+#else
+	// a browser dropping a connection halfway shouldn't end the server
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	serversocket = socket(AF_INET, SOCK_STREAM, 0);
+	if (serversocket == INVALID_SOCKET)
+	{
+		printf("error: cannot create a socket\n");
+		return false;
+	}
+	setsockopt(serversocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+	// only 127.0.0.1, it is a tool for a local checkout
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)serveport);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(serversocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(serversocket, 64) != 0)
+	{
+		printf("error: cannot listen on port %u\n", serveport);
+		CloseSocket(serversocket);
+		return false;
+	}
+
+	for (tiles = 0, i = 0; i < numservetiles; i++)
+		tiles += servetiles[i].pixels != NULL;
+	printf("serving %u tiles on http://127.0.0.1:%u/, cache of %" PRIu64 " bytes\n", tiles, serveport, cachelimit);
+	fflush(stdout);
+
+	// every thread accepts and answers connections of its own, the main
+	// thread is one of them
+	count = numencoders != 0 ? numencoders : 1;
+	servers = malloc(count * sizeof(pthread_t));
+	if (servers == NULL)
+		count = 1;
+	for (i = 1; i < count; i++)
+		if (pthread_create(&servers[i], NULL, ServerThread, NULL) != 0)
+			break;
+
+	ServerThread(NULL);
+	return true;
+}
+
+static void* ServerThread(void* arg)
+{
+	socket_t client;
+
+	(void)arg;
+
+	for (;;)
+	{
+		client = accept(serversocket, NULL, NULL);
+		if (client == INVALID_SOCKET)
+			continue;
+
+		HandleRequest(client);
+		CloseSocket(client);
+	}
+
+	return NULL;
+}
+
+static void HandleRequest(socket_t client)
+{
+	static const char notfound[] = "not found\n";
+	static const char index[] =
+		"art2png tile server\n\n"
+		"/tiles.json            size and animation data of every tile, and the palettes\n"
+		"/tile/<n>.json         size and animation data of tile n\n"
+		"/tile/<n>.png          tile n as a png\n"
+		"/tile/<n>.png?pal=<k>  tile n in palswap k or a palette from --palettes\n";
+	char request[HTTP_REQUEST_SIZE];
+	char path[256];
+	char* query;
+	textbuf_t text = {NULL, 0, 0};
+	uint8_t* png;
+	uint32_t len = 0, size, tilenum, i;
+	int32_t pal;
+	int got, namelen;
+	bool ok = true;
+
+	// the request line and the headers, a GET has no body
+	request[0] = '\0';
+	while (len < sizeof(request) - 1 &&
+		(got = recv(client, request + len, sizeof(request) - 1 - len, 0)) > 0)
+	{
+		len += got;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	if (sscanf(request, "GET %255s", path) != 1)
+	{
+		SendResponse(client, "405 Method Not Allowed", "text/plain", (const uint8_t*)"only GET\n", 9);
+		return;
+	}
+
+	query = strchr(path, '?');
+	if (query != NULL)
+		*query++ = '\0';
+
+	namelen = 0;
+	if (strcmp(path, "/") == 0)
+	{
+		SendResponse(client, "200 OK", "text/plain", (const uint8_t*)index, sizeof(index) - 1);
+	}
+	else if (strcmp(path, "/tiles.json") == 0)
+	{
+		ok &= AppendText(&text, "{\n\t\"palettes\": [");
+		for (i = 0; i < numexportpals; i++)
+			ok &= AppendText(&text, "%s\"%s\"", i != 0 ? ", " : "", exportpals[i].name);
+		ok &= AppendText(&text, "],\n\t\"tiles\": [\n");
+		for (size = 0, i = 0; i < numservetiles; i++)
+		{
+			if (servetiles[i].pixels == NULL && servetiles[i].animdata == 0)
+				continue;
+			ok &= AppendText(&text, "%s\t\t", size++ != 0 ? ",\n" : "");
+			ok &= AppendServeTile(&text, i);
+		}
+		ok &= AppendText(&text, "\n\t]\n}\n");
+
+		if (ok)
+			SendResponse(client, "200 OK", "application/json", (const uint8_t*)text.data, text.length);
+		else
+			SendResponse(client, "500 Internal Server Error", "text/plain", (const uint8_t*)"out of memory\n", 14);
+		free(text.data);
+	}
+	else if (sscanf(path, "/tile/%u.json%n", &tilenum, &namelen) == 1 && namelen > 0 && path[namelen] == '\0')
+	{
+		if (tilenum < numservetiles && AppendServeTile(&text, tilenum) && AppendText(&text, "\n"))
+			SendResponse(client, "200 OK", "application/json", (const uint8_t*)text.data, text.length);
+		else
+			SendResponse(client, "404 Not Found", "text/plain", (const uint8_t*)notfound, sizeof(notfound) - 1);
+		free(text.data);
+	}
+	else if (sscanf(path, "/tile/%u.png%n", &tilenum, &namelen) == 1 && namelen > 0 && path[namelen] == '\0')
+	{
+		pal = FindServePalette(query);
+		if (tilenum >= numservetiles || servetiles[tilenum].pixels == NULL || pal < 0)
+		{
+			SendResponse(client, "404 Not Found", "text/plain", (const uint8_t*)notfound, sizeof(notfound) - 1);
+			return;
+		}
+
+		png = GetTilePNG(tilenum, &size);
+		if (png == NULL || (pal > 0 && !SetPNGPalette(png, size, exportpals[pal - 1].colors)))
+			SendResponse(client, "500 Internal Server Error", "text/plain", (const uint8_t*)"cannot encode\n", 14);
+		else
+			SendResponse(client, "200 OK", "image/png", png, size);
+		free(png);
+	}
+	else
+	{
+		SendResponse(client, "404 Not Found", "text/plain", (const uint8_t*)notfound, sizeof(notfound) - 1);
+	}
+}
+
+static uint8_t* GetTilePNG(uint32_t tilenum, uint32_t* size)
+{
+	const servetile_t* st = &servetiles[tilenum];
+	cachedpng_t* entry;
+	cachedpng_t* old;
+	tilejob_t job;
+	uint8_t* copy = NULL;
+	BYTE* data;
+	DWORD datasize;
+
+	pthread_mutex_lock(&cachelock);
+	entry = st->png;
+	if (entry != NULL)
+	{
+		// to the front of the list
+		if (entry != cachehead)
+		{
+			entry->prev->next = entry->next;
+			if (entry->next != NULL)
+				entry->next->prev = entry->prev;
+			else
+				cachetail = entry->prev;
+			entry->prev = NULL;
+			entry->next = cachehead;
+			cachehead->prev = entry;
+			cachehead = entry;
+		}
+
+		copy = malloc(entry->size);
+		if (copy != NULL)
+		{
+			memcpy(copy, entry->data, entry->size);
+			*size = entry->size;
+		}
+		pthread_mutex_unlock(&cachelock);
+		return copy;
+	}
+	pthread_mutex_unlock(&cachelock);
+
+	// encoded outside the lock, the other threads keep serving meanwhile
+	memset(&job, 0, sizeof(job));
+	job.kind = JOB_PNG;
+	job.sizex = st->sizex;
+	job.sizey = st->sizey;
+	job.data = (uint8_t*)st->pixels;
+	job.size = st->sizex * st->sizey;
+	if (!SpawnPNG(&job) || !FreeImage_AcquireMemory(job.png, &data, &datasize) ||
+		(copy = malloc(datasize)) == NULL)
+	{
+		if (job.png != NULL)
+			FreeImage_CloseMemory(job.png);
+		return NULL;
+	}
+	memcpy(copy, data, datasize);
+	*size = datasize;
+
+	entry = datasize <= cachelimit ? malloc(sizeof(cachedpng_t) + datasize) : NULL;
+	if (entry != NULL)
+	{
+		entry->data = (uint8_t*)(entry + 1);
+		entry->tilenum = tilenum;
+		entry->size = datasize;
+		memcpy(entry->data, data, datasize);
+	}
+	FreeImage_CloseMemory(job.png);
+
+	if (entry == NULL)
+		return copy;
+
+	pthread_mutex_lock(&cachelock);
+	if (servetiles[tilenum].png != NULL)
+	{
+		// another thread got there first
+		pthread_mutex_unlock(&cachelock);
+		free(entry);
+		return copy;
+	}
+
+	entry->prev = NULL;
+	entry->next = cachehead;
+	if (cachehead != NULL)
+		cachehead->prev = entry;
+	else
+		cachetail = entry;
+	cachehead = entry;
+	servetiles[tilenum].png = entry;
+	cachebytes += datasize;
+
+	// drop the least recently used PNGs until it fits again
+	while (cachebytes > cachelimit && cachetail != NULL)
+	{
+		old = cachetail;
+		cachetail = old->prev;
+		if (cachetail != NULL)
+			cachetail->next = NULL;
+		else
+			cachehead = NULL;
+		servetiles[old->tilenum].png = NULL;
+		cachebytes -= old->size;
+		free(old);
+	}
+	pthread_mutex_unlock(&cachelock);
+
+	return copy;
+}
+
+static int32_t FindServePalette(const char* query)
+{
+	const char* value;
+	char name[16];
+	uint32_t i, len, number;
+
+	// pal=<k> anywhere in the query, no pal is the palette of the set
+	for (value = query; value != NULL; value = strchr(value, '&'))
+	{
+		if (*value == '&')
+			value++;
+		if (strncmp(value, "pal=", 4) == 0)
+			break;
+	}
+	if (value == NULL)
+		return 0;
+	value += 4;
+
+	len = strcspn(value, "&");
+	if (len == 0 || len >= sizeof(name))
+		return -1;
+	sprintf(name, "%.*s", (int)len, value);
+
+	// a number is a palswap of LOOKUP.DAT like the pal of a sprite
+	if (strspn(name, "0123456789") == len)
+	{
+		number = (uint32_t)atoi(name);
+		if (number == 0)
+			return 0;
+		sprintf(name, "swap%u", number);
+	}
+
+	for (i = 0; i < numexportpals; i++)
+		if (strcmp(exportpals[i].name, name) == 0)
+			return i + 1;
+
+	return -1;
+}
+
+static bool AppendServeTile(textbuf_t* tb, uint32_t tilenum)
+{
+	const uint32_t animdata = servetiles[tilenum].animdata;
+
+	// the same fields as the manifest
+	return AppendText(tb,
+		"{\"tile\": %u, \"width\": %u, \"height\": %u, \"frames\": %u, \"type\": \"%s\", \"speed\": %u, "
+		"\"xoffset\": %d, \"yoffset\": %d, \"flags\": %u}",
+		tilenum,
+		servetiles[tilenum].sizex,
+		servetiles[tilenum].sizey,
+		animdata & 0x3F,
+		animtypes[(animdata >> 6) & 0x03],
+		(animdata >> 24) & 0x0F,
+		(int8_t)((animdata >> 8) & 0xFF),
+		(int8_t)((animdata >> 16) & 0xFF),
+		animdata >> 28);
+}
+
+static bool SendResponse(socket_t client, const char* status, const char* type, const uint8_t* data, uint32_t size)
+{
+	char header[256];
+	int len;
+
+	len = sprintf(header,
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %u\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		status, type, size);
+
+	return SendAll(client, (const uint8_t*)header, len) && SendAll(client, data, size);
+}
+
+static bool SendAll(socket_t client, const uint8_t* data, uint32_t size)
+{
+	int sent;
+
+	while (size > 0)
+	{
+		sent = send(client, (const char*)data, size, 0);
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= sent;
+	}
+
+	return true;
+}
+
+static uint64_t ParseByteCount(const char* str)
+{
+	char* end;
+	uint64_t count;
+
+	count = strtoull(str, &end, 10);
+	switch (*end)
+	{
+	case 'g': case 'G':
+		count *= 1024;
+		// fall through
+	case 'm': case 'M':
+		count *= 1024;
+		// fall through
+	case 'k': case 'K':
+		count *= 1024;
+		break;
+	}
+
+	return count;
+}
+
+int main (int argc, char* argv[])
+{
+	char* numarg;
+	char* palfilestr;
+	char* dirinstr;
+	char* diroutstr;
+	char* reportstr = NULL;
+	char* manifeststr = NULL;
+	char* tarstr = NULL;
+	char* palettesstr = NULL;
+	char* lookupstr = NULL;
+	char* isastr = NULL;
+	char* batchstr = NULL;
+	char* positional[4];
+	uint32_t npositional = 0;
+	int argi;
+	char cdout[FILENAME_MAX];
+	char currfile[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	char cwd[FILENAME_MAX];
+	char palfile[FILENAME_MAX];
+	char dirout[FILENAME_MAX];
+	char dirin[FILENAME_MAX];
+	char planfile[FILENAME_MAX];
+	struct stat st;
+	FILE* markerfile;
+	uint32_t shardcount = 0;
+	uint32_t artn;
+	uint32_t extpos = 8;
+	uint32_t artcount;
+	int32_t threads = -1;
+
+	for (argi = 1; argi < argc; argi++)
+	{
+		if (strcmp(argv[argi], "--dedup") == 0)
+		{
+			finddups = true;
+			dedupmode = DEDUP_LINK;
+			if (argi + 1 < argc && strcmp(argv[argi + 1], "link") == 0)
+				argi++;
+			else if (argi + 1 < argc && strcmp(argv[argi + 1], "reflink") == 0)
+			{
+				dedupmode = DEDUP_REFLINK;
+				argi++;
+			}
+		}
+		else if (strcmp(argv[argi], "--dedup-report") == 0 && argi + 1 < argc)
+		{
+			finddups = true;
+			reportstr = argv[++argi];
+		}
+		else if (strcmp(argv[argi], "--out-tar") == 0 && argi + 1 < argc)
+		{
+			tarstr = argv[++argi];
+			if (strcmp(tarstr, "-") == 0 && tarfile == NULL)
+			{
+				// the stream gets the real stdout, our messages go to stderr
+				fflush(stdout);
+				tarfile = fdopen(dup(fileno(stdout)), "wb");
+				dup2(fileno(stderr), fileno(stdout));
+#ifdef _WIN32
+				if (tarfile != NULL)
+					_setmode(_fileno(tarfile), _O_BINARY);
+#endif
+			}
+		}
+		else if (strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc)
+			threads = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--queue-depth") == 0 && argi + 1 < argc)
+			queuedepth = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--max-memory") == 0 && argi + 1 < argc)
+			memorylimit = ParseByteCount(argv[++argi]);
+		else if (strcmp(argv[argi], "--manifest") == 0 && argi + 1 < argc)
+		{
+			writemanifest = true;
+			manifeststr = argv[++argi];
+		}
+		else if (strcmp(argv[argi], "--raw") == 0)
+		{
+			writeraw = true;
+			tileext = "raw";
+			if (argi + 1 < argc && strcmp(argv[argi + 1], "rle") == 0)
+			{
+				rawrle = true;
+				argi++;
+			}
+		}
+		else if (strcmp(argv[argi], "--row-major") == 0)
+			rawrows = true;
+		else if (strcmp(argv[argi], "--palettes") == 0 && argi + 1 < argc)
+			palettesstr = argv[++argi];
+		else if (strcmp(argv[argi], "--lookup") == 0 && argi + 1 < argc)
+			lookupstr = argv[++argi];
+		else if (strcmp(argv[argi], "--serve") == 0 && argi + 1 < argc)
+			serveport = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--cache-size") == 0 && argi + 1 < argc)
+			cachelimit = ParseByteCount(argv[++argi]);
+		else if (strcmp(argv[argi], "--plan") == 0 && argi + 1 < argc)
+			plancount = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--shard") == 0 && argi + 1 < argc)
+			shardnum = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--merge") == 0)
+			mergeshards = true;
+		else if (strcmp(argv[argi], "--isa") == 0 && argi + 1 < argc)
+			isastr = argv[++argi];
+		else if (strcmp(argv[argi], "--verify-roundtrip") == 0)
+			verifyroundtrip = true;
+		else if (strcmp(argv[argi], "--contact-sheet") == 0)
+			contactsheet = true;
+		else if (strcmp(argv[argi], "--sheet-tiles") == 0 && argi + 1 < argc)
+			sheettiles = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--thumb-size") == 0 && argi + 1 < argc)
+			thumbsize = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--thumb-filter") == 0 && argi + 1 < argc)
+		{
+			argi++;
+			thumbbox = strcmp(argv[argi], "box") == 0;
+			if (!thumbbox && strcmp(argv[argi], "nearest") != 0)
+			{
+				npositional = 0;
+				break;
+			}
+		}
+		else if (strcmp(argv[argi], "--batch") == 0 && argi + 1 < argc)
+			batchstr = argv[++argi];
+		else if (strcmp(argv[argi], "--apng") == 0)
+			writeapng = true;
+		else if (strcmp(argv[argi], "--upscale") == 0 && argi + 1 < argc)
+			upscale = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--upscale-filter") == 0 && argi + 1 < argc)
+		{
+			argi++;
+			upscalenearest = strcmp(argv[argi], "nearest") == 0;
+			if (!upscalenearest && strcmp(argv[argi], "scalex") != 0)
+			{
+				npositional = 0;
+				break;
+			}
+		}
+		else if (argv[argi][0] != '-' && npositional < 4)
+			positional[npositional++] = argv[argi];
+		else
+		{
+			npositional = 0;
+			break;
+		}
+	}
+
+	// header
+	printf("\n"
+			"Art2PNG version " VERSION " by SanyaWaffles\n"
+			"Based on Art2TGA by Mathieu Olivier\n"
+			"===================================\n\n"
+			);
+
+	// a tar stream replaces the output folder, the server and the round trip
+	// check have none. shards share the output folder, a tar can't be split that way.
+	// a batch takes everything but the shared settings from its job file
+	if (npositional != (batchstr != NULL ? 0 : tarstr != NULL || serveport != 0 || verifyroundtrip ? 3 : 4) ||
+		queuedepth == 0 ||
+		(plancount != 0) + (shardnum >= 0) + mergeshards > 1 ||
+		(tarstr != NULL && (plancount != 0 || shardnum >= 0 || mergeshards)) ||
+		(palettesstr != NULL && writeraw) || serveport > 65535 ||
+		(serveport != 0 && (tarstr != NULL || plancount != 0 || shardnum >= 0 || mergeshards || writeraw)) ||
+		(verifyroundtrip && (tarstr != NULL || serveport != 0 || plancount != 0 || shardnum >= 0 || mergeshards ||
+			writeraw || palettesstr != NULL || finddups || writemanifest)) ||
+		(contactsheet && (serveport != 0 || verifyroundtrip || plancount != 0 || shardnum >= 0 || mergeshards ||
+			writeraw || palettesstr != NULL || finddups || writemanifest)) || thumbsize == 0 || thumbsize > 1024 ||
+		upscale < 1 || upscale > 4 ||
+		(upscale > 1 && (writeraw || serveport != 0 || verifyroundtrip || contactsheet)) ||
+		(writeapng && (serveport != 0 || verifyroundtrip || contactsheet || upscale > 1)) ||
+		(batchstr != NULL && (tarstr != NULL || serveport != 0 || plancount != 0 || shardnum >= 0 || mergeshards ||
+			verifyroundtrip || contactsheet || palettesstr != NULL || finddups || writemanifest)))
+	{
+		printf("Syntax: art2png [options] <num> <palette> <folder in> <folder out>\n"
+				"	Extract pictures from art files in a folder to another folder as pngs\n"
+				"	eg: art2png 19 palette.dat folderin folderout\n"
+				"	options:\n"
+				"	--dedup [link|reflink]    write identical tiles once, link the other pngs to it\n"
+				"	--dedup-report <file>     list the identical tiles of the set in <file>\n"
+				"	--out-tar <file>          write a tar of the pngs and ini files instead of a\n"
+				"	                          folder out, - for stdout\n"
+				"	--threads <n>             png encoder threads, 0 for none (default: one per cpu)\n"
+				"	--queue-depth <n>         tiles waiting between the pipeline stages (default 64)\n"
+				"	--max-memory <bytes>      cap for the tiles in flight, K/M/G suffixes work\n"
+				"	--manifest <file>         write the animation data of the whole set to one json\n"
+				"	                          file instead of an adata ini per art file\n"
+				"	--raw [rle]               write raw palette indexes (tileNNNN.raw) instead of\n"
+				"	                          pngs, rle packs runs of the same index\n"
+				"	--row-major               store raw tiles row by row instead of column by column\n"
+				"	--palettes <list>         also write every png in these palettes, each into a\n"
+				"	                          subfolder: shadeN, shades, swapN, swaps, water,\n"
+				"	                          night, title, boss1 (comma separated)\n"
+				"	--lookup <file>           LOOKUP.DAT for the swap and water/night/title/boss1\n"
+				"	                          palettes\n"
+				"	--serve <port>            serve the tiles over http on 127.0.0.1 instead of\n"
+				"	                          writing them, leave folder out out\n"
+				"	--cache-size <bytes>      cap for the pngs the server keeps (default 64M)\n"
+				"	--plan <n>                split the set into n shards for separate runs, writes\n"
+				"	                          shards.ini to folder out\n"
+				"	--shard <k>               only write the pngs of shard k of the plan\n"
+				"	--merge                   write the animation data once every shard is done\n"
+				"	--isa <name>              pixel kernels to use: scalar, sse2, avx2 or avx512\n"
+				"	                          (default: the best the cpu can run)\n"
+				"	--verify-roundtrip        encode every tile and decode it again like png2art,\n"
+				"	                          in memory, and report what doesn't come back the\n"
+				"	                          same; leave folder out out\n"
+				"	--contact-sheet           write sheets of numbered thumbnails instead of the\n"
+				"	                          tiles, one per art file\n"
+				"	--sheet-tiles <n>         one contact sheet per n tiles instead\n"
+				"	--thumb-size <px>         largest thumbnail side (default 64)\n"
+				"	--thumb-filter <name>     box (average color, default) or nearest (pick a pixel)\n"
+				"	--upscale <n>             scale the pngs 2, 3 or 4 times, for hightile; the\n"
+				"	                          center offsets are scaled too\n"
+				"	--upscale-filter <name>   scalex (Scale2x/Scale3x, keeps the edges, default)\n"
+				"	                          or nearest (plain pixel repeat)\n"
+				"	--batch <file>            run the jobs listed in <file> in this one process,\n"
+				"	                          leave the other arguments out\n"
+				"	--apng                    also write every animation as one animated png,\n"
+				"	                          animNNNN.png after the tile that holds it\n");
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (!SelectArtKernels(isastr))
+	{
+		printf("error: --isa %s is unknown or this cpu can't run it\n", isastr);
+		return EXIT_FAILURE;
+	}
+
+	FreeImage_Initialise(0);
+
+	GetCurrentDir(cwd, sizeof(cwd));
+
+	if (threads < 0)
+	{
+		// one encoder per cpu, the reader and writer mostly wait on the disk
+#ifdef _WIN32
+		char* cpus = getenv("NUMBER_OF_PROCESSORS");
+		threads = cpus != NULL ? atoi(cpus) : 1;
+#else
+		threads = (int32_t)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads < 1)
+			threads = 1;
+	}
+	numencoders = threads;
+
+	if (batchstr != NULL)
+	{
+		sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, batchstr);
+		artn = RunBatch(path, cwd);
+		FreeImage_DeInitialise();
+		return artn ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	numarg = positional[0];
+	palfilestr = positional[1];
+	dirinstr = positional[2];
+	diroutstr = tarstr != NULL || serveport != 0 || verifyroundtrip ? "." : positional[3];
 
 	sprintf(palfile, "%s%s%s", cwd, PATH_DELIMITER, palfilestr);
 	sprintf(dirin, "%s%s%s", cwd, PATH_DELIMITER, dirinstr);
 	sprintf(dirout, "%s%s%s", cwd, PATH_DELIMITER, diroutstr);
+	outputdir = dirout;
+
+	if (tarstr != NULL && strcmp(tarstr, "-") != 0)
+	{
+		sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, tarstr);
+		tarfile = fopen(path, "wb");
+	}
+
+	if (tarstr != NULL && tarfile == NULL)
+	{
+		printf("error: cannot create tar stream %s\n", tarstr);
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	artcount = atoi(numarg);
+
+	if (!LoadPalette(palfile))
+	{
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (contactsheet)
+		SetSheetColors();
+
+	// the server knows every palswap, numbered like the pal of a sprite
+	if (serveport != 0 && palettesstr == NULL && lookupstr != NULL)
+		palettesstr = "swaps";
+
+	if (palettesstr != NULL)
+	{
+		if (lookupstr != NULL)
+			sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, lookupstr);
+		if (!LoadExportPalettes(palfile, lookupstr != NULL ? path : NULL, palettesstr))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+
+		// the tar gets the folders from the names of its entries
+		for (artn = 0; artn < numexportpals && tarfile == NULL && serveport == 0; artn++)
+		{
+			sprintf(path, "%s%s%s", dirout, PATH_DELIMITER, exportpals[artn].name);
+#ifdef _WIN32
+			_mkdir(path);
+#else
+			mkdir(path, 0777);
+#endif
+			if (stat(path, &st) != 0 || (st.st_mode & S_IFDIR) == 0)
+			{
+				printf("error: cannot create the folder %s\n", path);
+				FreeImage_DeInitialise();
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (serveport != 0)
+	{
+		for (artn = 0; artn <= artcount; artn++)
+		{
+			sprintf(currfile, "%s%sTILES%03u.ART", dirin, PATH_DELIMITER, artn);
+			if (!LoadServeFile(currfile))
+			{
+				FreeImage_DeInitialise();
+				return EXIT_FAILURE;
+			}
+		}
+
+		// only comes back when the server can't start
+		ServeTiles();
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	sprintf(planfile, "%s%sshards.ini", dirout, PATH_DELIMITER);
+
+	if (plancount != 0)
+	{
+		// only the headers are needed to weigh the tiles
+		for (artn = 0; artn <= artcount; artn++)
+		{
+			sprintf(currfile, "%s%sTILES%03u.ART", dirin, PATH_DELIMITER, artn);
+			artfile = fopen(currfile, "rb");
+			if (artfile == NULL || !GetPicturesList() || !AddPlanTiles())
+			{
+				if (artfile != NULL)
+					fclose(artfile);
+				FreeImage_DeInitialise();
+				return EXIT_FAILURE;
+			}
+			fclose(artfile);
+		}
+
+		FreeImage_DeInitialise();
+		return WriteShardPlan(planfile) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (shardnum >= 0 && !ReadShardPlan(planfile, shardnum, &shardfirst, &shardlast, &shardcount))
+	{
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (mergeshards)
+	{
+		if (!ReadShardPlan(planfile, 0, &shardfirst, &shardlast, &shardcount))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+
+		for (artn = 0; artn < shardcount; artn++)
+		{
+			sprintf(path, "%s%sshard%03u.done", dirout, PATH_DELIMITER, artn);
+			if ((markerfile = fopen(path, "rb")) == NULL)
+			{
+				printf("error: shard %u is not done yet\n", artn);
+				FreeImage_DeInitialise();
+				return EXIT_FAILURE;
+			}
+			fclose(markerfile);
+		}
+
+		// the pngs are all there, only the animation data is left
+		shardfirst = 1;
+		shardlast = 0;
+	}
+
+	if (!StartPipeline())
+	{
+		printf("error: cannot start the encoder threads\n");
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (!ExtractArtFiles(dirin, artcount))
+	{
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (!StopPipeline())
+	{
+		printf("error: some files could not be written\n");
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (verifyroundtrip)
+	{
+		printf("%u tiles checked, %u mismatches\n\n", verifiedtiles, mismatches);
+		FreeImage_DeInitialise();
+		return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (tarfile != NULL)
+	{
+		// a tar ends with two empty blocks
+		static const uint8_t endblocks[TAR_BLOCK_SIZE * 2];
+
+		if (fwrite(endblocks, 1, sizeof(endblocks), tarfile) != sizeof(endblocks) ||
+			fclose(tarfile) != 0)
+		{
+			printf("error: cannot write the tar stream\n");
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (shardnum >= 0)
+	{
+		// tells --merge this shard is complete
+		sprintf(path, "%s%sshard%03u.done", dirout, PATH_DELIMITER, shardnum);
+		markerfile = fopen(path, "wt");
+		if (markerfile == NULL || fprintf(markerfile, "tiles %u-%u\n", shardfirst, shardlast) < 0 ||
+			fclose(markerfile) != 0)
+		{
+			printf("error: cannot write %s\n", path);
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+		printf("shard %u of %u done\n\n", shardnum, shardcount);
+	}
+
+	if (manifeststr != NULL && shardnum < 0)
+	{
+		sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, manifeststr);
+		if (!WriteManifest(path))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (reportstr != NULL)
+	{
+		sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, reportstr);
+		if (!DumpDuplicateReport(path))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (mergeshards)
+	{
+		// leave the folder as a single run would
+		for (artn = 0; artn < shardcount; artn++)
+		{
+			sprintf(path, "%s%sshard%03u.done", dirout, PATH_DELIMITER, artn);
+			remove(path);
+		}
+		remove(planfile);
+	}
+
+	FreeImage_DeInitialise();
+	return EXIT_SUCCESS;
+
+}
+
+static uint8_t* PoolAlloc(uint32_t size)
+{
+	poolbuffer_t* buffer = NULL;
+	uint8_t* raw;
+	uint32_t sizeclass;
+
+	for (sizeclass = 0; sizeclass < POOL_CLASSES && (1u << (sizeclass + POOL_MIN_SHIFT)) < size; sizeclass++)
+		;
+
+	if (sizeclass < POOL_CLASSES)
+	{
+		pthread_mutex_lock(&poollock);
+		buffer = poolfree[sizeclass];
+		if (buffer != NULL)
+			poolfree[sizeclass] = buffer->next;
+		pthread_mutex_unlock(&poollock);
+		size = 1u << (sizeclass + POOL_MIN_SHIFT);
+	}
+
+	raw = buffer != NULL ? (uint8_t*)buffer : malloc(POOL_HEADER + size);
+	if (raw == NULL)
+		return NULL;
+
+	*(uint32_t*)raw = sizeclass;
+	return raw + POOL_HEADER;
+}
+
+static void PoolFree(uint8_t* buffer)
+{
+	uint8_t* raw = buffer - POOL_HEADER;
+	uint32_t sizeclass = *(uint32_t*)raw;
+
+	// too big for a class, nobody is likely to ask for it again
+	if (sizeclass >= POOL_CLASSES)
+	{
+		free(raw);
+		return;
+	}
+
+	pthread_mutex_lock(&poollock);
+	((poolbuffer_t*)raw)->next = poolfree[sizeclass];
+	poolfree[sizeclass] = (poolbuffer_t*)raw;
+	pthread_mutex_unlock(&poollock);
+}
+
+static void PoolReset(void)
+{
+	poolbuffer_t* buffer;
+	uint32_t i;
+
+	pthread_mutex_lock(&poollock);
+	for (i = 0; i < POOL_CLASSES; i++)
+	{
+		while ((buffer = poolfree[i]) != NULL)
+		{
+			poolfree[i] = buffer->next;
+			free(buffer);
+		}
+	}
+	pthread_mutex_unlock(&poollock);
+}
+
+static tilejob_t* PopJob(jobqueue_t* q)
+{
+	tilejob_t* job;
+	uint32_t spins;
+
+	for (spins = 0; (job = TryPopJob(q)) == NULL; spins++)
+		WaitForQueue(spins);
+
+	return job;
+}
+
+static void PushJob(jobqueue_t* q, tilejob_t* job)
+{
+	uint32_t spins;
+
+	for (spins = 0; !TryPushJob(q, job); spins++)
+		WaitForQueue(spins);
+}
+
+static uint8_t* ReadTile(uint32_t ti, const char* picname)
+{
+	uint8_t* ibuff;
+
+	const uint32_t picsize = Tiles.sizex[ti] * Tiles.sizey[ti];
+
+	fseek(artfile, Tiles.offset[ti], SEEK_SET);
+
+	ibuff = PoolAlloc(picsize);
+
+	if (ibuff == NULL)
+	{
+		printf("error: cannot alloc enough memory to load %s\n", picname);
+		return NULL;
+	}
+	if (fread(ibuff, 1, picsize, artfile) != picsize)
+	{
+		printf("error: cannot read enough data in ART file to load %s\n", picname);
+		PoolFree(ibuff);
+		return NULL;
+	}
+
+	return ibuff;
+}
+
+static void ReleaseMemory(uint32_t bytes)
+{
+	__atomic_sub_fetch(&memoryinflight, bytes, __ATOMIC_ACQ_REL);
+}
+
+static void ReserveMemory(uint32_t bytes)
+{
+	uint64_t inflight;
+	uint32_t spins;
+
+	inflight = __atomic_load_n(&memoryinflight, __ATOMIC_ACQUIRE);
+	for (spins = 0; ; spins++)
+	{
+		// a lone tile always goes through, even if it is bigger than the cap
+		if (memorylimit != 0 && inflight != 0 && inflight + bytes > memorylimit)
+		{
+			WaitForQueue(spins);
+			inflight = __atomic_load_n(&memoryinflight, __ATOMIC_ACQUIRE);
+		}
+		else if (__atomic_compare_exchange_n(&memoryinflight, &inflight, inflight + bytes, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+}
+
+static bool SpawnPNG(tilejob_t* job)
+{
+	FIBITMAP* pngas;
+
+	if (writeraw)
+		return SpawnRaw(job);
+
+	if (upscale > 1 && !UpscaleTile(job))
+		return false;
+
+	pngas = FreeImage_AllocateEx(job->sizex, job->sizey, 8, &rgbpal[255], 0, rgbpal, 0, 0, 0);
+	if (pngas == NULL)
+		return false;
+	FreeImage_SetTransparentIndex(pngas, 255);
+
+	// ART tiles are stored column by column, FreeImage scanlines go bottom up
+	ArtKernels.Transpose(job->data, job->sizey, FreeImage_GetScanLine(pngas, job->sizey - 1),
+		-(int32_t)FreeImage_GetPitch(pngas), job->sizex, job->sizey);
+
+	// encoded in memory, the writer puts it out
+	job->png = FreeImage_OpenMemory(NULL, 0);
+	if (job->png != NULL && !FreeImage_SaveToMemory(FIF_PNG, pngas, job->png, 0))
+	{
+		FreeImage_CloseMemory(job->png);
+		job->png = NULL;
+	}
+
+	FreeImage_Unload(pngas);
+
+	return job->png != NULL;
+}
+
+static void Scale3xTile(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst)
+{
+	const uint8_t* left;
+	const uint8_t* mid;
+	const uint8_t* right;
+	uint8_t* out;
+	uint8_t block[9];
+	uint8_t a, b, c, d, e, f, g, h, i;
+	uint32_t x, y, up, down, k;
+
+	for (x = 0; x < sizex; x++)
+	{
+		mid = src + (size_t)x * sizey;
+		left = x > 0 ? mid - sizey : mid;
+		right = x + 1 < sizex ? mid + sizey : mid;
+		out = dst + (size_t)x * sizey * 9;
+
+		for (y = 0; y < sizey; y++)
+		{
+			// the border pixels repeat outwards
+			up = y > 0 ? y - 1 : y;
+			down = y + 1 < sizey ? y + 1 : y;
+			a = left[up];	b = mid[up];	c = right[up];
+			d = left[y];	e = mid[y];		f = right[y];
+			g = left[down];	h = mid[down];	i = right[down];
+
+			// block is the 3x3 output, row by row
+			memset(block, e, sizeof(block));
+			if (b != h && d != f)
+			{
+				block[0] = d == b ? d : e;
+				block[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+				block[2] = b == f ? f : e;
+				block[3] = (d == b && e != g) || (d == h && e != a) ? d : e;
+				block[5] = (b == f && e != i) || (h == f && e != c) ? f : e;
+				block[6] = d == h ? d : e;
+				block[7] = (d == h && e != i) || (h == f && e != g) ? h : e;
+				block[8] = h == f ? f : e;
+			}
 
-	artcount = atoi(numarg);
+			for (k = 0; k < 3; k++)
+			{
+				out[k * sizey * 3 + y * 3] = block[k];
+				out[k * sizey * 3 + y * 3 + 1] = block[k + 3];
+				out[k * sizey * 3 + y * 3 + 2] = block[k + 6];
+			}
+		}
+	}
+}
 
-	if (!LoadPalette(palfile))
+static bool SpawnRaw(tilejob_t* job)
+{
+	uint8_t* rows = NULL;
+	const uint8_t* pixels = job->data;
+	uint8_t* out;
+	uint32_t size;
+
+	if (rawrows)
 	{
-		FreeImage_DeInitialise();
-		return EXIT_FAILURE;
+		rows = malloc(job->size);
+		if (rows == NULL)
+			return false;
+		ArtKernels.Transpose(job->data, job->sizey, rows, job->sizex, job->sizex, job->sizey);
+		pixels = rows;
 	}
 
-	for (artn = 0; artn <= artcount; artn++)
+	out = malloc(RAW_HEADER_SIZE + job->size + job->size / 128 + 1);
+	if (out == NULL)
 	{
-		sprintf(currfile, "%s%sTILES%03u.ART", dirin, PATH_DELIMITER, artn);
-		artfile = fopen(currfile, "rb");
-		if (artfile == NULL)
+		free(rows);
+		return false;
+	}
+
+	if (rawrle)
+		size = PackRLE(pixels, job->size, &out[RAW_HEADER_SIZE]);
+	else
+	{
+		memcpy(&out[RAW_HEADER_SIZE], pixels, job->size);
+		size = job->size;
+	}
+	free(rows);
+
+	memcpy(&out[0], "BTIL", 4);
+	out[4] = 1;
+	out[5] = rawrows ? RAW_ORDER_ROWS : RAW_ORDER_COLUMNS;
+	out[6] = rawrle ? RAW_COMPRESSION_RLE : RAW_COMPRESSION_NONE;
+	out[7] = 0;
+	SetLittleEndianUInt16(job->sizex, &out[8]);
+	SetLittleEndianUInt16(job->sizey, &out[10]);
+	SetLittleEndianUInt32(size, &out[12]);
+
+	job->raw = out;
+	job->rawsize = RAW_HEADER_SIZE + size;
+	return true;
+}
+
+static uint32_t PackRLE(const uint8_t* src, uint32_t len, uint8_t* dst)
+{
+	uint32_t i = 0, out = 0, n;
+
+	// control byte 0-127: that many plus one bytes follow as they are,
+	// 128-255: the next byte repeats 2-129 times
+	while (i < len)
+	{
+		for (n = 1; i + n < len && n < 129 && src[i + n] == src[i]; n++)
+			;
+		if (n >= 3)
 		{
-			FreeImage_DeInitialise();
-			return EXIT_FAILURE;
+			dst[out++] = (uint8_t)(n + 126);
+			dst[out++] = src[i];
+			i += n;
+			continue;
 		}
 
-		if (!GetPicturesList() || !ExtractImages(dirout) || !DumpAnimationData(artn, dirout))
+		// literals up to the next three equal bytes, so the output never
+		// grows by more than a byte in 128
+		for (n = 1; i + n < len && n < 128 &&
+			!(i + n + 2 < len && src[i + n] == src[i + n + 1] && src[i + n] == src[i + n + 2]); n++)
+			;
+		dst[out++] = (uint8_t)(n - 1);
+		memcpy(&dst[out], &src[i], n);
+		out += n;
+		i += n;
+	}
+
+	return out;
+}
+
+static bool StartPipeline(void)
+{
+	uint32_t i;
+
+	if (numencoders == 0)
+		return true;
+
+	encoders = malloc(numencoders * sizeof(pthread_t));
+	pending = calloc(queuedepth * 2, sizeof(tilejob_t*));
+	if (encoders == NULL || pending == NULL ||
+		!InitJobQueue(&encodequeue, queuedepth) || !InitJobQueue(&writequeue, queuedepth))
+		return false;
+
+	for (i = 0; i < numencoders; i++)
+		if (pthread_create(&encoders[i], NULL, EncoderThread, NULL) != 0)
+			return false;
+
+	return pthread_create(&writer, NULL, WriterThread, NULL) == 0;
+}
+
+static bool StopPipeline(void)
+{
+	tilejob_t* job;
+	uint32_t i;
+
+	if (numencoders == 0)
+		return !writefailed;
+
+	for (i = 0; i < numencoders; i++)
+		PushJob(&encodequeue, &stopencoder);
+	for (i = 0; i < numencoders; i++)
+		pthread_join(encoders[i], NULL);
+
+	// the stop job comes last in read order, so the writer ends once all is out
+	job = calloc(1, sizeof(tilejob_t));
+	if (job == NULL)
+		return false;
+	job->kind = JOB_STOP;
+	job->seq = jobsread++;
+	for (i = 0; job->seq - __atomic_load_n(&jobswritten, __ATOMIC_ACQUIRE) >= queuedepth * 2; i++)
+		WaitForQueue(i);
+	PushJob(&writequeue, job);
+	pthread_join(writer, NULL);
+
+	return !__atomic_load_n(&writefailed, __ATOMIC_ACQUIRE);
+}
+
+static void DrainPipeline(void)
+{
+	uint32_t spins;
+
+	for (spins = 0; numencoders > 0 && __atomic_load_n(&jobswritten, __ATOMIC_ACQUIRE) != jobsread; spins++)
+		WaitForQueue(spins);
+}
+
+static bool RunBatch(const char* batchname, const char* cwd)
+{
+	FILE* batchfile;
+	textbuf_t summary = {NULL, 0, 0};
+	char line[FILENAME_MAX];
+	char palfile[FILENAME_MAX];
+	char dirin[FILENAME_MAX];
+	char dirout[FILENAME_MAX];
+	char result[64];
+	char* field[6];
+	char* token;
+	struct stat st;
+	uint32_t lineno = 0, numfields, jobs = 0, failed = 0;
+	bool sheet, verify, ok;
+
+	batchfile = fopen(batchname, "rt");
+	if (batchfile == NULL)
+	{
+		printf("error: cannot open the job file %s\n", batchname);
+		return false;
+	}
+
+	// one set of encoder threads for all the jobs
+	if (!StartPipeline())
+	{
+		printf("error: cannot start the encoder threads\n");
+		fclose(batchfile);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), batchfile) != NULL)
+	{
+		lineno++;
+
+		numfields = 0;
+		for (token = strtok(line, " \t\r\n"); token != NULL && numfields < 6; token = strtok(NULL, " \t\r\n"))
+			field[numfields++] = token;
+
+		// blank lines and comments
+		if (numfields == 0 || field[0][0] == ';' || field[0][0] == '#')
+			continue;
+
+		jobs++;
+		sheet = strcmp(field[0], "sheet") == 0;
+		verify = strcmp(field[0], "verify") == 0;
+		ok = false;
+
+		// the job before is all written, its counts can go
+		verifiedtiles = 0;
+		mismatches = 0;
+		batchtiles = 0;
+
+		if ((!sheet && !verify && strcmp(field[0], "png") != 0) || numfields != (verify ? 4 : 5))
+			printf("error: %s line %u: expected png or sheet <num> <palette> <folder in> <folder out>, "
+				"or verify <num> <palette> <folder in>\n", batchname, lineno);
+		else if ((sheet || verify) && (upscale > 1 || writeraw || writeapng))
+			printf("error: %s line %u: --upscale, --raw and --apng only work with png jobs\n", batchname, lineno);
+		else
 		{
-			fclose(artfile);
-			FreeImage_DeInitialise();
-			return EXIT_FAILURE;
+			sprintf(palfile, "%s%s%s", cwd, PATH_DELIMITER, field[2]);
+			sprintf(dirin, "%s%s%s", cwd, PATH_DELIMITER, field[3]);
+			sprintf(dirout, "%s%s%s", cwd, PATH_DELIMITER, verify ? "." : field[4]);
+
+			printf("job %u: %s %s\n\n", jobs, field[0], field[3]);
+
+			if (stat(dirout, &st) != 0 || (st.st_mode & S_IFDIR) == 0)
+				printf("error: the folder %s does not exist\n", dirout);
+			else if (LoadPalette(palfile))
+			{
+				// the palette and settings can change from job to job
+				SetSheetColors();
+				contactsheet = sheet;
+				verifyroundtrip = verify;
+				outputdir = dirout;
+				writefailed = false;
+
+				ok = ExtractArtFiles(dirin, atoi(field[1]));
+				DrainPipeline();
+				ok = ok && !__atomic_load_n(&writefailed, __ATOMIC_ACQUIRE) && mismatches == 0;
+			}
 		}
 
-		fclose(artfile);
+		if (verify)
+			sprintf(result, "%u checked, %u mismatches", verifiedtiles, mismatches);
+		else
+			sprintf(result, "%u tiles", batchtiles);
+		AppendText(&summary, "\t%4u  %-6s %-32s %-28s %s\n", jobs, field[0],
+			numfields > 3 ? field[3] : "", result, ok ? "ok" : "FAILED");
+		failed += !ok;
 	}
 
-	FreeImage_DeInitialise();
-	return EXIT_SUCCESS;
+	fclose(batchfile);
+
+	if (!StopPipeline())
+		failed++;
 
+	printf("batch summary:\n\n%s\n%u jobs, %u failed\n\n", summary.data != NULL ? summary.data : "", jobs, failed);
+	free(summary.data);
+
+	return failed == 0;
 }
 
-static bool SpawnPNG(uint32_t ti, const char* picname, const char* outdir)
+static void SubmitJob(tilejob_t* job)
 {
-	FILE* imgfile;
-	char tmp[FILENAME_MAX];
-	uint32_t xindex, yindex;
-	uint8_t* ibuff;
-	FIBITMAP* pngas;
+	uint32_t spins;
 
-	const uint32_t picsize = TilesList[ti].sizex * TilesList[ti].sizey;
+	job->seq = jobsread++;
 
-	if (picsize == 0)
-		return true;
+	if (numencoders == 0)
+	{
+		if (job->kind == JOB_SHEET)
+			ComposeSheet(job);
+		else if (job->kind == JOB_ANIM)
+			ComposeAnimation(job);
+		else if (job->kind == JOB_PNG)
+		{
+			SpawnPNG(job);
+			if (verifyroundtrip)
+				VerifyPNG(job);
+		}
+		if (!WriteJob(job))
+			writefailed = true;
+		FreeJob(job);
+		return;
+	}
 
-	fseek(artfile, TilesList[ti].offset, SEEK_SET);
-	
-	ibuff = malloc(picsize);
+	// backpressure: stay within the writer's reorder window
+	for (spins = 0; job->seq - __atomic_load_n(&jobswritten, __ATOMIC_ACQUIRE) >= queuedepth * 2; spins++)
+		WaitForQueue(spins);
 
-	if (ibuff == NULL)
+	PushJob(&encodequeue, job);
+}
+
+static tilejob_t* TryPopJob(jobqueue_t* q)
+{
+	queuecell_t* cell;
+	tilejob_t* job;
+	uint32_t pos, seq;
+
+	pos = __atomic_load_n(&q->dequeuepos, __ATOMIC_RELAXED);
+	for (;;)
 	{
-		printf("error: cannot alloc enough memory to load %s\n", picname);
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+		if ((int32_t)(seq - (pos + 1)) == 0)
+		{
+			if (__atomic_compare_exchange_n(&q->dequeuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int32_t)(seq - (pos + 1)) < 0)
+			return NULL;	// empty
+		else
+			pos = __atomic_load_n(&q->dequeuepos, __ATOMIC_RELAXED);
+	}
+
+	job = cell->job;
+	// the cell is free again one lap later
+	__atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return job;
+}
+
+static bool TryPushJob(jobqueue_t* q, tilejob_t* job)
+{
+	queuecell_t* cell;
+	uint32_t pos, seq;
+
+	pos = __atomic_load_n(&q->enqueuepos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+		if ((int32_t)(seq - pos) == 0)
+		{
+			if (__atomic_compare_exchange_n(&q->enqueuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int32_t)(seq - pos) < 0)
+			return false;	// full
+		else
+			pos = __atomic_load_n(&q->enqueuepos, __ATOMIC_RELAXED);
+	}
+
+	cell->job = job;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool UpscaleTile(tilejob_t* job)
+{
+	uint32_t sizex = job->sizex * upscale;
+	uint32_t sizey = job->sizey * upscale;
+	uint8_t* scaled;
+	uint8_t* twice;
+	uint8_t* column;
+	uint32_t x, y, k;
+
+	if (sizex > 0xFFFF || sizey > 0xFFFF)
+	{
+		printf("error: %s is too big to scale %u times\n", job->name, upscale);
 		return false;
 	}
-	if (fread(ibuff, 1, picsize, artfile) != picsize)
+
+	scaled = PoolAlloc(sizex * sizey);
+	if (scaled == NULL)
 	{
-		printf("error: cannot read enough data in ART file to load %s\n", picname);
-		free(ibuff);
+		printf("error: cannot alloc enough memory to scale %s\n", job->name);
 		return false;
 	}
 
-	pngas = FreeImage_AllocateEx(TilesList[ti].sizex, TilesList[ti].sizey, 8, &rgbpal[255], 0, rgbpal, 0, 0, 0);
-	FreeImage_SetTransparentIndex(pngas, 255);
+	if (upscalenearest)
+	{
+		// each pixel repeated down the column, then the column repeated
+		for (x = 0; x < job->sizex; x++)
+		{
+			column = scaled + (size_t)x * upscale * sizey;
+			for (y = 0; y < job->sizey; y++)
+				memset(column + y * upscale, job->data[x * job->sizey + y], upscale);
+			for (k = 1; k < upscale; k++)
+				memcpy(column + k * sizey, column, sizey);
+		}
+	}
+	else if (upscale == 2)
+		ArtKernels.Scale2x(job->data, job->sizex, job->sizey, scaled);
+	else if (upscale == 3)
+		Scale3xTile(job->data, job->sizex, job->sizey, scaled);
+	else
+	{
+		twice = PoolAlloc(job->size * 4);
+		if (twice == NULL)
+		{
+			printf("error: cannot alloc enough memory to scale %s\n", job->name);
+			PoolFree(scaled);
+			return false;
+		}
+		ArtKernels.Scale2x(job->data, job->sizex, job->sizey, twice);
+		ArtKernels.Scale2x(twice, job->sizex * 2, job->sizey * 2, scaled);
+		PoolFree(twice);
+	}
+
+	PoolFree(job->data);
+	job->data = scaled;
+	job->sizex = sizex;
+	job->sizey = sizey;
+	job->size = sizex * sizey;
+	return true;
+}
+
+static bool VerifyAnimationData(const char* text)
+{
+	uint32_t* parsed;
+	const char* line;
+	const char* next;
+	char key[32], value[32];
+	uint32_t first, last, current = 0, i;
+	int32_t type;
+	bool insection = true;
+
+	parsed = calloc(numtiles + 1, sizeof(uint32_t));
+	if (parsed == NULL)
+	{
+		printf("Error: cannot alloc enough memory to check the animation data\n");
+		return false;
+	}
+
+	// the rules of png2art's parser: a bad section is skipped with its keys,
+	// a range has to stay inside the ART file
+	for (line = text; *line != '\0'; line = next)
+	{
+		next = strchr(line, '\n');
+		next = next != NULL ? next + 1 : line + strlen(line);
+		while (*line == ' ')
+			line++;
+
+		if (*line == '[')
+		{
+			if (sscanf(line, "[tile%u.png -> tile%u.png]", &first, &last) == 2)
+			{
+				insection = first >= tilestartnum && last < tilestartnum + numtiles && first <= last;
+				if (insection)
+				{
+					current = first - tilestartnum;
+					parsed[current] = (parsed[current] & 0xFFFFFFC0) | ((last - first) & 0x3F);
+				}
+			}
+			else if (sscanf(line, "[tile%u.png]", &first) == 1)
+			{
+				insection = first >= tilestartnum && first < tilestartnum + numtiles;
+				if (insection)
+					current = first - tilestartnum;
+			}
+			else
+				insection = false;
+			continue;
+		}
+
+		if (!insection || sscanf(line, "%31[^= ] = %31s", key, value) != 2)
+			continue;
+
+		if (strcmp(key, "AnimationType") == 0)
+		{
+			for (type = 0; type < 4 && strcmp(animtypes[type], value) != 0; type++)
+				;
+			if (type < 4)
+				parsed[current] = (parsed[current] & 0xFFFFFF3F) | (type << 6);
+		}
+		else if (strcmp(key, "AnimationSpeed") == 0)
+			parsed[current] = (parsed[current] & 0xF0FFFFFF) | ((atoi(value) & 0x0F) << 24);
+		else if (strcmp(key, "XCenterOffset") == 0)
+			parsed[current] = (parsed[current] & 0xFFFF00FF) | ((uint8_t)atoi(value) << 8);
+		else if (strcmp(key, "YCenterOffset") == 0)
+			parsed[current] = (parsed[current] & 0xFF00FFFF) | ((uint8_t)atoi(value) << 16);
+		else if (strcmp(key, "OtherFlags") == 0)
+			parsed[current] = (parsed[current] & 0x0FFFFFFF) | ((uint32_t)(atoi(value) & 0x0F) << 28);
+	}
 
-	for (yindex = TilesList[ti].sizey; yindex > 0 ; yindex--)
+	for (i = 0; i < numtiles; i++)
 	{
-		for (xindex = 0; xindex <= TilesList[ti].sizex; xindex++)
+		if (parsed[i] != Tiles.animdata[i])
 		{
-			FreeImage_SetPixelIndex(pngas, xindex, yindex-1, &ibuff[(yindex-1) + (xindex) * (TilesList[ti].sizey)]);
+			printf("mismatch: the animation data of tile%04u is %08X, png2art reads %08X\n",
+				i + tilestartnum, Tiles.animdata[i], parsed[i]);
+			__atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
 		}
 	}
 
-	FreeImage_FlipVertical(pngas);
+	free(parsed);
+	return true;
+}
 
-	sprintf(tmp, "%s%stile%04u.png", outdir, PATH_DELIMITER, ti + tilestartnum);
+static bool VerifyPNG(tilejob_t* job)
+{
+	FIMEMORY* pngmem;
+	FIBITMAP* pngas = NULL;
+	BYTE* data;
+	DWORD size;
+	uint8_t* columns;
+	uint32_t i, differ = 0;
+	bool ok = false;
 
-	free(ibuff);
+	__atomic_add_fetch(&verifiedtiles, 1, __ATOMIC_RELAXED);
 
-	FreeImage_Save(FIF_PNG, pngas, tmp, 0);
+	// the same calls png2art makes on a png from a tar stream
+	if (job->png != NULL && FreeImage_AcquireMemory(job->png, &data, &size))
+	{
+		pngmem = FreeImage_OpenMemory(data, size);
+		pngas = FreeImage_LoadFromMemory(FIF_PNG, pngmem, 0);
+		FreeImage_CloseMemory(pngmem);
+	}
 
-	FreeImage_Unload(pngas);
+	if (pngas == NULL)
+		printf("\nmismatch: %s does not decode\n", job->name);
+	else if (FreeImage_GetBPP(pngas) != 8)
+		printf("\nmismatch: %s comes back as %u bit, png2art would quantize it\n", job->name, FreeImage_GetBPP(pngas));
+	else if (FreeImage_GetWidth(pngas) != job->sizex || FreeImage_GetHeight(pngas) != job->sizey)
+		printf("\nmismatch: %s comes back as %ux%u instead of %ux%u\n", job->name,
+			FreeImage_GetWidth(pngas), FreeImage_GetHeight(pngas), job->sizex, job->sizey);
+	else if ((columns = PoolAlloc(job->size)) == NULL)
+		printf("\nerror: not enough memory to check %s\n", job->name);
+	else
+	{
+		ArtKernels.Transpose(FreeImage_GetScanLine(pngas, job->sizey - 1), -(int32_t)FreeImage_GetPitch(pngas),
+			columns, job->sizey, job->sizey, job->sizex);
+
+		if (memcmp(columns, job->data, job->size) != 0)
+		{
+			for (i = 0; i < job->size; i++)
+				differ += columns[i] != job->data[i];
+			for (i = 0; columns[i] == job->data[i]; i++)
+				;
+			printf("\nmismatch: %u pixels of %s differ, the first at %u,%u is %u instead of %u\n", differ, job->name,
+				i / job->sizey, i % job->sizey, columns[i], job->data[i]);
+		}
+		else
+			ok = true;
+
+		PoolFree(columns);
+	}
+
+	if (pngas != NULL)
+		FreeImage_Unload(pngas);
+	if (!ok)
+		__atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+	return ok;
+}
+
+static void WaitForQueue(uint32_t spins)
+{
+	struct timespec ts = {0, 50000};
+
+	// spin a bit, then give the cpu away, then sleep
+	if (spins < 64)
+		return;
+	else if (spins < 1024)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+static bool WriteJob(tilejob_t* job)
+{
+	char path[FILENAME_MAX];
+	char srcname[FILENAME_MAX];
+	BYTE* data;
+	DWORD size;
+
+	// checked by the encoder already
+	if (verifyroundtrip)
+		return true;
+
+	if (job->kind == JOB_LINK)
+	{
+		// tar has hardlinks of its own
+		if (tarfile != NULL)
+			return WriteTarEntry(job->name, NULL, 0, job->linkname) && LinkPaletteVariants(job);
+
+		sprintf(srcname, "%s%s%s", outputdir, PATH_DELIMITER, job->linkname);
+		sprintf(path, "%s%s%s", outputdir, PATH_DELIMITER, job->name);
+		if (LinkPNG(srcname, path))
+			return LinkPaletteVariants(job);
+
+		// no luck, encode it after all
+		job->kind = JOB_PNG;
+		SpawnPNG(job);
+	}
+
+	if ((job->kind == JOB_PNG && writeraw) || job->kind == JOB_ANIM)
+	{
+		if (job->raw == NULL)
+		{
+			printf("error: cannot encode %s\n", job->name);
+			return false;
+		}
+		data = job->raw;
+		size = job->rawsize;
+	}
+	else if (job->kind == JOB_PNG)
+	{
+		if (job->png == NULL || !FreeImage_AcquireMemory(job->png, &data, &size))
+		{
+			printf("error: cannot encode %s\n", job->name);
+			return false;
+		}
+	}
+	else
+	{
+		data = job->data;
+		size = job->size;
+	}
 
+	if (!WriteOutput(job->name, data, size, job->kind == JOB_FILE))
+		return false;
+
+	// the same PNG in every extra palette
+	if (((job->kind == JOB_PNG && !writeraw) || job->kind == JOB_ANIM) && numexportpals > 0)
+		return WritePaletteVariants(job, data, size);
 	return true;
 }
 
+static bool WriteOutput(const char* name, const uint8_t* data, uint32_t size, bool text)
+{
+	FILE* outfile;
+	char path[FILENAME_MAX];
+	bool ok;
+
+	if (tarfile != NULL)
+	{
+		ok = WriteTarEntry(name, data, size, NULL);
+	}
+	else
+	{
+		sprintf(path, "%s%s%s", outputdir, PATH_DELIMITER, name);
+		outfile = fopen(path, text ? "wt" : "wb");
+		if (outfile == NULL)
+		{
+			printf("error: cannot create %s\n", path);
+			return false;
+		}
+		ok = fwrite(data, 1, size, outfile) == size;
+		if (fclose(outfile) != 0)
+			ok = false;
+	}
+
+	if (!ok)
+		printf("error: cannot write %s\n", name);
+	return ok;
+}
+
+static void* WriterThread(void* arg)
+{
+	tilejob_t* job;
+	uint32_t next = 0;
+	const uint32_t window = queuedepth * 2;
+
+	(void)arg;
+
+	for (;;)
+	{
+		job = PopJob(&writequeue);
+		pending[job->seq % window] = job;
+
+		// put out everything that is next in line
+		while ((job = pending[next % window]) != NULL)
+		{
+			pending[next % window] = NULL;
+			if (job->kind == JOB_STOP)
+			{
+				free(job);
+				return NULL;
+			}
+
+			if (!WriteJob(job))
+				__atomic_store_n(&writefailed, true, __ATOMIC_RELEASE);
+			FreeJob(job);
+
+			next++;
+			__atomic_store_n(&jobswritten, next, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static bool WriteTarEntry(const char* name, const uint8_t* data, uint32_t size, const char* linkname)
+{
+	uint8_t header[TAR_BLOCK_SIZE];
+	uint32_t i, checksum;
+	static const uint8_t padding[TAR_BLOCK_SIZE];
+
+	// ustar header, everything is a plain file or a hardlink to one
+	memset(header, 0, sizeof(header));
+	strncpy((char*)&header[0], name, 99);
+	sprintf((char*)&header[100], "%07o", 0644);
+	sprintf((char*)&header[108], "%07o", 0);
+	sprintf((char*)&header[116], "%07o", 0);
+	sprintf((char*)&header[124], "%011o", linkname != NULL ? 0 : size);
+	sprintf((char*)&header[136], "%011lo", (unsigned long)time(NULL));
+	header[156] = linkname != NULL ? '1' : '0';
+	if (linkname != NULL)
+		strncpy((char*)&header[157], linkname, 99);
+	memcpy(&header[257], "ustar", 6);
+	memcpy(&header[263], "00", 2);
+
+	// the checksum is computed with its own field set to spaces
+	memset(&header[148], ' ', 8);
+	checksum = 0;
+	for (i = 0; i < TAR_BLOCK_SIZE; i++)
+		checksum += header[i];
+	sprintf((char*)&header[148], "%06o", checksum);
+	header[155] = ' ';
+
+	if (fwrite(header, 1, TAR_BLOCK_SIZE, tarfile) != TAR_BLOCK_SIZE)
+		return false;
+
+	if (linkname != NULL || size == 0)
+		return true;
+
+	if (fwrite(data, 1, size, tarfile) != size)
+		return false;
+
+	size %= TAR_BLOCK_SIZE;
+	return size == 0 || fwrite(padding, 1, TAR_BLOCK_SIZE - size, tarfile) == TAR_BLOCK_SIZE - size;
+}
+
 static uint16_t GetLittleEndianUInt16 (const uint8_t* Buffer)
 {
    return (uint16_t)(Buffer[0] | (Buffer[1] << 8));
@@ -426,4 +4243,37 @@ static uint16_t GetLittleEndianUInt16 (const uint8_t* Buffer)
 static uint32_t GetLittleEndianUInt32 (const uint8_t* Buffer)
 {
    return Buffer[0] | (Buffer[1] << 8) | (Buffer[2] << 16) | (Buffer[3] << 24);
-}
\ No newline at end of file
+}
+
+static void SetLittleEndianUInt16 (uint16_t number, uint8_t* Buffer)
+{
+   Buffer[0] = (uint8_t)(number & 255);
+   Buffer[1] = (uint8_t)(number >> 8);
+}
+
+static void SetLittleEndianUInt32 (uint32_t number, uint8_t* Buffer)
+{
+   Buffer[0] = (uint8_t)(number & 255);
+   Buffer[1] = (uint8_t)((number >> 8) & 255);
+   Buffer[2] = (uint8_t)((number >> 16) & 255);
+   Buffer[3] = (uint8_t)(number >> 24);
+}
+
+static uint32_t GetBigEndianUInt32 (const uint8_t* Buffer)
+{
+   return ((uint32_t)Buffer[0] << 24) | (Buffer[1] << 16) | (Buffer[2] << 8) | Buffer[3];
+}
+
+static void SetBigEndianUInt16 (uint16_t number, uint8_t* Buffer)
+{
+   Buffer[0] = (uint8_t)(number >> 8);
+   Buffer[1] = (uint8_t)(number & 255);
+}
+
+static void SetBigEndianUInt32 (uint32_t number, uint8_t* Buffer)
+{
+   Buffer[0] = (uint8_t)(number >> 24);
+   Buffer[1] = (uint8_t)((number >> 16) & 255);
+   Buffer[2] = (uint8_t)((number >> 8) & 255);
+   Buffer[3] = (uint8_t)(number & 255);
+}
@@ -0,0 +1,542 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Types and Constants
+//
+
+#define		PATH_DELIMITER "/"
+
+#ifdef _WIN32		// If we're on Win32/Win64
+
+#include <direct.h>
+#define GetCurrentDir _getcwd
+
+#else				// If we're on *nix/Apple Mac OS X
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GetCurrentDir getcwd
+
+#endif
+
+#ifndef __cplusplus
+typedef enum {false, true} bool;
+#endif
+
+// An ART file mapped into memory (read into a buffer on Windows)
+typedef struct {
+	uint8_t* data;
+	size_t size;
+#ifndef _WIN32
+	int fd;
+#endif
+} mappedfile_t;
+
+// Tiles of one set, indexed by tile number
+typedef struct {
+	uint32_t count;
+	uint32_t capacity;
+	uint16_t* sizex;
+	uint16_t* sizey;
+	uint32_t* animdata;
+	uint64_t* hash;
+} tileset_t;
+
+// What changed in a tile
+#define CHANGED_SIZE 1
+#define CHANGED_ANIMDATA 2
+#define CHANGED_PIXELS 4
+
+#define MAX_TILE_NUMBER 1048575		// far beyond any build game, header is garbage
+
+//
+// Global Variables
+//
+
+// ART file name spellings we accept: art2png reads .ART, png2art writes .art
+static const char* artnames[3] = {"TILES%03u.ART", "TILES%03u.art", "tiles%03u.art"};
+
+static tileset_t seta, setb;
+static bool jsonoutput = false;
+
+//
+// Functions
+//
+
+// PROTOTYPES
+// Print the differences, returns the number of differing tiles
+static uint32_t DiffSets(void);
+
+// Get a uint16_t from a little-endian ordered buffer
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
+
+// Get a uint32_t from a little-endian ordered buffer
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
+
+// Make room for tile numbers below count
+static bool GrowTileSet(tileset_t* set, uint32_t count);
+
+// Hash the dimensions and pixels of a tile
+static uint64_t HashTile(uint16_t sizex, uint16_t sizey, const uint8_t* pixels, uint32_t len);
+
+// Read the header of a mapped ART file and hash its tiles into set
+static bool LoadArtFile(tileset_t* set, const mappedfile_t* mf, const char* path);
+
+// Load TILES000..TILESnnn of a folder, missing files count as empty and
+// are left false in found. False if no file could be loaded at all
+static bool LoadArtSet(tileset_t* set, const char* dir, uint32_t artcount, bool* found);
+
+// Map a file into memory for reading
+static bool MapFile(mappedfile_t* mf, const char* path);
+
+// Print one added, removed or changed tile
+static void PrintTile(const char* what, uint32_t tilenum, uint32_t changed, bool first);
+
+// Release a mapping
+static void UnmapFile(mappedfile_t* mf);
+
+// Implementations
+static uint32_t DiffSets(void)
+{
+	uint32_t i, count, changed;
+	uint32_t added = 0, removed = 0, modified = 0;
+	bool ina, inb;
+	int pass;
+	const char* what[3] = {"added", "removed", "changed"};
+
+	count = seta.count > setb.count ? seta.count : setb.count;
+	GrowTileSet(&seta, count);
+	GrowTileSet(&setb, count);
+
+	if (jsonoutput)
+		printf("{");
+
+	// one pass per kind so the JSON arrays come out whole
+	for (pass = 0; pass < 3; pass++)
+	{
+		if (jsonoutput)
+			printf("%s\"%s\":[", pass ? "," : "", what[pass]);
+
+		for (i = 0; i < count; i++)
+		{
+			ina = seta.hash[i] != 0 || seta.animdata[i] != 0;
+			inb = setb.hash[i] != 0 || setb.animdata[i] != 0;
+
+			if (pass == 0 && !ina && inb)
+				PrintTile(what[pass], i, 0, added++ == 0);
+			else if (pass == 1 && ina && !inb)
+				PrintTile(what[pass], i, 0, removed++ == 0);
+			else if (pass == 2 && ina && inb)
+			{
+				changed = 0;
+				if (seta.sizex[i] != setb.sizex[i] || seta.sizey[i] != setb.sizey[i])
+					changed |= CHANGED_SIZE;
+				if (seta.animdata[i] != setb.animdata[i])
+					changed |= CHANGED_ANIMDATA;
+				if (seta.hash[i] != setb.hash[i])
+					changed |= CHANGED_PIXELS;
+
+				if (changed != 0)
+					PrintTile(what[pass], i, changed, modified++ == 0);
+			}
+		}
+
+		if (jsonoutput)
+			printf("]");
+	}
+
+	if (jsonoutput)
+		printf(",\"summary\":{\"added\":%u,\"removed\":%u,\"changed\":%u}}\n", added, removed, modified);
+	else
+		printf("\n%u added, %u removed, %u changed\n\n", added, removed, modified);
+
+	return added + removed + modified;
+}
+
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer)
+{
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static bool GrowTileSet(tileset_t* set, uint32_t count)
+{
+	uint32_t newcapacity;
+	void* p;
+
+	if (count > MAX_TILE_NUMBER + 1)
+		return false;
+	if (count > set->count)
+		set->count = count;
+
+	if (count <= set->capacity)
+		return true;
+
+	newcapacity = set->capacity ? set->capacity : 4096;
+	while (newcapacity < count)
+		newcapacity *= 2;
+
+	if ((p = realloc(set->sizex, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	set->sizex = p;
+	if ((p = realloc(set->sizey, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	set->sizey = p;
+	if ((p = realloc(set->animdata, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	set->animdata = p;
+	if ((p = realloc(set->hash, newcapacity * sizeof(uint64_t))) == NULL)
+		return false;
+	set->hash = p;
+
+	// tiles no file declares are empty
+	memset(&set->sizex[set->capacity], 0, (newcapacity - set->capacity) * sizeof(uint16_t));
+	memset(&set->sizey[set->capacity], 0, (newcapacity - set->capacity) * sizeof(uint16_t));
+	memset(&set->animdata[set->capacity], 0, (newcapacity - set->capacity) * sizeof(uint32_t));
+	memset(&set->hash[set->capacity], 0, (newcapacity - set->capacity) * sizeof(uint64_t));
+
+	set->capacity = newcapacity;
+	return true;
+}
+
+static uint64_t HashTile(uint16_t sizex, uint16_t sizey, const uint8_t* pixels, uint32_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)sizex << 16) ^ sizey;
+	uint64_t w;
+	uint32_t i;
+
+	// eight bytes at a time, multiply-rotate mixing
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&w, &pixels[i], 8);
+		h ^= w * 0x87C37B91114253D5ULL;
+		h = ((h << 31) | (h >> 33)) * 0x4CF5AD432745937FULL;
+	}
+
+	w = 0;
+	memcpy(&w, &pixels[i], len - i);
+	h ^= (w * 0x87C37B91114253D5ULL) ^ len;
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	return h ? h : 1;
+}
+
+static bool LoadArtFile(tileset_t* set, const mappedfile_t* mf, const char* path)
+{
+	uint32_t ver, tilestartnum, tileendnum, numtiles;
+	uint32_t i, picsize;
+	size_t crtoffset;
+	const uint8_t* header = mf->data;
+
+	// same checks as art2png's GetPicturesList()
+	if (mf->size < 16)
+	{
+		printf("error: invalid ART file %s: not enough header data\n", path);
+		return false;
+	}
+
+	ver = GetLittleEndianUInt32(&header[0]);
+	tilestartnum = GetLittleEndianUInt32(&header[8]);
+	tileendnum = GetLittleEndianUInt32(&header[12]);
+
+	if (ver != 1)
+	{
+		printf("error: invalid ART file %s: invalid version number(%u)\n", path, ver);
+		return false;
+	}
+	if (tileendnum < tilestartnum)
+	{
+		printf("error: invalid ART file %s: last tile (%u) before first tile (%u)\n",
+			path, tileendnum, tilestartnum);
+		return false;
+	}
+	if (tileendnum > MAX_TILE_NUMBER)
+	{
+		printf("error: invalid ART file %s: last tile (%u) past %u\n", path, tileendnum, MAX_TILE_NUMBER);
+		return false;
+	}
+
+	numtiles = tileendnum - tilestartnum + 1;
+	if ((mf->size - 16) / (2 + 2 + 4) < numtiles)
+	{
+		printf("error: invalid ART file %s: %u tiles declared but the header is truncated\n",
+			path, numtiles);
+		return false;
+	}
+
+	if (!GrowTileSet(set, tileendnum + 1))
+	{
+		printf("error: cannot alloc enough memory for %u tiles\n", tileendnum + 1);
+		return false;
+	}
+
+	crtoffset = 16 + (size_t)numtiles * (2 + 2 + 4);
+	for (i = 0; i < numtiles; i++)
+	{
+		set->sizex[tilestartnum + i] = GetLittleEndianUInt16(&header[16 + i * 2]);
+		set->sizey[tilestartnum + i] = GetLittleEndianUInt16(&header[16 + numtiles * 2 + i * 2]);
+		set->animdata[tilestartnum + i] = GetLittleEndianUInt32(&header[16 + numtiles * 4 + i * 4]);
+
+		picsize = set->sizex[tilestartnum + i] * set->sizey[tilestartnum + i];
+		if (picsize > mf->size - crtoffset)
+		{
+			printf("error: invalid ART file %s: tile data runs past the end of the file\n", path);
+			return false;
+		}
+
+		// empty tiles keep hash 0
+		set->hash[tilestartnum + i] = picsize ? HashTile(set->sizex[tilestartnum + i],
+			set->sizey[tilestartnum + i], &mf->data[crtoffset], picsize) : 0;
+		crtoffset += picsize;
+	}
+
+	return true;
+}
+
+static bool LoadArtSet(tileset_t* set, const char* dir, uint32_t artcount, bool* found)
+{
+	mappedfile_t mf;
+	char path[FILENAME_MAX];
+	uint32_t artn, i, loaded = 0;
+	bool ok;
+
+	for (artn = 0; artn <= artcount; artn++)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			sprintf(path, "%s%s", dir, PATH_DELIMITER);
+			sprintf(path + strlen(path), artnames[i], artn);
+			if (MapFile(&mf, path))
+				break;
+		}
+
+		if (i == 3)
+			continue;
+
+		ok = LoadArtFile(set, &mf, path);
+		UnmapFile(&mf);
+		if (!ok)
+			return false;
+
+		found[artn] = true;
+		loaded++;
+	}
+
+	// a mistyped folder would otherwise look like a set of empty files
+	if (loaded == 0)
+	{
+		printf("error: no art files in %s\n", dir);
+		return false;
+	}
+
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool MapFile(mappedfile_t* mf, const char* path)
+{
+	FILE* f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	mf->size = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	mf->data = malloc(mf->size + 1);
+	if (mf->data == NULL || fread(mf->data, 1, mf->size, f) != mf->size)
+	{
+		free(mf->data);
+		fclose(f);
+		return false;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static void UnmapFile(mappedfile_t* mf)
+{
+	free(mf->data);
+}
+
+#else
+
+static bool MapFile(mappedfile_t* mf, const char* path)
+{
+	struct stat st;
+
+	mf->fd = open(path, O_RDONLY);
+	if (mf->fd < 0)
+		return false;
+
+	if (fstat(mf->fd, &st) != 0)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	mf->size = st.st_size;
+	mf->data = NULL;
+	if (mf->size == 0)
+		return true;
+
+	mf->data = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, mf->fd, 0);
+	if (mf->data == MAP_FAILED)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	madvise(mf->data, mf->size, MADV_SEQUENTIAL);
+	return true;
+}
+
+static void UnmapFile(mappedfile_t* mf)
+{
+	if (mf->data != NULL)
+		munmap(mf->data, mf->size);
+	close(mf->fd);
+}
+
+#endif
+
+static void PrintTile(const char* what, uint32_t tilenum, uint32_t changed, bool first)
+{
+	if (!jsonoutput)
+	{
+		printf("%-8s tile%04u.png", what, tilenum);
+		if (changed & CHANGED_SIZE)
+			printf("  size %ux%u -> %ux%u", seta.sizex[tilenum], seta.sizey[tilenum],
+				setb.sizex[tilenum], setb.sizey[tilenum]);
+		else if (setb.hash[tilenum] != 0)
+			printf("  %ux%u", setb.sizex[tilenum], setb.sizey[tilenum]);
+		else if (seta.hash[tilenum] != 0)
+			printf("  %ux%u", seta.sizex[tilenum], seta.sizey[tilenum]);
+		if (changed & CHANGED_ANIMDATA)
+			printf("  animdata %08X -> %08X", seta.animdata[tilenum], setb.animdata[tilenum]);
+		if (changed & CHANGED_PIXELS)
+			printf("  pixels");
+		printf("\n");
+		return;
+	}
+
+	printf("%s{\"tile\":%u", first ? "" : ",", tilenum);
+	if (seta.hash[tilenum] != 0 || seta.animdata[tilenum] != 0)
+		printf(",\"a\":{\"sizex\":%u,\"sizey\":%u,\"animdata\":%u,\"hash\":\"%016" PRIx64 "\"}",
+			seta.sizex[tilenum], seta.sizey[tilenum], seta.animdata[tilenum], seta.hash[tilenum]);
+	if (setb.hash[tilenum] != 0 || setb.animdata[tilenum] != 0)
+		printf(",\"b\":{\"sizex\":%u,\"sizey\":%u,\"animdata\":%u,\"hash\":\"%016" PRIx64 "\"}",
+			setb.sizex[tilenum], setb.sizey[tilenum], setb.animdata[tilenum], setb.hash[tilenum]);
+	if (changed != 0)
+		printf(",\"fields\":[%s%s%s]",
+			(changed & CHANGED_SIZE) ? "\"size\"" : "",
+			(changed & CHANGED_ANIMDATA) ? ((changed & CHANGED_SIZE) ? ",\"animdata\"" : "\"animdata\"") : "",
+			(changed & CHANGED_PIXELS) ? ((changed & (CHANGED_SIZE | CHANGED_ANIMDATA)) ? ",\"pixels\"" : "\"pixels\"") : "");
+	printf("}");
+}
+
+int main(int argc, char* argv[])
+{
+	char cwd[FILENAME_MAX];
+	char dira[FILENAME_MAX];
+	char dirb[FILENAME_MAX];
+	char* positional[3];
+	uint32_t npositional = 0;
+	uint32_t artcount, artn;
+	bool* founda;
+	bool* foundb;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0)
+			jsonoutput = true;
+		else if (argv[i][0] != '-' && npositional < 3)
+			positional[npositional++] = argv[i];
+		else
+		{
+			npositional = 0;
+			break;
+		}
+	}
+
+	// the banner would break the JSON
+	if (!jsonoutput)
+		printf("\n"
+			"artdiff by SanyaWaffles\n"
+			"=======================\n\n");
+
+	if (npositional != 3)
+	{
+		printf("syntax: artdiff [--json] <num> <folder a> <folder b>\n"
+			"	List the tiles added, removed or changed from set a to set b\n"
+			"	a tile changed if its size, animation data or pixels differ\n"
+			"	exit code is 0 when the sets match, 1 when they differ, 2 on errors\n"
+			"	eg: artdiff 19 oldbuild newbuild\n\n");
+		return 2;
+	}
+
+	GetCurrentDir(cwd, sizeof(cwd));
+	artcount = atoi(positional[0]);
+	sprintf(dira, "%s%s%s", cwd, PATH_DELIMITER, positional[1]);
+	sprintf(dirb, "%s%s%s", cwd, PATH_DELIMITER, positional[2]);
+
+	founda = calloc((artcount + 1) * 2, sizeof(bool));
+	if (founda == NULL)
+	{
+		printf("error: cannot alloc enough memory for %u art files\n", artcount + 1);
+		return 2;
+	}
+	foundb = founda + artcount + 1;
+
+	if (!LoadArtSet(&seta, dira, artcount, founda) || !LoadArtSet(&setb, dirb, artcount, foundb))
+		return 2;
+
+	// two sets without a file in common are two different folders, not a diff
+	for (artn = 0; artn <= artcount; artn++)
+		if (founda[artn] && foundb[artn])
+			break;
+	if (artn > artcount)
+	{
+		printf("error: %s and %s have no art file in common\n", dira, dirb);
+		return 2;
+	}
+	free(founda);
+
+	return DiffSets() == 0 ? EXIT_SUCCESS : 1;
+}
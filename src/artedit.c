@@ -0,0 +1,697 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE			// copy_file_range()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+//
+// Types and Constants
+//
+
+typedef		signed char		int8_t;
+typedef		signed short	int16_t;
+typedef		signed int		int32_t;
+typedef	  unsigned char		uint8_t;
+typedef	  unsigned short	uint16_t;
+typedef	  unsigned int		uint32_t;
+
+// A tile of the set being edited. The pixels stay in the source ART file
+// until the output is written, only the reference moves around.
+typedef struct {
+	int32_t source;			// index in sources[], -1 for an empty tile
+	uint32_t offset;		// offset of the pixel data in the source
+	uint16_t sizex;
+	uint16_t sizey;
+	uint32_t animdata;
+} tileref_t;
+
+// An opened input ART file
+typedef struct {
+	int fd;
+	uint32_t tilestartnum;
+	uint32_t tileendnum;
+	uint32_t numtilesfield;	// header field 4, kept so untouched files stay bit-exact
+} source_t;
+
+#define		PATH_DELIMITER "/"
+
+#ifdef _WIN32		// If we're on Win32/Win64
+
+#include <direct.h>
+#include <io.h>
+#define GetCurrentDir _getcwd
+
+#else				// If we're on *nix/Apple Mac OS X
+
+#include <unistd.h>
+#define GetCurrentDir getcwd
+
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef __cplusplus
+typedef enum {false, true} bool;
+#endif
+
+#define MAX_SOURCES 1024			// Input ART files over all merged sets
+#define COPY_BUFFER_SIZE 65536		// Bounce buffer when the kernel can't copy for us
+#define MAX_TILE_NUMBER 1048575		// far beyond any build game, header is garbage
+
+//
+// Global Variables
+//
+
+// ART file name spellings we accept: art2png reads .ART, png2art writes .art
+static const char* artnames[3] = {"TILES%03u.ART", "TILES%03u.art", "tiles%03u.art"};
+
+static source_t sources[MAX_SOURCES];
+static uint32_t numsources = 0;
+
+static tileref_t* tiles = NULL;			// indexed by tile number
+static uint32_t numtiles = 0;			// highest tile number + 1
+static uint32_t tilescapacity = 0;
+
+static uint32_t tilesperfile = 256;
+
+//
+// Functions
+//
+
+// PROTOTYPES
+// Copy length bytes at offset of infd to the end of outfd
+static bool CopyRange(int infd, uint32_t offset, int outfd, size_t length);
+
+// Make sure tile numbers below count exist
+static bool GrowTiles(uint32_t count);
+
+// Get a uint16_t from a little-endian ordered buffer
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
+
+// Get a uint32_t from a little-endian ordered buffer
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
+
+// Read the header of an ART file and add its tiles to the set
+static bool LoadArtFile(const char* path, bool overlay);
+
+// Load TILES000..TILESnnn from a folder
+static bool LoadArtSet(const char* dir, uint32_t artcount, bool overlay);
+
+// Parse "first-last" or "tile"
+static bool ParseRange(const char* str, uint32_t* first, uint32_t* last);
+
+// Move, copy or clear a range of tiles
+static bool RelocateTiles(uint32_t first, uint32_t last, uint32_t to, bool keepsource);
+
+// Set a uint16_t into a little-endian ordered buffer
+static void SetLittleEndianUInt16(uint16_t integer, uint8_t* buffer);
+
+// Set a uint32_t into a little-endian ordered buffer
+static void SetLittleEndianUInt32(uint32_t integer, uint8_t* buffer);
+
+// Write one output ART file covering tiles first..last
+static bool WriteArtFile(const char* path, uint32_t first, uint32_t last);
+
+// Implementations
+static bool CopyRange(int infd, uint32_t offset, int outfd, size_t length)
+{
+	static uint8_t buffer[COPY_BUFFER_SIZE];
+	size_t chunk;
+	ssize_t done;
+
+#ifdef __linux__
+	loff_t inoff = offset;
+
+	// let the kernel move the bytes (or share extents on reflink filesystems)
+	while (length > 0)
+	{
+		done = copy_file_range(infd, &inoff, outfd, NULL, length, 0);
+		if (done <= 0)
+			break;
+		length -= done;
+	}
+
+	if (length == 0)
+		return true;
+
+	// older kernels or cross-filesystem copies: sendfile() still avoids userspace
+	if (done < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+	{
+		off_t sendoff = inoff;
+
+		while (length > 0)
+		{
+			done = sendfile(outfd, infd, &sendoff, length);
+			if (done <= 0)
+				break;
+			length -= done;
+		}
+
+		if (length == 0)
+			return true;
+	}
+
+	offset = (uint32_t)inoff;
+	if (length > 0 && done == 0)
+		return false;
+#endif
+
+	if (lseek(infd, offset, SEEK_SET) < 0)
+		return false;
+
+	while (length > 0)
+	{
+		chunk = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+		done = read(infd, buffer, chunk);
+		if (done <= 0 || write(outfd, buffer, done) != done)
+			return false;
+		length -= done;
+	}
+
+	return true;
+}
+
+static bool GrowTiles(uint32_t count)
+{
+	tileref_t* newtiles;
+	uint32_t newcapacity;
+
+	if (count <= tilescapacity)
+	{
+		if (count > numtiles)
+			numtiles = count;
+		return true;
+	}
+	if (count > MAX_TILE_NUMBER + 1)
+	{
+		printf("error: tile numbers stop at %u\n", MAX_TILE_NUMBER);
+		return false;
+	}
+
+	newcapacity = tilescapacity ? tilescapacity : 4096;
+	while (newcapacity < count)
+		newcapacity *= 2;
+
+	newtiles = realloc(tiles, newcapacity * sizeof(tileref_t));
+	if (newtiles == NULL)
+	{
+		printf("error: cannot alloc enough memory for %u tiles\n", count);
+		return false;
+	}
+
+	memset(&newtiles[tilescapacity], 0, (newcapacity - tilescapacity) * sizeof(tileref_t));
+	while (tilescapacity < newcapacity)
+		newtiles[tilescapacity++].source = -1;
+
+	tiles = newtiles;
+	if (count > numtiles)
+		numtiles = count;
+	return true;
+}
+
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer)
+{
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static bool LoadArtFile(const char* path, bool overlay)
+{
+	source_t* src;
+	uint8_t header[16];
+	uint8_t* buffer;
+	uint32_t ver, count, i;
+	off_t filesize;
+	size_t offset;
+	tileref_t* t;
+
+	if (numsources == MAX_SOURCES)
+	{
+		printf("error: too many art files (%u)\n", MAX_SOURCES);
+		return false;
+	}
+
+	src = &sources[numsources];
+	src->fd = open(path, O_RDONLY | O_BINARY);
+	if (src->fd < 0)
+	{
+		printf("error: cannot open %s\n", path);
+		return false;
+	}
+
+	if (read(src->fd, header, 16) != 16)
+	{
+		printf("error: invalid ART file %s: not enough header data\n", path);
+		close(src->fd);
+		return false;
+	}
+
+	ver = GetLittleEndianUInt32(&header[0]);
+	src->numtilesfield = GetLittleEndianUInt32(&header[4]);
+	src->tilestartnum = GetLittleEndianUInt32(&header[8]);
+	src->tileendnum = GetLittleEndianUInt32(&header[12]);
+
+	if (ver != 1)
+	{
+		printf("error: invalid ART file %s: invalid version number(%u)\n", path, ver);
+		close(src->fd);
+		return false;
+	}
+	if (src->tileendnum < src->tilestartnum)
+	{
+		printf("error: invalid ART file %s: last tile (%u) before first tile (%u)\n",
+			path, src->tileendnum, src->tilestartnum);
+		close(src->fd);
+		return false;
+	}
+	if (src->tileendnum > MAX_TILE_NUMBER)
+	{
+		printf("error: invalid ART file %s: last tile (%u) past %u\n", path, src->tileendnum, MAX_TILE_NUMBER);
+		close(src->fd);
+		return false;
+	}
+
+	count = src->tileendnum - src->tilestartnum + 1;
+	filesize = lseek(src->fd, 0, SEEK_END);
+	if (filesize < 16 || (uint32_t)((filesize - 16) / 8) < count)
+	{
+		printf("error: invalid ART file %s: %u tiles declared but the header is truncated\n", path, count);
+		close(src->fd);
+		return false;
+	}
+
+	buffer = malloc(count * (2 + 2 + 4));
+	if (buffer == NULL)
+	{
+		printf("error: cannot alloc enough memory to read %s\n", path);
+		close(src->fd);
+		return false;
+	}
+	if (lseek(src->fd, 16, SEEK_SET) != 16 || read(src->fd, buffer, count * 8) != (ssize_t)(count * 8))
+	{
+		printf("error: cannot read the header of %s\n", path);
+		free(buffer);
+		close(src->fd);
+		return false;
+	}
+
+	if (!GrowTiles(src->tileendnum + 1))
+	{
+		free(buffer);
+		close(src->fd);
+		return false;
+	}
+
+	offset = 16 + (size_t)count * (2 + 2 + 4);
+	for (i = 0; i < count; i++)
+	{
+		uint16_t sizex = GetLittleEndianUInt16(&buffer[i * 2]);
+		uint16_t sizey = GetLittleEndianUInt16(&buffer[count * 2 + i * 2]);
+		uint32_t animdata = GetLittleEndianUInt32(&buffer[count * 4 + i * 4]);
+
+		// merged sets only bring tiles that actually hold something
+		if (!overlay || (sizex != 0 && sizey != 0) || animdata != 0)
+		{
+			t = &tiles[src->tilestartnum + i];
+			t->source = (sizex != 0 && sizey != 0) ? (int32_t)numsources : -1;
+			t->offset = offset;
+			t->sizex = sizex;
+			t->sizey = sizey;
+			t->animdata = animdata;
+		}
+		offset += (size_t)sizex * sizey;
+	}
+	free(buffer);
+
+	if (offset > (size_t)filesize)
+	{
+		printf("error: invalid ART file %s: tile data runs past the end of the file\n", path);
+		close(src->fd);
+		return false;
+	}
+
+	numsources++;
+	return true;
+}
+
+static bool LoadArtSet(const char* dir, uint32_t artcount, bool overlay)
+{
+	FILE* f;
+	char path[FILENAME_MAX];
+	uint32_t artn, i, found = 0;
+
+	for (artn = 0; artn <= artcount; artn++)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			sprintf(path, "%s%s", dir, PATH_DELIMITER);
+			sprintf(path + strlen(path), artnames[i], artn);
+			f = fopen(path, "rb");
+			if (f != NULL)
+			{
+				fclose(f);
+				break;
+			}
+		}
+
+		// a mod usually only ships a few of the files, the base set must be complete
+		if (i == 3)
+		{
+			if (overlay)
+				continue;
+			printf("error: TILES%03u.ART not found in %s\n", artn, dir);
+			return false;
+		}
+
+		if (!LoadArtFile(path, overlay))
+			return false;
+		found++;
+	}
+
+	if (found == 0)
+	{
+		printf("error: no art files found in %s\n", dir);
+		return false;
+	}
+
+	printf("%u art files read from %s\n", found, dir);
+	return true;
+}
+
+static bool ParseRange(const char* str, uint32_t* first, uint32_t* last)
+{
+	switch (sscanf(str, "%u-%u", first, last))
+	{
+	case 1:
+		*last = *first;
+		// fall through
+	case 2:
+		if (*first <= *last && *last <= MAX_TILE_NUMBER)
+			return true;
+		// fall through
+	default:
+		printf("error: invalid tile range (%s)\n", str);
+		return false;
+	}
+}
+
+static bool RelocateTiles(uint32_t first, uint32_t last, uint32_t to, bool keepsource)
+{
+	tileref_t* moved;
+	uint32_t count = last - first + 1;
+	uint32_t i;
+
+	if (to > MAX_TILE_NUMBER + 1 - count)
+	{
+		printf("error: tiles moved to %u run past tile %u\n", to, MAX_TILE_NUMBER);
+		return false;
+	}
+	if (!GrowTiles(last + 1) || !GrowTiles(to + count))
+		return false;
+
+	// ranges may overlap, so go through a copy
+	moved = malloc(count * sizeof(tileref_t));
+	if (moved == NULL)
+	{
+		printf("error: cannot alloc enough memory to move %u tiles\n", count);
+		return false;
+	}
+	memcpy(moved, &tiles[first], count * sizeof(tileref_t));
+
+	if (!keepsource)
+	{
+		for (i = first; i <= last; i++)
+		{
+			memset(&tiles[i], 0, sizeof(tileref_t));
+			tiles[i].source = -1;
+		}
+	}
+
+	memcpy(&tiles[to], moved, count * sizeof(tileref_t));
+	free(moved);
+	return true;
+}
+
+static void SetLittleEndianUInt16(uint16_t integer, uint8_t* buffer)
+{
+	buffer[0] = (uint8_t)(integer & 255);
+	buffer[1] = (uint8_t)(integer >> 8);
+}
+
+static void SetLittleEndianUInt32(uint32_t integer, uint8_t* buffer)
+{
+	buffer[0] = (uint8_t)(integer & 255);
+	buffer[1] = (uint8_t)((integer >> 8) & 255);
+	buffer[2] = (uint8_t)((integer >> 16) & 255);
+	buffer[3] = (uint8_t)(integer >> 24);
+}
+
+static bool WriteArtFile(const char* path, uint32_t first, uint32_t last)
+{
+	int artfd;
+	uint8_t* buffer;
+	uint32_t count = last - first + 1;
+	uint32_t numtilesfield = last + 1;
+	uint32_t i, runoffset;
+	int32_t runsource;
+	size_t headersize = 16 + (size_t)count * (2 + 2 + 4);
+	size_t runlength;
+	tileref_t* t;
+	bool ok = true;
+
+	// keep the original header field when the file covers the same tiles
+	for (i = 0; i < numsources; i++)
+		if (sources[i].tilestartnum == first && sources[i].tileendnum == last)
+			numtilesfield = sources[i].numtilesfield;
+
+	buffer = malloc(headersize);
+	if (buffer == NULL)
+	{
+		printf("error: cannot alloc enough memory for the header of %s\n", path);
+		return false;
+	}
+
+	SetLittleEndianUInt32(1, &buffer[0]);
+	SetLittleEndianUInt32(numtilesfield, &buffer[4]);
+	SetLittleEndianUInt32(first, &buffer[8]);
+	SetLittleEndianUInt32(last, &buffer[12]);
+	for (i = 0; i < count; i++)
+	{
+		t = &tiles[first + i];
+		SetLittleEndianUInt16(t->sizex, &buffer[16 + i * 2]);
+		SetLittleEndianUInt16(t->sizey, &buffer[16 + count * 2 + i * 2]);
+		SetLittleEndianUInt32(t->animdata, &buffer[16 + count * 4 + i * 4]);
+	}
+
+	artfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (artfd < 0)
+	{
+		printf("error: cannot create %s\n", path);
+		free(buffer);
+		return false;
+	}
+
+	if (write(artfd, buffer, headersize) != (ssize_t)headersize)
+		ok = false;
+	free(buffer);
+
+	// tiles that were next to each other in the same source go in one copy
+	runsource = -1;
+	runoffset = 0;
+	runlength = 0;
+	for (i = first; i <= last + 1 && ok; i++)
+	{
+		t = (i <= last) ? &tiles[i] : NULL;
+		if (t != NULL && t->source < 0)
+			continue;
+
+		if (t != NULL && t->source == runsource && t->offset == runoffset + runlength)
+		{
+			runlength += (size_t)t->sizex * t->sizey;
+			continue;
+		}
+
+		if (runlength > 0)
+			ok = CopyRange(sources[runsource].fd, runoffset, artfd, runlength);
+
+		if (t != NULL)
+		{
+			runsource = t->source;
+			runoffset = t->offset;
+			runlength = (size_t)t->sizex * t->sizey;
+		}
+	}
+
+	if (close(artfd) != 0 || !ok)
+	{
+		printf("error: cannot write %s\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	char cwd[FILENAME_MAX];
+	char dirin[FILENAME_MAX];
+	char dirout[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	char temppath[FILENAME_MAX];
+	uint32_t first, last, to;
+	uint32_t artn, srcn, outcount;
+	int i;
+
+	printf("\n"
+		"artedit by SanyaWaffles\n"
+		"=======================\n\n");
+
+	if (argc < 4)
+	{
+		printf("syntax: artedit <num> <folder in> <folder out> [operations]\n"
+			"	Move, renumber, merge and split tiles without converting them\n"
+			"	operations are applied in order:\n"
+			"		--merge <num> <folder>        add the tiles of another set over this one\n"
+			"		--move <first>-<last> <to>    renumber tiles, the old numbers become empty\n"
+			"		--copy <first>-<last> <to>    duplicate tiles\n"
+			"		--delete <first>-<last>       empty tiles\n"
+			"		--tiles-per-file <n>          tiles in each written art file (default 256)\n"
+			"	eg: artedit 19 folderin folderout --merge 20 modfolder --move 6200-6210 4000\n\n");
+		return EXIT_FAILURE;
+	}
+
+	GetCurrentDir(cwd, sizeof(cwd));
+	sprintf(dirin, "%s%s%s", cwd, PATH_DELIMITER, argv[2]);
+	sprintf(dirout, "%s%s%s", cwd, PATH_DELIMITER, argv[3]);
+
+	if (!LoadArtSet(dirin, atoi(argv[1]), false))
+		return EXIT_FAILURE;
+
+	for (i = 4; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--merge") == 0 && i + 2 < argc)
+		{
+			sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, argv[i + 2]);
+			if (!LoadArtSet(path, atoi(argv[i + 1]), true))
+				return EXIT_FAILURE;
+			i += 2;
+		}
+		else if ((strcmp(argv[i], "--move") == 0 || strcmp(argv[i], "--copy") == 0) && i + 2 < argc)
+		{
+			if (!ParseRange(argv[i + 1], &first, &last) ||
+				!RelocateTiles(first, last, atoi(argv[i + 2]), argv[i][2] == 'c'))
+				return EXIT_FAILURE;
+			printf("%s tiles %u-%u to %u\n", argv[i][2] == 'c' ? "copied" : "moved",
+				first, last, (uint32_t)atoi(argv[i + 2]));
+			i += 2;
+		}
+		else if (strcmp(argv[i], "--delete") == 0 && i + 1 < argc)
+		{
+			// the tile numbers stay, only their content goes
+			if (!ParseRange(argv[i + 1], &first, &last) || !GrowTiles(last + 1))
+				return EXIT_FAILURE;
+			for (to = first; to <= last; to++)
+			{
+				memset(&tiles[to], 0, sizeof(tileref_t));
+				tiles[to].source = -1;
+			}
+			printf("deleted tiles %u-%u\n", first, last);
+			i++;
+		}
+		else if (strcmp(argv[i], "--tiles-per-file") == 0 && i + 1 < argc)
+		{
+			tilesperfile = atoi(argv[++i]);
+			if (tilesperfile == 0)
+			{
+				printf("error: tiles per file must be at least 1\n");
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			printf("error: unknown operation %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	outcount = (numtiles + tilesperfile - 1) / tilesperfile;
+	printf("\nWriting %u tiles in %u art files:", numtiles, outcount);
+	fflush(stdout);
+
+	for (artn = 0; artn < outcount; artn++)
+	{
+		first = artn * tilesperfile;
+		last = first + tilesperfile - 1;
+		if (!GrowTiles(last + 1))
+			return EXIT_FAILURE;
+
+		// the output folder may be the input or a merged one, whose files are
+		// still copied from until the last output file is written
+		sprintf(path, "%s%sTILES%03u.ART.tmp", dirout, PATH_DELIMITER, artn);
+		if (!WriteArtFile(path, first, last))
+		{
+			remove(path);
+			while (artn-- > 0)
+			{
+				sprintf(path, "%s%sTILES%03u.ART.tmp", dirout, PATH_DELIMITER, artn);
+				remove(path);
+			}
+			return EXIT_FAILURE;
+		}
+
+		printf(" %03u", artn);
+		fflush(stdout);
+	}
+
+	for (srcn = 0; srcn < numsources; srcn++)
+		close(sources[srcn].fd);
+
+	for (artn = 0; artn < outcount; artn++)
+	{
+		sprintf(path, "%s%sTILES%03u.ART", dirout, PATH_DELIMITER, artn);
+		sprintf(temppath, "%s.tmp", path);
+#ifdef _WIN32
+		remove(path);
+#endif
+		if (rename(temppath, path) != 0)
+		{
+			printf("\nerror: cannot replace %s\n", path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("\ndone\n\n");
+	return EXIT_SUCCESS;
+}
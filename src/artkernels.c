@@ -0,0 +1,747 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Types and Constants
+//
+
+typedef		signed char		int8_t;
+typedef		signed short	int16_t;
+typedef		signed int		int32_t;
+typedef	  unsigned char		uint8_t;
+typedef	  unsigned short	uint16_t;
+typedef	  unsigned int		uint32_t;
+
+#ifndef __cplusplus
+typedef enum {false, true} bool;
+#endif
+
+// Every instruction set is compiled into the same binary: gcc and clang
+// get a target attribute per function, msvc has all intrinsics anyway
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#define KERNELS_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define KERNELS_X86
+#define TARGET(isa)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#include "artkernels.h"
+
+#define PALETTE_COLORS 256			// most colors NearestColors() looks at
+#define NEAREST_PAD 0x4000			// padding entries, farther than any real color
+
+// Instruction sets, best last
+typedef enum {
+	ISA_SCALAR,
+	ISA_SSE2,
+	ISA_AVX2,
+	ISA_AVX512,
+	NUM_ISAS
+} isa_t;
+
+//
+// Functions
+//
+
+// PROTOTYPES
+// What the cpu (and the OS, for the wider registers) can run
+static void DetectCpu(bool* supported, bool* vbmi);
+
+// Index of the smallest of n distances, the lowest index on a tie
+static uint8_t PickNearest(const int32_t* dist, const int32_t* index, uint32_t n);
+
+// Palette as 16-bit (r, g) and (b, 0) pairs for pmaddwd, padded to a multiple of 16 colors
+static uint32_t PreparePalette(const uint8_t* palette, uint32_t numcolors, int16_t* rg, int16_t* b0);
+
+// Transpose the lines [first, lines) and the columns [from, length) of lines [0, first) one byte at a time
+static void TransposeRest(const uint8_t* src, ptrdiff_t srcstride, uint8_t* dst, ptrdiff_t dststride,
+	uint32_t lines, uint32_t length, uint32_t first, uint32_t from);
+
+// Scale2x rows [from, to) of column e, with the columns d and f left and right of it
+static void Scale2xColumn(const uint8_t* d, const uint8_t* e, const uint8_t* f, uint32_t length,
+	uint8_t* out0, uint8_t* out1, uint32_t from, uint32_t to);
+
+// Scalar kernels
+static void TransposeScalar(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length);
+static void RemapScalar(const uint8_t* src, uint8_t* dst, size_t len, const uint8_t* map);
+static void NearestColorsScalar(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count);
+static void Scale2xScalar(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst);
+
+#ifdef KERNELS_X86
+// SSE2 kernels, SSE2 has no byte shuffle so the remap stays scalar
+static void TransposeSSE2(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length);
+static void NearestColorsSSE2(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count);
+static void Scale2xSSE2(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst);
+
+// AVX2 kernels
+static void TransposeAVX2(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length);
+static void NearestColorsAVX2(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count);
+static void Scale2xAVX2(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst);
+
+// AVX-512 kernels, the remap needs VBMI on top of AVX-512BW, Scale2x
+// uses the AVX2 one
+static void TransposeAVX512(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length);
+static void RemapAVX512(const uint8_t* src, uint8_t* dst, size_t len, const uint8_t* map);
+static void NearestColorsAVX512(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count);
+#endif
+
+//
+// Global Variables
+//
+
+static const char* isanames[NUM_ISAS] = {"scalar", "sse2", "avx2", "avx512"};
+
+artkernels_t ArtKernels = {"scalar", TransposeScalar, RemapScalar, NearestColorsScalar, Scale2xScalar};
+
+// Implementations
+bool SelectArtKernels(const char* isa)
+{
+	bool supported[NUM_ISAS];
+	bool vbmi;
+	int32_t pick, i;
+
+	DetectCpu(supported, &vbmi);
+
+	if (isa == NULL)
+	{
+		for (pick = NUM_ISAS - 1; !supported[pick]; pick--)
+			;
+	}
+	else
+	{
+		for (pick = -1, i = 0; i < NUM_ISAS; i++)
+		{
+			if (strcmp(isa, isanames[i]) == 0)
+				pick = i;
+		}
+		if (pick < 0 || !supported[pick])
+			return false;
+	}
+
+	ArtKernels.name = isanames[pick];
+	ArtKernels.Transpose = TransposeScalar;
+	ArtKernels.Remap = RemapScalar;
+	ArtKernels.NearestColors = NearestColorsScalar;
+	ArtKernels.Scale2x = Scale2xScalar;
+
+#ifdef KERNELS_X86
+	if (pick == ISA_SSE2)
+	{
+		ArtKernels.Transpose = TransposeSSE2;
+		ArtKernels.NearestColors = NearestColorsSSE2;
+		ArtKernels.Scale2x = Scale2xSSE2;
+	}
+	else if (pick == ISA_AVX2)
+	{
+		ArtKernels.Transpose = TransposeAVX2;
+		ArtKernels.NearestColors = NearestColorsAVX2;
+		ArtKernels.Scale2x = Scale2xAVX2;
+	}
+	else if (pick == ISA_AVX512)
+	{
+		ArtKernels.Transpose = TransposeAVX512;
+		ArtKernels.NearestColors = NearestColorsAVX512;
+		ArtKernels.Scale2x = Scale2xAVX2;
+		if (vbmi)
+			ArtKernels.Remap = RemapAVX512;
+	}
+#endif
+
+	return true;
+}
+
+static void DetectCpu(bool* supported, bool* vbmi)
+{
+	memset(supported, false, NUM_ISAS * sizeof(bool));
+	supported[ISA_SCALAR] = true;
+	*vbmi = false;
+
+#if defined(KERNELS_X86) && defined(_MSC_VER)
+	{
+		int info[4];
+		unsigned long long xcr0 = 0;
+		bool leaf7;
+
+		__cpuid(info, 0);
+		leaf7 = info[0] >= 7;
+
+		__cpuid(info, 1);
+		supported[ISA_SSE2] = (info[3] >> 26) & 1;
+		if ((info[2] >> 27) & 1)			// OSXSAVE
+			xcr0 = _xgetbv(0);
+
+		if (leaf7)
+		{
+			__cpuidex(info, 7, 0);
+			// the OS has to save the ymm and zmm registers too
+			supported[ISA_AVX2] = ((info[1] >> 5) & 1) && (xcr0 & 0x06) == 0x06;
+			supported[ISA_AVX512] = ((info[1] >> 16) & 1) && ((info[1] >> 30) & 1) && (xcr0 & 0xe6) == 0xe6;
+			*vbmi = supported[ISA_AVX512] && ((info[2] >> 1) & 1);
+		}
+	}
+#elif defined(KERNELS_X86)
+	// libgcc also checks xgetbv for the OS support
+	__builtin_cpu_init();
+	supported[ISA_SSE2] = __builtin_cpu_supports("sse2") != 0;
+	supported[ISA_AVX2] = __builtin_cpu_supports("avx2") != 0;
+	supported[ISA_AVX512] = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	*vbmi = supported[ISA_AVX512] && __builtin_cpu_supports("avx512vbmi");
+#endif
+}
+
+static uint8_t PickNearest(const int32_t* dist, const int32_t* index, uint32_t n)
+{
+	uint32_t i, best = 0;
+
+	for (i = 1; i < n; i++)
+	{
+		if (dist[i] < dist[best] || (dist[i] == dist[best] && index[i] < index[best]))
+			best = i;
+	}
+
+	return (uint8_t)index[best];
+}
+
+static uint32_t PreparePalette(const uint8_t* palette, uint32_t numcolors, int16_t* rg, int16_t* b0)
+{
+	uint32_t i, padded;
+
+	if (numcolors > PALETTE_COLORS)
+		numcolors = PALETTE_COLORS;
+	padded = (numcolors + 15) & ~15;
+
+	for (i = 0; i < padded; i++)
+	{
+		rg[i * 2] = i < numcolors ? palette[i * 3] : NEAREST_PAD;
+		rg[i * 2 + 1] = i < numcolors ? palette[i * 3 + 1] : NEAREST_PAD;
+		b0[i * 2] = i < numcolors ? palette[i * 3 + 2] : NEAREST_PAD;
+		b0[i * 2 + 1] = 0;
+	}
+
+	return padded;
+}
+
+static void TransposeRest(const uint8_t* src, ptrdiff_t srcstride, uint8_t* dst, ptrdiff_t dststride,
+	uint32_t lines, uint32_t length, uint32_t first, uint32_t from)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < lines; i++)
+	{
+		for (j = i < first ? from : 0; j < length; j++)
+			dst[j * dststride + i] = src[i * srcstride + j];
+	}
+}
+
+static void Scale2xColumn(const uint8_t* d, const uint8_t* e, const uint8_t* f, uint32_t length,
+	uint8_t* out0, uint8_t* out1, uint32_t from, uint32_t to)
+{
+	uint32_t y;
+	uint8_t b, h;
+
+	// out0 is the left output column, out1 the right one
+	for (y = from; y < to; y++)
+	{
+		b = e[y > 0 ? y - 1 : y];
+		h = e[y + 1 < length ? y + 1 : y];
+
+		if (b != h && d[y] != f[y])
+		{
+			out0[y * 2] = d[y] == b ? d[y] : e[y];
+			out1[y * 2] = b == f[y] ? f[y] : e[y];
+			out0[y * 2 + 1] = d[y] == h ? d[y] : e[y];
+			out1[y * 2 + 1] = h == f[y] ? f[y] : e[y];
+		}
+		else
+		{
+			out0[y * 2] = out0[y * 2 + 1] = e[y];
+			out1[y * 2] = out1[y * 2 + 1] = e[y];
+		}
+	}
+}
+
+static void TransposeScalar(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length)
+{
+	TransposeRest(src, srcstride, dst, dststride, lines, length, 0, 0);
+}
+
+static void RemapScalar(const uint8_t* src, uint8_t* dst, size_t len, const uint8_t* map)
+{
+	size_t i;
+	uint8_t a, b, c, d, e, f, g, h;
+
+	// eight independent lookups per iteration keep the loads in flight
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		a = map[src[i]];
+		b = map[src[i + 1]];
+		c = map[src[i + 2]];
+		d = map[src[i + 3]];
+		e = map[src[i + 4]];
+		f = map[src[i + 5]];
+		g = map[src[i + 6]];
+		h = map[src[i + 7]];
+		dst[i] = a;
+		dst[i + 1] = b;
+		dst[i + 2] = c;
+		dst[i + 3] = d;
+		dst[i + 4] = e;
+		dst[i + 5] = f;
+		dst[i + 6] = g;
+		dst[i + 7] = h;
+	}
+
+	for (; i < len; i++)
+		dst[i] = map[src[i]];
+}
+
+static void Scale2xScalar(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst)
+{
+	const uint8_t* e;
+	uint32_t x;
+
+	for (x = 0; x < sizex; x++)
+	{
+		e = src + (size_t)x * sizey;
+		Scale2xColumn(x > 0 ? e - sizey : e, e, x + 1 < sizex ? e + sizey : e, sizey,
+			dst + (size_t)x * sizey * 4, dst + (size_t)x * sizey * 4 + sizey * 2, 0, sizey);
+	}
+}
+
+static void NearestColorsScalar(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count)
+{
+	size_t p;
+	uint32_t j, best;
+	int32_t dr, dg, db, dist, bestdist;
+
+	if (numcolors > PALETTE_COLORS)
+		numcolors = PALETTE_COLORS;
+
+	for (p = 0; p < count; p++, rgb += 3)
+	{
+		best = 0;
+		bestdist = 0x7fffffff;
+		for (j = 0; j < numcolors && bestdist != 0; j++)
+		{
+			dr = rgb[0] - palette[j * 3];
+			dg = rgb[1] - palette[j * 3 + 1];
+			db = rgb[2] - palette[j * 3 + 2];
+			dist = dr * dr + dg * dg + db * db;
+
+			if (dist < bestdist)
+			{
+				bestdist = dist;
+				best = j;
+			}
+		}
+		indexes[p] = (uint8_t)best;
+	}
+}
+
+#ifdef KERNELS_X86
+
+// Four rounds of interleaving line i with line i + 8 transpose a 16x16
+// block of bytes (in every 128-bit lane of the wider registers)
+#define TRANSPOSE_ROUND(out, in, unpacklo, unpackhi)		\
+	for (i = 0; i < 8; i++)									\
+	{														\
+		out[i * 2] = unpacklo(in[i], in[i + 8]);			\
+		out[i * 2 + 1] = unpackhi(in[i], in[i + 8]);		\
+	}
+
+#define TRANSPOSE_16(a, b, unpacklo, unpackhi)				\
+	TRANSPOSE_ROUND(b, a, unpacklo, unpackhi)				\
+	TRANSPOSE_ROUND(a, b, unpacklo, unpackhi)				\
+	TRANSPOSE_ROUND(b, a, unpacklo, unpackhi)				\
+	TRANSPOSE_ROUND(a, b, unpacklo, unpackhi)
+
+TARGET("sse2") static void TransposeBlockSSE2(const uint8_t* src, ptrdiff_t srcstride, uint8_t* dst, ptrdiff_t dststride)
+{
+	__m128i a[16], b[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		a[i] = _mm_loadu_si128((const __m128i*)(src + i * srcstride));
+
+	TRANSPOSE_16(a, b, _mm_unpacklo_epi8, _mm_unpackhi_epi8)
+
+	for (i = 0; i < 16; i++)
+		_mm_storeu_si128((__m128i*)(dst + i * dststride), a[i]);
+}
+
+TARGET("avx2") static void TransposeBlockAVX2(const uint8_t* src, ptrdiff_t srcstride, uint8_t* dst, ptrdiff_t dststride)
+{
+	__m256i a[16], b[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		a[i] = _mm256_loadu_si256((const __m256i*)(src + i * srcstride));
+
+	TRANSPOSE_16(a, b, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8)
+
+	// each lane holds its own 16x16 block
+	for (i = 0; i < 16; i++)
+	{
+		_mm_storeu_si128((__m128i*)(dst + i * dststride), _mm256_castsi256_si128(a[i]));
+		_mm_storeu_si128((__m128i*)(dst + (i + 16) * dststride), _mm256_extracti128_si256(a[i], 1));
+	}
+}
+
+TARGET("avx512f,avx512bw") static void TransposeBlockAVX512(const uint8_t* src, ptrdiff_t srcstride, uint8_t* dst, ptrdiff_t dststride)
+{
+	__m512i a[16], b[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		a[i] = _mm512_loadu_si512((const void*)(src + i * srcstride));
+
+	TRANSPOSE_16(a, b, _mm512_unpacklo_epi8, _mm512_unpackhi_epi8)
+
+	for (i = 0; i < 16; i++)
+	{
+		_mm_storeu_si128((__m128i*)(dst + i * dststride), _mm512_extracti32x4_epi32(a[i], 0));
+		_mm_storeu_si128((__m128i*)(dst + (i + 16) * dststride), _mm512_extracti32x4_epi32(a[i], 1));
+		_mm_storeu_si128((__m128i*)(dst + (i + 32) * dststride), _mm512_extracti32x4_epi32(a[i], 2));
+		_mm_storeu_si128((__m128i*)(dst + (i + 48) * dststride), _mm512_extracti32x4_epi32(a[i], 3));
+	}
+}
+
+TARGET("sse2") static void TransposeSSE2(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length)
+{
+	uint32_t i, j;
+
+	for (i = 0; i + 16 <= lines; i += 16)
+	{
+		for (j = 0; j + 16 <= length; j += 16)
+			TransposeBlockSSE2(src + i * (ptrdiff_t)srcstride + j, srcstride, dst + j * (ptrdiff_t)dststride + i, dststride);
+	}
+
+	TransposeRest(src, srcstride, dst, dststride, lines, length, lines & ~15, length & ~15);
+}
+
+TARGET("avx2") static void TransposeAVX2(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length)
+{
+	uint32_t i, j;
+
+	for (i = 0; i + 16 <= lines; i += 16)
+	{
+		for (j = 0; j + 32 <= length; j += 32)
+			TransposeBlockAVX2(src + i * (ptrdiff_t)srcstride + j, srcstride, dst + j * (ptrdiff_t)dststride + i, dststride);
+		if (j + 16 <= length)
+			TransposeBlockSSE2(src + i * (ptrdiff_t)srcstride + j, srcstride, dst + j * (ptrdiff_t)dststride + i, dststride);
+	}
+
+	TransposeRest(src, srcstride, dst, dststride, lines, length, lines & ~15, length & ~15);
+}
+
+TARGET("avx512f,avx512bw") static void TransposeAVX512(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+	uint32_t lines, uint32_t length)
+{
+	uint32_t i, j;
+
+	for (i = 0; i + 16 <= lines; i += 16)
+	{
+		for (j = 0; j + 64 <= length; j += 64)
+			TransposeBlockAVX512(src + i * (ptrdiff_t)srcstride + j, srcstride, dst + j * (ptrdiff_t)dststride + i, dststride);
+		if (j + 32 <= length)
+		{
+			TransposeBlockAVX2(src + i * (ptrdiff_t)srcstride + j, srcstride, dst + j * (ptrdiff_t)dststride + i, dststride);
+			j += 32;
+		}
+		if (j + 16 <= length)
+			TransposeBlockSSE2(src + i * (ptrdiff_t)srcstride + j, srcstride, dst + j * (ptrdiff_t)dststride + i, dststride);
+	}
+
+	TransposeRest(src, srcstride, dst, dststride, lines, length, lines & ~15, length & ~15);
+}
+
+TARGET("avx512f,avx512bw,avx512vbmi") static void RemapAVX512(const uint8_t* src, uint8_t* dst, size_t len, const uint8_t* map)
+{
+	__m512i t0, t1, t2, t3, idx, low, high;
+	__mmask64 tail;
+	size_t i;
+
+	// vpermi2b looks up 128 entries, bit 7 of the index picks the half
+	t0 = _mm512_loadu_si512((const void*)map);
+	t1 = _mm512_loadu_si512((const void*)(map + 64));
+	t2 = _mm512_loadu_si512((const void*)(map + 128));
+	t3 = _mm512_loadu_si512((const void*)(map + 192));
+
+	for (i = 0; i + 64 <= len; i += 64)
+	{
+		idx = _mm512_loadu_si512((const void*)(src + i));
+		low = _mm512_permutex2var_epi8(t0, idx, t1);
+		high = _mm512_permutex2var_epi8(t2, idx, t3);
+		_mm512_storeu_si512((void*)(dst + i), _mm512_mask_blend_epi8(_mm512_movepi8_mask(idx), low, high));
+	}
+
+	if (i < len)
+	{
+		tail = ((__mmask64)1 << (len - i)) - 1;
+		idx = _mm512_maskz_loadu_epi8(tail, src + i);
+		low = _mm512_permutex2var_epi8(t0, idx, t1);
+		high = _mm512_permutex2var_epi8(t2, idx, t3);
+		_mm512_mask_storeu_epi8(dst + i, tail, _mm512_mask_blend_epi8(_mm512_movepi8_mask(idx), low, high));
+	}
+}
+
+// Scale2x takes 16 or 32 pixels of a column at once: the rules become
+// byte compares and selects, the two output pixels of each input pixel
+// are interleaved into the output columns with unpack
+TARGET("sse2") static __m128i SelectSSE2(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+TARGET("sse2") static void Scale2xSSE2(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst)
+{
+	const uint8_t* d;
+	const uint8_t* e;
+	const uint8_t* f;
+	uint8_t* out0;
+	uint8_t* out1;
+	__m128i vb, vd, ve, vf, vh, edge, e0, e1, e2, e3;
+	uint32_t x, y;
+
+	// the first pixel of each column is written before the loop
+	if (sizex == 0 || sizey == 0)
+		return;
+
+	for (x = 0; x < sizex; x++)
+	{
+		e = src + (size_t)x * sizey;
+		d = x > 0 ? e - sizey : e;
+		f = x + 1 < sizex ? e + sizey : e;
+		out0 = dst + (size_t)x * sizey * 4;
+		out1 = out0 + sizey * 2;
+
+		// the first and last pixel of a column have no neighbor to load
+		Scale2xColumn(d, e, f, sizey, out0, out1, 0, 1);
+		for (y = 1; y + 17 <= sizey; y += 16)
+		{
+			vb = _mm_loadu_si128((const __m128i*)(e + y - 1));
+			vh = _mm_loadu_si128((const __m128i*)(e + y + 1));
+			vd = _mm_loadu_si128((const __m128i*)(d + y));
+			ve = _mm_loadu_si128((const __m128i*)(e + y));
+			vf = _mm_loadu_si128((const __m128i*)(f + y));
+
+			// B != H and D != F
+			edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(vb, vh), _mm_cmpeq_epi8(vd, vf)), _mm_set1_epi8(-1));
+
+			e0 = SelectSSE2(_mm_and_si128(edge, _mm_cmpeq_epi8(vd, vb)), vd, ve);
+			e1 = SelectSSE2(_mm_and_si128(edge, _mm_cmpeq_epi8(vb, vf)), vf, ve);
+			e2 = SelectSSE2(_mm_and_si128(edge, _mm_cmpeq_epi8(vd, vh)), vd, ve);
+			e3 = SelectSSE2(_mm_and_si128(edge, _mm_cmpeq_epi8(vh, vf)), vf, ve);
+
+			_mm_storeu_si128((__m128i*)(out0 + y * 2), _mm_unpacklo_epi8(e0, e2));
+			_mm_storeu_si128((__m128i*)(out0 + y * 2 + 16), _mm_unpackhi_epi8(e0, e2));
+			_mm_storeu_si128((__m128i*)(out1 + y * 2), _mm_unpacklo_epi8(e1, e3));
+			_mm_storeu_si128((__m128i*)(out1 + y * 2 + 16), _mm_unpackhi_epi8(e1, e3));
+		}
+		Scale2xColumn(d, e, f, sizey, out0, out1, y < sizey ? y : sizey, sizey);
+	}
+}
+
+TARGET("avx2") static void Scale2xAVX2(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst)
+{
+	const uint8_t* d;
+	const uint8_t* e;
+	const uint8_t* f;
+	uint8_t* out0;
+	uint8_t* out1;
+	__m256i vb, vd, ve, vf, vh, edge, e0, e1, e2, e3, low, high;
+	uint32_t x, y;
+
+	// the first pixel of each column is written before the loop
+	if (sizex == 0 || sizey == 0)
+		return;
+
+	for (x = 0; x < sizex; x++)
+	{
+		e = src + (size_t)x * sizey;
+		d = x > 0 ? e - sizey : e;
+		f = x + 1 < sizex ? e + sizey : e;
+		out0 = dst + (size_t)x * sizey * 4;
+		out1 = out0 + sizey * 2;
+
+		Scale2xColumn(d, e, f, sizey, out0, out1, 0, 1);
+		for (y = 1; y + 33 <= sizey; y += 32)
+		{
+			vb = _mm256_loadu_si256((const __m256i*)(e + y - 1));
+			vh = _mm256_loadu_si256((const __m256i*)(e + y + 1));
+			vd = _mm256_loadu_si256((const __m256i*)(d + y));
+			ve = _mm256_loadu_si256((const __m256i*)(e + y));
+			vf = _mm256_loadu_si256((const __m256i*)(f + y));
+
+			edge = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(vb, vh), _mm256_cmpeq_epi8(vd, vf)), _mm256_set1_epi8(-1));
+
+			e0 = _mm256_blendv_epi8(ve, vd, _mm256_and_si256(edge, _mm256_cmpeq_epi8(vd, vb)));
+			e1 = _mm256_blendv_epi8(ve, vf, _mm256_and_si256(edge, _mm256_cmpeq_epi8(vb, vf)));
+			e2 = _mm256_blendv_epi8(ve, vd, _mm256_and_si256(edge, _mm256_cmpeq_epi8(vd, vh)));
+			e3 = _mm256_blendv_epi8(ve, vf, _mm256_and_si256(edge, _mm256_cmpeq_epi8(vh, vf)));
+
+			// unpack works per 128-bit lane, the lanes are put back in order
+			low = _mm256_unpacklo_epi8(e0, e2);
+			high = _mm256_unpackhi_epi8(e0, e2);
+			_mm256_storeu_si256((__m256i*)(out0 + y * 2), _mm256_permute2x128_si256(low, high, 0x20));
+			_mm256_storeu_si256((__m256i*)(out0 + y * 2 + 32), _mm256_permute2x128_si256(low, high, 0x31));
+			low = _mm256_unpacklo_epi8(e1, e3);
+			high = _mm256_unpackhi_epi8(e1, e3);
+			_mm256_storeu_si256((__m256i*)(out1 + y * 2), _mm256_permute2x128_si256(low, high, 0x20));
+			_mm256_storeu_si256((__m256i*)(out1 + y * 2 + 32), _mm256_permute2x128_si256(low, high, 0x31));
+		}
+		Scale2xColumn(d, e, f, sizey, out0, out1, y < sizey ? y : sizey, sizey);
+	}
+}
+
+// The nearest color kernels take the distance of 4, 8 or 16 palette
+// colors at once: pmaddwd of the (r, g) and (b, 0) differences gives
+// dr*dr + dg*dg and db*db per color in 32 bits
+TARGET("sse2") static void NearestColorsSSE2(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count)
+{
+	int16_t rg[PALETTE_COLORS * 2], b0[PALETTE_COLORS * 2];
+	int32_t dists[4], index[4];
+	__m128i pixrg, pixb, drg, db, dist, less, bestdist, bestindex, lane;
+	uint32_t j, padded;
+	size_t p;
+
+	padded = PreparePalette(palette, numcolors, rg, b0);
+
+	for (p = 0; p < count; p++, rgb += 3)
+	{
+		pixrg = _mm_set1_epi32(rgb[0] | (rgb[1] << 16));
+		pixb = _mm_set1_epi32(rgb[2]);
+		bestdist = _mm_set1_epi32(0x7fffffff);
+		bestindex = _mm_setzero_si128();
+		lane = _mm_setr_epi32(0, 1, 2, 3);
+
+		for (j = 0; j < padded; j += 4)
+		{
+			drg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)&rg[j * 2]), pixrg);
+			db = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)&b0[j * 2]), pixb);
+			dist = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+
+			less = _mm_cmplt_epi32(dist, bestdist);
+			bestdist = _mm_or_si128(_mm_and_si128(less, dist), _mm_andnot_si128(less, bestdist));
+			bestindex = _mm_or_si128(_mm_and_si128(less, lane), _mm_andnot_si128(less, bestindex));
+			lane = _mm_add_epi32(lane, _mm_set1_epi32(4));
+		}
+
+		_mm_storeu_si128((__m128i*)dists, bestdist);
+		_mm_storeu_si128((__m128i*)index, bestindex);
+		indexes[p] = PickNearest(dists, index, 4);
+	}
+}
+
+TARGET("avx2") static void NearestColorsAVX2(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count)
+{
+	int16_t rg[PALETTE_COLORS * 2], b0[PALETTE_COLORS * 2];
+	int32_t dists[8], index[8];
+	__m256i pixrg, pixb, drg, db, dist, less, bestdist, bestindex, lane;
+	uint32_t j, padded;
+	size_t p;
+
+	padded = PreparePalette(palette, numcolors, rg, b0);
+
+	for (p = 0; p < count; p++, rgb += 3)
+	{
+		pixrg = _mm256_set1_epi32(rgb[0] | (rgb[1] << 16));
+		pixb = _mm256_set1_epi32(rgb[2]);
+		bestdist = _mm256_set1_epi32(0x7fffffff);
+		bestindex = _mm256_setzero_si256();
+		lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+		for (j = 0; j < padded; j += 8)
+		{
+			drg = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)&rg[j * 2]), pixrg);
+			db = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)&b0[j * 2]), pixb);
+			dist = _mm256_add_epi32(_mm256_madd_epi16(drg, drg), _mm256_madd_epi16(db, db));
+
+			less = _mm256_cmpgt_epi32(bestdist, dist);
+			bestdist = _mm256_blendv_epi8(bestdist, dist, less);
+			bestindex = _mm256_blendv_epi8(bestindex, lane, less);
+			lane = _mm256_add_epi32(lane, _mm256_set1_epi32(8));
+		}
+
+		_mm256_storeu_si256((__m256i*)dists, bestdist);
+		_mm256_storeu_si256((__m256i*)index, bestindex);
+		indexes[p] = PickNearest(dists, index, 8);
+	}
+}
+
+TARGET("avx512f,avx512bw") static void NearestColorsAVX512(const uint8_t* palette, uint32_t numcolors,
+	const uint8_t* rgb, uint8_t* indexes, size_t count)
+{
+	int16_t rg[PALETTE_COLORS * 2], b0[PALETTE_COLORS * 2];
+	int32_t dists[16], index[16];
+	__m512i pixrg, pixb, drg, db, dist, bestdist, bestindex, lane;
+	__mmask16 less;
+	uint32_t j, padded;
+	size_t p;
+
+	padded = PreparePalette(palette, numcolors, rg, b0);
+
+	for (p = 0; p < count; p++, rgb += 3)
+	{
+		pixrg = _mm512_set1_epi32(rgb[0] | (rgb[1] << 16));
+		pixb = _mm512_set1_epi32(rgb[2]);
+		bestdist = _mm512_set1_epi32(0x7fffffff);
+		bestindex = _mm512_setzero_si512();
+		lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+		for (j = 0; j < padded; j += 16)
+		{
+			drg = _mm512_sub_epi16(_mm512_loadu_si512((const void*)&rg[j * 2]), pixrg);
+			db = _mm512_sub_epi16(_mm512_loadu_si512((const void*)&b0[j * 2]), pixb);
+			dist = _mm512_add_epi32(_mm512_madd_epi16(drg, drg), _mm512_madd_epi16(db, db));
+
+			less = _mm512_cmplt_epi32_mask(dist, bestdist);
+			bestdist = _mm512_mask_mov_epi32(bestdist, less, dist);
+			bestindex = _mm512_mask_mov_epi32(bestindex, less, lane);
+			lane = _mm512_add_epi32(lane, _mm512_set1_epi32(16));
+		}
+
+		_mm512_storeu_si512((void*)dists, bestdist);
+		_mm512_storeu_si512((void*)index, bestindex);
+		indexes[p] = PickNearest(dists, index, 16);
+	}
+}
+
+#endif
@@ -0,0 +1,58 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Pixel kernels shared by the tools, built in scalar, SSE2, AVX2 and
+// AVX-512 versions in artkernels.c. One set is picked at startup from
+// what the cpu can run, --isa picks another one to compare them.
+//
+// Include it after the integer types (stdint.h or typedefs) and bool of the tool.
+
+#ifndef ARTKERNELS_H
+#define ARTKERNELS_H
+
+typedef struct {
+	const char* name;
+
+	// dst[j * dststride + i] = src[i * srcstride + j] for lines lines of
+	// length bytes: ART columns to rows and back. A negative stride walks
+	// the lines backwards, for FreeImage's bottom up scanlines.
+	void (*Transpose)(const uint8_t* src, int32_t srcstride, uint8_t* dst, int32_t dststride,
+		uint32_t lines, uint32_t length);
+
+	// dst[i] = map[src[i]], src and dst may be the same buffer
+	void (*Remap)(const uint8_t* src, uint8_t* dst, size_t len, const uint8_t* map);
+
+	// Index of the nearest of the first numcolors colors of palette (RGB
+	// triplets) for each of the count RGB triplets in rgb, the lowest
+	// index wins a tie
+	void (*NearestColors)(const uint8_t* palette, uint32_t numcolors,
+		const uint8_t* rgb, uint8_t* indexes, size_t count);
+
+	// Scale2x (EPX) of a column-major tile of palette indexes into dst,
+	// which is 2 * sizex by 2 * sizey, the border pixels repeat outwards.
+	// An empty tile writes nothing
+	void (*Scale2x)(const uint8_t* src, uint32_t sizex, uint32_t sizey, uint8_t* dst);
+} artkernels_t;
+
+// The kernels in use, scalar until SelectArtKernels() is called
+extern artkernels_t ArtKernels;
+
+// Pick the kernels: NULL for the best the cpu can run, or scalar, sse2,
+// avx2 or avx512. False if the name is unknown or the cpu can't run it.
+bool SelectArtKernels(const char* isa);
+
+#endif
@@ -0,0 +1,561 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Types and Constants
+//
+
+#define		PATH_DELIMITER "/"
+
+#ifdef _WIN32		// If we're on Win32/Win64
+
+#include <direct.h>
+#define GetCurrentDir _getcwd
+
+#else				// If we're on *nix/Apple Mac OS X
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GetCurrentDir getcwd
+
+#endif
+
+#ifndef __cplusplus
+typedef enum {false, true} bool;
+#endif
+
+// An ART file mapped into memory (read into a buffer on Windows)
+typedef struct {
+	uint8_t* data;
+	size_t size;
+#ifndef _WIN32
+	int fd;
+#endif
+} mappedfile_t;
+
+// Tiles of the set, indexed by tile number
+typedef struct {
+	uint32_t capacity;
+	uint16_t* sizex;
+	uint16_t* sizey;
+	uint32_t* animdata;
+	int16_t* artfile;			// file the tile came from, -1 if none
+} tileset_t;
+
+// How bad a problem is
+typedef enum {
+	SEVERITY_WARNING,
+	SEVERITY_ERROR
+} severity_e;
+
+#define TRANSPARENT_INDEX 255
+#define MAX_TILE_NUMBER 1048575		// far beyond any build game, header is garbage
+
+//
+// Global Variables
+//
+
+// ART file name spellings we accept: art2png reads .ART, png2art writes .art
+static const char* artnames[3] = {"TILES%03u.ART", "TILES%03u.art", "tiles%03u.art"};
+
+static tileset_t Tiles;
+static bool jsonoutput = false;
+static uint32_t maxtiles = 9216;		// engine tile limit to warn about
+static uint32_t numerrors = 0;
+static uint32_t numwarnings = 0;
+
+// Set-wide statistics
+static uint64_t histogram[256];
+static uint64_t numpixels = 0;
+static uint32_t numfiles = 0;
+static uint32_t numtiles = 0;
+static uint32_t transparenttiles = 0;	// tiles using index 255
+static uint32_t emptytiles = 0;			// tiles made of index 255 only
+
+//
+// Functions
+//
+
+// PROTOTYPES
+// Check the animation data of every tile against the whole set
+static void CheckAnimations(uint32_t lasttile);
+
+// Check one mapped ART file, fills in the tile table and the histogram
+static bool CheckArtFile(const mappedfile_t* mf, const char* name, uint32_t artn, int32_t* lasttile);
+
+// Count the palette indexes of len bytes into the histogram, returns the index 255 count
+static uint64_t CountIndexes(const uint8_t* pixels, size_t len);
+
+// Get a uint16_t from a little-endian ordered buffer
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
+
+// Get a uint32_t from a little-endian ordered buffer
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
+
+// Make room for tile numbers below count
+static bool GrowTileSet(tileset_t* set, uint32_t count);
+
+// Map a file read-only into memory
+static bool MapFile(mappedfile_t* mf, const char* path);
+
+// Print the statistics of the set
+static void PrintSummary(void);
+
+// Report a problem, tile is -1 when it concerns the whole file
+static void Report(severity_e severity, const char* name, int32_t tile, const char* format, ...);
+
+// Release a mapping
+static void UnmapFile(mappedfile_t* mf);
+
+// Implementations
+static void CheckAnimations(uint32_t lasttile)
+{
+	uint32_t i, j, frames, type, first, last;
+	char name[16];
+
+	for (i = 0; i < lasttile + 1 && i < Tiles.capacity; i++)
+	{
+		if (Tiles.artfile[i] < 0 || (Tiles.animdata[i] & 0x3F) == 0)
+			continue;
+
+		// type none is never animated by the engine
+		frames = Tiles.animdata[i] & 0x3F;
+		type = (Tiles.animdata[i] >> 6) & 0x03;
+		if (type == 0)
+			continue;
+
+		// backward animations play the tiles before their own
+		first = type == 3 ? i - frames : i;
+		last = first + frames;
+		sprintf(name, "TILES%03u.ART", Tiles.artfile[i]);
+
+		if (first > i)
+		{
+			Report(SEVERITY_ERROR, name, i, "backward animation of %u frames runs past the first tile of the set",
+				frames);
+			continue;
+		}
+		if (last > lasttile)
+		{
+			Report(SEVERITY_ERROR, name, i, "animation of %u frames runs past the last tile of the set (%u)",
+				frames, lasttile);
+			continue;
+		}
+
+		// the engine shows the frames, empty ones blink
+		for (j = first; j <= last; j++)
+			if (j != i && (Tiles.artfile[j] < 0 || Tiles.sizex[j] == 0 || Tiles.sizey[j] == 0))
+				break;
+		if (j <= last)
+			Report(SEVERITY_WARNING, name, i, "animation frame tile%04u.png is empty", j);
+	}
+}
+
+static bool CheckArtFile(const mappedfile_t* mf, const char* name, uint32_t artn, int32_t* lasttile)
+{
+	uint32_t ver, tilestartnum, tileendnum, count;
+	uint32_t i, t, picsize;
+	uint64_t transparent;
+	size_t crtoffset;
+	const uint8_t* header = mf->data;
+
+	if (mf->size < 16)
+	{
+		Report(SEVERITY_ERROR, name, -1, "not enough header data (%u bytes)", (uint32_t)mf->size);
+		return true;
+	}
+
+	ver = GetLittleEndianUInt32(&header[0]);
+	tilestartnum = GetLittleEndianUInt32(&header[8]);
+	tileendnum = GetLittleEndianUInt32(&header[12]);
+
+	if (ver != 1)
+	{
+		Report(SEVERITY_ERROR, name, -1, "invalid version number (%u)", ver);
+		return true;
+	}
+	if (tileendnum < tilestartnum)
+	{
+		Report(SEVERITY_ERROR, name, -1, "last tile (%u) before first tile (%u)", tileendnum, tilestartnum);
+		return true;
+	}
+
+	if (tileendnum > MAX_TILE_NUMBER)
+	{
+		Report(SEVERITY_ERROR, name, -1, "last tile (%u) is not a sane tile number", tileendnum);
+		return true;
+	}
+
+	count = tileendnum - tilestartnum + 1;
+	if ((mf->size - 16) / (2 + 2 + 4) < count)
+	{
+		Report(SEVERITY_ERROR, name, -1, "%u tiles declared but the header is truncated", count);
+		return true;
+	}
+
+	// the files of a set follow each other without gaps or overlaps
+	if (*lasttile >= 0 && tilestartnum != (uint32_t)(*lasttile + 1))
+		Report(tilestartnum <= (uint32_t)*lasttile ? SEVERITY_ERROR : SEVERITY_WARNING, name, -1,
+			"tiles %u-%u do not follow the previous file, which ends at tile %u",
+			tilestartnum, tileendnum, (uint32_t)*lasttile);
+	if (tileendnum >= maxtiles)
+		Report(SEVERITY_WARNING, name, -1, "tile %u is past the engine limit of %u tiles", tileendnum, maxtiles);
+
+	if (!GrowTileSet(&Tiles, tileendnum + 1))
+	{
+		printf("error: cannot alloc enough memory for %u tiles\n", tileendnum + 1);
+		return false;
+	}
+
+	crtoffset = 16 + (size_t)count * (2 + 2 + 4);
+	for (i = 0; i < count; i++)
+	{
+		t = tilestartnum + i;
+		if (Tiles.artfile[t] >= 0)
+			Report(SEVERITY_ERROR, name, t, "tile is also in TILES%03u.ART", Tiles.artfile[t]);
+
+		Tiles.artfile[t] = (int16_t)artn;
+		Tiles.sizex[t] = GetLittleEndianUInt16(&header[16 + i * 2]);
+		Tiles.sizey[t] = GetLittleEndianUInt16(&header[16 + count * 2 + i * 2]);
+		Tiles.animdata[t] = GetLittleEndianUInt32(&header[16 + count * 4 + i * 4]);
+
+		if ((Tiles.sizex[t] == 0) != (Tiles.sizey[t] == 0))
+			Report(SEVERITY_WARNING, name, t, "size %ux%u has no pixels", Tiles.sizex[t], Tiles.sizey[t]);
+
+		picsize = Tiles.sizex[t] * Tiles.sizey[t];
+		if (picsize > mf->size - crtoffset)
+		{
+			Report(SEVERITY_ERROR, name, t, "tile data runs %u bytes past the end of the file",
+				(uint32_t)(crtoffset + picsize - mf->size));
+			crtoffset = mf->size;
+			continue;
+		}
+
+		if (picsize != 0)
+		{
+			transparent = CountIndexes(&mf->data[crtoffset], picsize);
+			numpixels += picsize;
+			if (transparent != 0)
+				transparenttiles++;
+			if (transparent == picsize)
+				emptytiles++;
+			// 1x1 transparent tiles are the usual placeholders
+			if (transparent == picsize && picsize > 1)
+				Report(SEVERITY_WARNING, name, t, "%ux%u tile is fully transparent", Tiles.sizex[t], Tiles.sizey[t]);
+		}
+		crtoffset += picsize;
+	}
+
+	if (crtoffset < mf->size)
+		Report(SEVERITY_WARNING, name, -1, "%u bytes after the last tile", (uint32_t)(mf->size - crtoffset));
+
+	numtiles += count;
+	*lasttile = tileendnum;
+	return true;
+}
+
+static uint64_t CountIndexes(const uint8_t* pixels, size_t len)
+{
+	// four tables so back to back equal bytes don't wait on each other
+	uint32_t counts[4][256];
+	uint64_t before;
+	size_t i;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		counts[0][pixels[i]]++;
+		counts[1][pixels[i + 1]]++;
+		counts[2][pixels[i + 2]]++;
+		counts[3][pixels[i + 3]]++;
+	}
+	for (; i < len; i++)
+		counts[0][pixels[i]]++;
+
+	before = histogram[TRANSPARENT_INDEX];
+	for (i = 0; i < 256; i++)
+		histogram[i] += (uint64_t)counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+
+	return histogram[TRANSPARENT_INDEX] - before;
+}
+
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer)
+{
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
+}
+
+static bool GrowTileSet(tileset_t* set, uint32_t count)
+{
+	uint32_t newcapacity, i;
+	void* p;
+
+	if (count <= set->capacity)
+		return true;
+
+	newcapacity = set->capacity ? set->capacity : 256;
+	while (newcapacity < count)
+		newcapacity *= 2;
+
+	if ((p = realloc(set->sizex, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	set->sizex = p;
+	if ((p = realloc(set->sizey, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	set->sizey = p;
+	if ((p = realloc(set->animdata, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	set->animdata = p;
+	if ((p = realloc(set->artfile, newcapacity * sizeof(int16_t))) == NULL)
+		return false;
+	set->artfile = p;
+
+	for (i = set->capacity; i < newcapacity; i++)
+	{
+		set->sizex[i] = 0;
+		set->sizey[i] = 0;
+		set->animdata[i] = 0;
+		set->artfile[i] = -1;
+	}
+
+	set->capacity = newcapacity;
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool MapFile(mappedfile_t* mf, const char* path)
+{
+	FILE* f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	mf->size = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	mf->data = malloc(mf->size + 1);
+	if (mf->data == NULL || fread(mf->data, 1, mf->size, f) != mf->size)
+	{
+		free(mf->data);
+		fclose(f);
+		return false;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static void UnmapFile(mappedfile_t* mf)
+{
+	free(mf->data);
+}
+
+#else
+
+static bool MapFile(mappedfile_t* mf, const char* path)
+{
+	struct stat st;
+
+	mf->fd = open(path, O_RDONLY);
+	if (mf->fd < 0)
+		return false;
+
+	if (fstat(mf->fd, &st) != 0)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	mf->size = st.st_size;
+	mf->data = NULL;
+	if (mf->size == 0)
+		return true;
+
+	mf->data = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, mf->fd, 0);
+	if (mf->data == MAP_FAILED)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	madvise(mf->data, mf->size, MADV_SEQUENTIAL);
+	return true;
+}
+
+static void UnmapFile(mappedfile_t* mf)
+{
+	if (mf->data != NULL)
+		munmap(mf->data, mf->size);
+	close(mf->fd);
+}
+
+#endif
+
+static void PrintSummary(void)
+{
+	uint32_t i;
+
+	if (jsonoutput)
+	{
+		printf("],\"files\":%u,\"tiles\":%u,\"pixels\":%" PRIu64 ",\"transparenttiles\":%u,\"emptytiles\":%u,"
+			"\"errors\":%u,\"warnings\":%u,\"histogram\":[",
+			numfiles, numtiles, numpixels, transparenttiles, emptytiles, numerrors, numwarnings);
+		for (i = 0; i < 256; i++)
+			printf("%s%" PRIu64, i ? "," : "", histogram[i]);
+		printf("]}\n");
+		return;
+	}
+
+	printf("\n%u files, %u tiles, %" PRIu64 " pixels\n", numfiles, numtiles, numpixels);
+	printf("index 255: %" PRIu64 " pixels (%.1f%%) in %u tiles, %u tiles are only index 255\n",
+		histogram[TRANSPARENT_INDEX],
+		numpixels ? 100.0 * histogram[TRANSPARENT_INDEX] / numpixels : 0.0,
+		transparenttiles, emptytiles);
+	printf("%u errors, %u warnings\n", numerrors, numwarnings);
+}
+
+static void Report(severity_e severity, const char* name, int32_t tile, const char* format, ...)
+{
+	va_list args;
+
+	if (severity == SEVERITY_ERROR)
+		numerrors++;
+	else
+		numwarnings++;
+
+	if (jsonoutput)
+	{
+		printf("%s{\"file\":\"%s\",\"severity\":\"%s\"", numerrors + numwarnings > 1 ? "," : "",
+			name, severity == SEVERITY_ERROR ? "error" : "warning");
+		if (tile >= 0)
+			printf(",\"tile\":%d", tile);
+		printf(",\"message\":\"");
+	}
+	else
+	{
+		printf("%s: %s: ", name, severity == SEVERITY_ERROR ? "error" : "warning");
+		if (tile >= 0)
+			printf("tile%04d.png: ", tile);
+	}
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+
+	printf(jsonoutput ? "\"}" : "\n");
+}
+
+int main(int argc, char* argv[])
+{
+	char cwd[FILENAME_MAX];
+	char dir[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	char name[16];
+	char* positional[2];
+	uint32_t npositional = 0;
+	uint32_t artcount, artn, j;
+	int32_t lasttile = -1;
+	mappedfile_t mf;
+	bool ok;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0)
+			jsonoutput = true;
+		else if (strcmp(argv[i], "--max-tiles") == 0 && i + 1 < argc)
+			maxtiles = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && npositional < 2)
+			positional[npositional++] = argv[i];
+		else
+		{
+			npositional = 0;
+			break;
+		}
+	}
+
+	// the banner would break the JSON
+	if (!jsonoutput)
+		printf("\n"
+			"artlint by SanyaWaffles\n"
+			"=======================\n\n");
+
+	if (npositional != 2)
+	{
+		printf("syntax: artlint [--json] [--max-tiles n] <num> <folder>\n"
+			"	Check the art files of a set before they go into a build\n"
+			"	headers, tile data against the file length, tile ranges across the files,\n"
+			"	animation frames, and the use of transparent index 255\n"
+			"	exit code is 0 when there are no errors, 1 when there are\n"
+			"	--max-tiles n   engine tile limit to warn about (default 9216)\n"
+			"	eg: artlint 19 tiles\n\n");
+		return 2;
+	}
+
+	GetCurrentDir(cwd, sizeof(cwd));
+	artcount = atoi(positional[0]);
+	sprintf(dir, "%s%s%s", cwd, PATH_DELIMITER, positional[1]);
+
+	if (jsonoutput)
+		printf("{\"problems\":[");
+
+	for (artn = 0; artn <= artcount; artn++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			sprintf(path, "%s%s", dir, PATH_DELIMITER);
+			sprintf(path + strlen(path), artnames[j], artn);
+			if (MapFile(&mf, path))
+				break;
+		}
+
+		sprintf(name, "TILES%03u.ART", artn);
+		if (j == 3)
+		{
+			Report(SEVERITY_ERROR, name, -1, "missing");
+			continue;
+		}
+
+		numfiles++;
+		ok = CheckArtFile(&mf, name, artn, &lasttile);
+		UnmapFile(&mf);
+		if (!ok)
+			return 2;
+	}
+
+	if (lasttile >= 0)
+		CheckAnimations((uint32_t)lasttile);
+
+	PrintSummary();
+
+	return numerrors == 0 ? EXIT_SUCCESS : 1;
+}
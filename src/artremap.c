@@ -0,0 +1,612 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Types and Constants
+//
+
+typedef		signed char		int8_t;
+typedef		signed short	int16_t;
+typedef		signed int		int32_t;
+typedef	  unsigned char		uint8_t;
+typedef	  unsigned short	uint16_t;
+typedef	  unsigned int		uint32_t;
+
+#define		PATH_DELIMITER "/"
+
+#ifdef _WIN32		// If we're on Win32/Win64
+
+#include <direct.h>
+#define GetCurrentDir _getcwd
+
+#else				// If we're on *nix/Apple Mac OS X
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GetCurrentDir getcwd
+
+#endif
+
+#ifndef __cplusplus
+typedef enum {false, true} bool;
+#endif
+
+#include "artkernels.h"
+
+// An ART file mapped into memory. On Windows the file is simply read
+// into a buffer and written back when it is unmapped.
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	bool writable;
+#ifdef _WIN32
+	char path[FILENAME_MAX];
+#else
+	int fd;
+#endif
+} mappedfile_t;
+
+#define MAP_SIZE 256				// One entry per palette index
+#define PALETTE_SIZE (256 * 3)		// Palette size (768)
+#define TRANSPARENT_INDEX 255		// Never remapped when deriving a map
+
+//
+// Global Variables
+//
+
+// ART file name spellings we accept: art2png reads .ART, png2art writes .art
+static const char* artnames[3] = {"TILES%03u.ART", "TILES%03u.art", "tiles%03u.art"};
+
+// Index map applied to every pixel byte
+static uint8_t indexmap[MAP_SIZE];
+
+//
+// Functions
+//
+
+// PROTOTYPES
+// Build the index map from two palettes by nearest color
+static bool DeriveMapFromPalettes(const char* fromname, const char* toname);
+
+// Locate TILESxxx.ART in dir under any accepted spelling
+static bool FindArtFile(const char* dir, uint32_t artn, char* name);
+
+// Get a uint32_t from a little-endian ordered buffer
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
+
+// Find where the pixel data of a mapped ART file starts and how long it is
+static bool GetPixelDataRange(const mappedfile_t* mf, size_t* start, size_t* length);
+
+// Load a 256 byte index map from a file
+static bool LoadIndexMap(const char* mapname);
+
+// Load the palswap table number swapnum from LOOKUP.DAT
+static bool LoadLookupMap(const char* lookupname, uint32_t swapnum);
+
+// Load a palette as 8-bit RGB triplets
+static bool LoadPalette(const char* pfname, uint8_t* pal);
+
+// Map a file into memory, optionally creating it with the given size
+static bool MapFile(mappedfile_t* mf, const char* path, bool writable, size_t createsize);
+
+// Remap an ART file, in place if outname is NULL
+static bool RemapArtFile(const char* inname, const char* outname);
+
+// Release a mapping, flushing it to disk if it was writable
+static bool UnmapFile(mappedfile_t* mf);
+
+// Implementations
+static bool DeriveMapFromPalettes(const char* fromname, const char* toname)
+{
+	uint8_t frompal[PALETTE_SIZE], topal[PALETTE_SIZE];
+	uint32_t i;
+	int32_t dr, dg, db, samedist, bestdist;
+
+	if (!LoadPalette(fromname, frompal) || !LoadPalette(toname, topal))
+		return false;
+
+	// the transparent index is never a target
+	ArtKernels.NearestColors(topal, TRANSPARENT_INDEX, frompal, indexmap, MAP_SIZE);
+
+	for (i = 0; i < MAP_SIZE; i++)
+	{
+		if (i == TRANSPARENT_INDEX)
+		{
+			indexmap[i] = TRANSPARENT_INDEX;
+			continue;
+		}
+
+		// unchanged colors keep their index even when the palette holds
+		// duplicates
+		dr = frompal[i * 3] - topal[i * 3];
+		dg = frompal[i * 3 + 1] - topal[i * 3 + 1];
+		db = frompal[i * 3 + 2] - topal[i * 3 + 2];
+		samedist = dr * dr + dg * dg + db * db;
+
+		dr = frompal[i * 3] - topal[indexmap[i] * 3];
+		dg = frompal[i * 3 + 1] - topal[indexmap[i] * 3 + 1];
+		db = frompal[i * 3 + 2] - topal[indexmap[i] * 3 + 2];
+		bestdist = dr * dr + dg * dg + db * db;
+
+		if (samedist <= bestdist)
+			indexmap[i] = (uint8_t)i;
+	}
+
+	return true;
+}
+
+static bool FindArtFile(const char* dir, uint32_t artn, char* name)
+{
+	FILE* f;
+	char path[FILENAME_MAX];
+	uint32_t i;
+
+	for (i = 0; i < 3; i++)
+	{
+		sprintf(name, artnames[i], artn);
+		sprintf(path, "%s%s%s", dir, PATH_DELIMITER, name);
+		f = fopen(path, "rb");
+		if (f != NULL)
+		{
+			fclose(f);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static bool GetPixelDataRange(const mappedfile_t* mf, size_t* start, size_t* length)
+{
+	uint32_t ver, tilestartnum, tileendnum, numtiles;
+	uint32_t i;
+	size_t total;
+	const uint8_t* sizes;
+
+	if (mf->size < 16)
+	{
+		printf("error: invalid ART file: not enough header data\n");
+		return false;
+	}
+
+	ver = GetLittleEndianUInt32(&mf->data[0]);
+	tilestartnum = GetLittleEndianUInt32(&mf->data[8]);
+	tileendnum = GetLittleEndianUInt32(&mf->data[12]);
+
+	if (ver != 1)
+	{
+		printf("error: invalid ART file: invalid version number(%u)\n", ver);
+		return false;
+	}
+	if (tileendnum < tilestartnum)
+	{
+		printf("error: invalid ART file: last tile (%u) before first tile (%u)\n",
+			tileendnum, tilestartnum);
+		return false;
+	}
+
+	numtiles = tileendnum - tilestartnum + 1;
+	if ((mf->size - 16) / 8 < numtiles)
+	{
+		printf("error: invalid ART file: %u tiles declared but the header is truncated\n", numtiles);
+		return false;
+	}
+
+	// sizex[] then sizey[], both uint16_t
+	sizes = &mf->data[16];
+	total = 0;
+	for (i = 0; i < numtiles; i++)
+		total += (size_t)(sizes[i * 2] | (sizes[i * 2 + 1] << 8)) *
+			(sizes[numtiles * 2 + i * 2] | (sizes[numtiles * 2 + i * 2 + 1] << 8));
+
+	*start = 16 + (size_t)numtiles * (2 + 2 + 4);
+	if (total > mf->size - *start)
+	{
+		printf("error: invalid ART file: tile data runs past the end of the file\n");
+		return false;
+	}
+	*length = total;
+
+	return true;
+}
+
+static bool LoadIndexMap(const char* mapname)
+{
+	FILE* mfile;
+
+	mfile = fopen(mapname, "rb");
+	if (mfile == NULL)
+	{
+		printf("error: cannot open index map %s\n", mapname);
+		return false;
+	}
+
+	if (fread(indexmap, 1, MAP_SIZE, mfile) != MAP_SIZE)
+	{
+		printf("error: index map %s is shorter than %u bytes\n", mapname, MAP_SIZE);
+		fclose(mfile);
+		return false;
+	}
+
+	fclose(mfile);
+	return true;
+}
+
+static bool LoadLookupMap(const char* lookupname, uint32_t swapnum)
+{
+	FILE* lfile;
+	int32_t numswaps, id;
+	uint8_t table[MAP_SIZE];
+
+	lfile = fopen(lookupname, "rb");
+	if (lfile == NULL)
+	{
+		printf("error: cannot open %s\n", lookupname);
+		return false;
+	}
+
+	// LOOKUP.DAT: count, then (id, 256 byte table) for each palswap
+	numswaps = fgetc(lfile);
+	while (numswaps-- > 0)
+	{
+		id = fgetc(lfile);
+		if (id == EOF || fread(table, 1, MAP_SIZE, lfile) != MAP_SIZE)
+			break;
+
+		if ((uint32_t)id == swapnum)
+		{
+			memcpy(indexmap, table, MAP_SIZE);
+			fclose(lfile);
+			return true;
+		}
+	}
+
+	printf("error: palswap %u not found in %s\n", swapnum, lookupname);
+	fclose(lfile);
+	return false;
+}
+
+static bool LoadPalette(const char* pfname, uint8_t* pal)
+{
+	FILE* pfile;
+	uint32_t i;
+	uint8_t maxval;
+
+	pfile = fopen(pfname, "rb");
+	if (pfile == NULL)
+	{
+		printf("error: cannot open palette %s\n", pfname);
+		return false;
+	}
+
+	if (fread(pal, 1, PALETTE_SIZE, pfile) != PALETTE_SIZE)
+	{
+		printf("error: cannot read the whole palette from %s\n", pfname);
+		fclose(pfile);
+		return false;
+	}
+	fclose(pfile);
+
+	// PALETTE.DAT stores 6-bit VGA values, .act files full 8-bit ones
+	maxval = 0;
+	for (i = 0; i < PALETTE_SIZE; i++)
+		if (pal[i] > maxval)
+			maxval = pal[i];
+
+	if (maxval < 64)
+		for (i = 0; i < PALETTE_SIZE; i++)
+			pal[i] *= 4;
+
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool MapFile(mappedfile_t* mf, const char* path, bool writable, size_t createsize)
+{
+	FILE* f;
+	long len;
+
+	mf->writable = writable;
+	strcpy(mf->path, path);
+
+	if (createsize != 0)
+	{
+		mf->size = createsize;
+		mf->data = malloc(createsize);
+		return mf->data != NULL;
+	}
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	mf->size = (size_t)len;
+	mf->data = malloc(mf->size + 1);
+	if (mf->data == NULL || fread(mf->data, 1, mf->size, f) != mf->size)
+	{
+		free(mf->data);
+		fclose(f);
+		return false;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static bool UnmapFile(mappedfile_t* mf)
+{
+	FILE* f;
+	bool ok = true;
+
+	if (mf->writable)
+	{
+		f = fopen(mf->path, "wb");
+		if (f == NULL || fwrite(mf->data, 1, mf->size, f) != mf->size)
+			ok = false;
+		if (f != NULL)
+			fclose(f);
+	}
+
+	free(mf->data);
+	return ok;
+}
+
+#else
+
+static bool MapFile(mappedfile_t* mf, const char* path, bool writable, size_t createsize)
+{
+	struct stat st;
+
+	mf->writable = writable;
+
+	if (createsize != 0)
+		mf->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	else
+		mf->fd = open(path, writable ? O_RDWR : O_RDONLY);
+
+	if (mf->fd < 0)
+		return false;
+
+	if (createsize != 0)
+	{
+		if (ftruncate(mf->fd, createsize) != 0)
+		{
+			close(mf->fd);
+			return false;
+		}
+		mf->size = createsize;
+	}
+	else
+	{
+		if (fstat(mf->fd, &st) != 0)
+		{
+			close(mf->fd);
+			return false;
+		}
+		mf->size = st.st_size;
+	}
+
+	// mmap() refuses empty mappings; an empty ART file fails the header check anyway
+	if (mf->size == 0)
+	{
+		mf->data = NULL;
+		return true;
+	}
+
+	mf->data = mmap(NULL, mf->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		MAP_SHARED, mf->fd, 0);
+	if (mf->data == MAP_FAILED)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	// we walk every byte front to back exactly once
+	madvise(mf->data, mf->size, MADV_SEQUENTIAL);
+
+	return true;
+}
+
+static bool UnmapFile(mappedfile_t* mf)
+{
+	if (mf->data != NULL)
+		munmap(mf->data, mf->size);
+
+	return close(mf->fd) == 0;
+}
+
+#endif
+
+static bool RemapArtFile(const char* inname, const char* outname)
+{
+	mappedfile_t src, dst;
+	char temppath[FILENAME_MAX];
+	size_t start, length;
+	bool ok;
+
+	if (!MapFile(&src, inname, outname == NULL, 0))
+	{
+		printf("error: cannot open %s\n", inname);
+		return false;
+	}
+
+	if (!GetPixelDataRange(&src, &start, &length))
+	{
+		src.writable = false;
+		UnmapFile(&src);
+		return false;
+	}
+
+	// in place: the header and animdata are left alone, only pixels change
+	if (outname == NULL)
+	{
+		ArtKernels.Remap(&src.data[start], &src.data[start], length, indexmap);
+		return UnmapFile(&src);
+	}
+
+	// folder out may be folder in, truncating outname would pull the
+	// pixels from under the source mapping
+	sprintf(temppath, "%s.tmp", outname);
+	if (!MapFile(&dst, temppath, true, src.size))
+	{
+		printf("error: cannot create %s\n", temppath);
+		UnmapFile(&src);
+		return false;
+	}
+
+	memcpy(dst.data, src.data, start);
+	ArtKernels.Remap(&src.data[start], &dst.data[start], length, indexmap);
+	memcpy(&dst.data[start + length], &src.data[start + length], src.size - start - length);
+
+	UnmapFile(&src);
+	ok = UnmapFile(&dst);
+
+#ifdef _WIN32
+	if (ok)
+		remove(outname);
+#endif
+	if (!ok || rename(temppath, outname) != 0)
+	{
+		printf("error: cannot write %s\n", outname);
+		remove(temppath);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	char cwd[FILENAME_MAX];
+	char dirin[FILENAME_MAX];
+	char dirout[FILENAME_MAX];
+	char artname[FILENAME_MAX];
+	char inpath[FILENAME_MAX];
+	char outpath[FILENAME_MAX];
+	char* positional[3];
+	uint32_t npositional = 0;
+	uint32_t artn, artcount;
+	bool havemap = false;
+	bool inplace;
+	int i;
+
+	printf("\n"
+		"artremap by SanyaWaffles\n"
+		"========================\n\n");
+
+	GetCurrentDir(cwd, sizeof(cwd));
+	SelectArtKernels(NULL);
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+		{
+			if (!SelectArtKernels(argv[++i]))
+			{
+				printf("error: --isa %s is unknown or this cpu can't run it\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc)
+		{
+			if (!LoadIndexMap(argv[++i]))
+				return EXIT_FAILURE;
+			havemap = true;
+		}
+		else if (strcmp(argv[i], "--palettes") == 0 && i + 2 < argc)
+		{
+			if (!DeriveMapFromPalettes(argv[i + 1], argv[i + 2]))
+				return EXIT_FAILURE;
+			i += 2;
+			havemap = true;
+		}
+		else if (strcmp(argv[i], "--lookup") == 0 && i + 2 < argc)
+		{
+			if (!LoadLookupMap(argv[i + 1], atoi(argv[i + 2])))
+				return EXIT_FAILURE;
+			i += 2;
+			havemap = true;
+		}
+		else if (argv[i][0] != '-' && npositional < 3)
+			positional[npositional++] = argv[i];
+		else
+		{
+			npositional = 0;
+			break;
+		}
+	}
+
+	if (!havemap || npositional < 2)
+	{
+		printf("syntax: artremap <num> <folder in> [folder out] <map>\n"
+			"	Rewrite the pixel indexes of art files without converting them\n"
+			"	<map> is one of:\n"
+			"		--map <file>                256 byte table, entry i is the new index for i\n"
+			"		--palettes <from> <to>      nearest color in <to> for each color of <from>\n"
+			"		--lookup <lookup.dat> <n>   palswap n from LOOKUP.DAT\n"
+			"	without a folder out the art files are remapped in place\n"
+			"	--isa <name> picks the pixel kernels: scalar, sse2, avx2 or avx512\n"
+			"	eg: artremap 19 folderin folderout --lookup LOOKUP.DAT 21\n\n");
+		return EXIT_FAILURE;
+	}
+
+	artcount = atoi(positional[0]);
+	sprintf(dirin, "%s%s%s", cwd, PATH_DELIMITER, positional[1]);
+	inplace = npositional < 3;
+	if (!inplace)
+		sprintf(dirout, "%s%s%s", cwd, PATH_DELIMITER, positional[2]);
+
+	for (artn = 0; artn <= artcount; artn++)
+	{
+		if (!FindArtFile(dirin, artn, artname))
+		{
+			printf("error: TILES%03u.ART not found in %s\n", artn, dirin);
+			return EXIT_FAILURE;
+		}
+
+		printf("Remapping %s...", artname);
+		fflush(stdout);
+
+		sprintf(inpath, "%s%s%s", dirin, PATH_DELIMITER, artname);
+		if (!inplace)
+			sprintf(outpath, "%s%s%s", dirout, PATH_DELIMITER, artname);
+
+		if (!RemapArtFile(inpath, inplace ? NULL : outpath))
+			return EXIT_FAILURE;
+
+		printf(" done\n");
+	}
+
+	printf("\n");
+	return EXIT_SUCCESS;
+}
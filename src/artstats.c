@@ -0,0 +1,572 @@
+/* Copyright (C) 2012 SanyaWaffles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Types and Constants
+//
+
+#define		PATH_DELIMITER "/"
+
+#ifdef _WIN32		// If we're on Win32/Win64
+
+#include <direct.h>
+#define GetCurrentDir _getcwd
+
+#else				// If we're on *nix/Apple Mac OS X
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GetCurrentDir getcwd
+
+#endif
+
+#ifndef __cplusplus
+typedef enum {false, true} bool;
+#endif
+
+// An ART file mapped into memory (read into a buffer on Windows)
+typedef struct {
+	uint8_t* data;
+	size_t size;
+#ifndef _WIN32
+	int fd;
+#endif
+} mappedfile_t;
+
+// A tile of the set with pixels, and where they are
+typedef struct {
+	const uint8_t* pixels;		// in the mapped ART file
+	uint32_t tilenum;
+	uint16_t sizex;
+	uint16_t sizey;
+	uint32_t artfile;			// index into the mapped files
+} tileinfo_t;
+
+#define TRANSPARENT_INDEX 255
+#define MAX_TILE_NUMBER 1048575		// far beyond any build game, header is garbage
+#define PALETTE_ROWS 16				// the palette as a 16x16 grid, where the shade ramps sit
+
+//
+// Global Variables
+//
+
+// ART file name spellings we accept: art2png reads .ART, png2art writes .art
+static const char* artnames[3] = {"TILES%03u.ART", "TILES%03u.art", "tiles%03u.art"};
+
+static mappedfile_t* artfiles = NULL;
+static uint32_t* artnumbers = NULL;		// TILESnnn of each mapped file
+static uint32_t numartfiles = 0;
+
+// Tiles with pixels, in tile order, and a histogram for each
+static tileinfo_t* tiles = NULL;
+static uint32_t (*tilehistograms)[256] = NULL;
+static uint32_t numtiles = 0;
+static uint32_t tilecapacity = 0;
+static uint32_t emptytiles = 0;			// 0x0 tiles, in no histogram
+
+// Counting: the threads take the next tile until none are left
+static uint32_t numthreads = 0;
+static uint32_t nexttile = 0;			// only touched through __atomic builtins
+
+static uint32_t rarelimit = 8;			// --rare, indexes used by at most this many tiles
+static bool printhistograms = false;	// --tile-histograms
+
+//
+// Functions
+//
+
+// PROTOTYPES
+// Read the header of a mapped ART file and add its tiles to the set
+static bool AddArtFile(const mappedfile_t* mf, const char* name, uint32_t filen);
+
+// Count the palette indexes of len bytes into counts
+static void CountIndexes(const uint8_t* pixels, size_t len, uint32_t* counts);
+
+// Counting thread, takes tiles until none are left
+static void* CountThread(void* arg);
+
+// Get a uint16_t from a little-endian ordered buffer
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
+
+// Get a uint32_t from a little-endian ordered buffer
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
+
+// Map a file read-only into memory
+static bool MapFile(mappedfile_t* mf, const char* path);
+
+// Print the totals of a histogram: pixels, index 255, used and unused indexes, palette rows
+static void PrintTotals(const uint64_t* histogram, uint32_t tilecount, uint32_t tilesusing255);
+
+// Print the rare indexes and the tiles that use them
+static void PrintRareIndexes(void);
+
+// Print one line per tile
+static void PrintTiles(void);
+
+// Release a mapping
+static void UnmapFile(mappedfile_t* mf);
+
+// Implementations
+static bool AddArtFile(const mappedfile_t* mf, const char* name, uint32_t filen)
+{
+	uint32_t ver, tilestartnum, tileendnum, count;
+	uint32_t i, picsize;
+	size_t crtoffset;
+	const uint8_t* header = mf->data;
+	void* p;
+
+	if (mf->size < 16)
+	{
+		fprintf(stderr, "warning: %s: not enough header data, skipped\n", name);
+		return true;
+	}
+
+	ver = GetLittleEndianUInt32(&header[0]);
+	tilestartnum = GetLittleEndianUInt32(&header[8]);
+	tileendnum = GetLittleEndianUInt32(&header[12]);
+	count = tileendnum - tilestartnum + 1;
+
+	if (ver != 1 || tileendnum < tilestartnum || tileendnum > MAX_TILE_NUMBER ||
+		(mf->size - 16) / (2 + 2 + 4) < count)
+	{
+		fprintf(stderr, "warning: %s: invalid header, skipped (artlint tells what is wrong)\n", name);
+		return true;
+	}
+
+	if (numtiles + count > tilecapacity)
+	{
+		tilecapacity = tilecapacity ? tilecapacity : 1024;
+		while (tilecapacity < numtiles + count)
+			tilecapacity *= 2;
+		if ((p = realloc(tiles, tilecapacity * sizeof(tileinfo_t))) == NULL)
+			return false;
+		tiles = p;
+	}
+
+	crtoffset = 16 + (size_t)count * (2 + 2 + 4);
+	for (i = 0; i < count; i++)
+	{
+		tiles[numtiles].tilenum = tilestartnum + i;
+		tiles[numtiles].sizex = GetLittleEndianUInt16(&header[16 + i * 2]);
+		tiles[numtiles].sizey = GetLittleEndianUInt16(&header[16 + count * 2 + i * 2]);
+		tiles[numtiles].artfile = filen;
+		tiles[numtiles].pixels = &mf->data[crtoffset];
+
+		picsize = tiles[numtiles].sizex * tiles[numtiles].sizey;
+		if (picsize > mf->size - crtoffset)
+		{
+			fprintf(stderr, "warning: %s: tile data runs past the end of the file from tile %u on\n",
+				name, tilestartnum + i);
+			break;
+		}
+
+		crtoffset += picsize;
+		if (picsize == 0)
+			emptytiles++;
+		else
+			numtiles++;
+	}
+
+	return true;
+}
+
+static void CountIndexes(const uint8_t* pixels, size_t len, uint32_t* counts)
+{
+	// four tables so back to back equal bytes don't wait on each other
+	uint32_t tables[4][256];
+	size_t i;
+
+	memset(tables, 0, sizeof(tables));
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		tables[0][pixels[i]]++;
+		tables[1][pixels[i + 1]]++;
+		tables[2][pixels[i + 2]]++;
+		tables[3][pixels[i + 3]]++;
+	}
+	for (; i < len; i++)
+		tables[0][pixels[i]]++;
+
+	for (i = 0; i < 256; i++)
+		counts[i] = tables[0][i] + tables[1][i] + tables[2][i] + tables[3][i];
+}
+
+static void* CountThread(void* arg)
+{
+	uint32_t t;
+
+	(void)arg;
+
+	// tiles differ a lot in size, so they are handed out one by one
+	while ((t = __atomic_fetch_add(&nexttile, 1, __ATOMIC_RELAXED)) < numtiles)
+		CountIndexes(tiles[t].pixels, (size_t)tiles[t].sizex * tiles[t].sizey, tilehistograms[t]);
+
+	return NULL;
+}
+
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer)
+{
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+#ifdef _WIN32
+
+static bool MapFile(mappedfile_t* mf, const char* path)
+{
+	FILE* f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	mf->size = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	mf->data = malloc(mf->size + 1);
+	if (mf->data == NULL || fread(mf->data, 1, mf->size, f) != mf->size)
+	{
+		free(mf->data);
+		fclose(f);
+		return false;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static void UnmapFile(mappedfile_t* mf)
+{
+	free(mf->data);
+}
+
+#else
+
+static bool MapFile(mappedfile_t* mf, const char* path)
+{
+	struct stat st;
+
+	mf->fd = open(path, O_RDONLY);
+	if (mf->fd < 0)
+		return false;
+
+	if (fstat(mf->fd, &st) != 0)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	mf->size = st.st_size;
+	mf->data = NULL;
+	if (mf->size == 0)
+		return true;
+
+	mf->data = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, mf->fd, 0);
+	if (mf->data == MAP_FAILED)
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	// the threads read the tiles out of order, so read all of it ahead
+	madvise(mf->data, mf->size, MADV_WILLNEED);
+	return true;
+}
+
+static void UnmapFile(mappedfile_t* mf)
+{
+	if (mf->data != NULL)
+		munmap(mf->data, mf->size);
+	close(mf->fd);
+}
+
+#endif
+
+static void PrintTotals(const uint64_t* histogram, uint32_t tilecount, uint32_t tilesusing255)
+{
+	uint64_t pixels = 0, rows[PALETTE_ROWS];
+	uint32_t i, used = 0;
+	bool first = true;
+
+	memset(rows, 0, sizeof(rows));
+	for (i = 0; i < 256; i++)
+	{
+		pixels += histogram[i];
+		rows[i / (256 / PALETTE_ROWS)] += histogram[i];
+		if (i != TRANSPARENT_INDEX && histogram[i] != 0)
+			used++;
+	}
+
+	printf("\"tiles\":%u,\"pixels\":%" PRIu64 ",\"transparent\":%" PRIu64 ",\"transparentratio\":%.4f,"
+		"\"tilesusing255\":%u,\"used\":%u,\"unused\":[",
+		tilecount, pixels, histogram[TRANSPARENT_INDEX],
+		pixels ? (double)histogram[TRANSPARENT_INDEX] / pixels : 0.0, tilesusing255, used);
+
+	// index 255 is the transparent color, it is never unused
+	for (i = 0; i < TRANSPARENT_INDEX; i++)
+	{
+		if (histogram[i] == 0)
+		{
+			printf("%s%u", first ? "" : ",", i);
+			first = false;
+		}
+	}
+
+	printf("],\"rows\":[");
+	for (i = 0; i < PALETTE_ROWS; i++)
+		printf("%s%" PRIu64, i ? "," : "", rows[i]);
+
+	printf("],\"histogram\":[");
+	for (i = 0; i < 256; i++)
+		printf("%s%" PRIu64, i ? "," : "", histogram[i]);
+	printf("]");
+}
+
+static void PrintRareIndexes(void)
+{
+	uint32_t tilesusing[256];
+	uint64_t pixels[256];
+	uint32_t i, t;
+	bool first = true, firsttile;
+
+	memset(tilesusing, 0, sizeof(tilesusing));
+	memset(pixels, 0, sizeof(pixels));
+	for (t = 0; t < numtiles; t++)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			tilesusing[i] += tilehistograms[t][i] != 0;
+			pixels[i] += tilehistograms[t][i];
+		}
+	}
+
+	printf("\"rare\":[");
+	for (i = 0; i < TRANSPARENT_INDEX; i++)
+	{
+		if (tilesusing[i] == 0 || tilesusing[i] > rarelimit)
+			continue;
+
+		printf("%s\n\t{\"index\":%u,\"pixels\":%" PRIu64 ",\"tiles\":[", first ? "" : ",", i, pixels[i]);
+		first = false;
+
+		firsttile = true;
+		for (t = 0; t < numtiles; t++)
+		{
+			if (tilehistograms[t][i] == 0)
+				continue;
+			printf("%s%u", firsttile ? "" : ",", tiles[t].tilenum);
+			firsttile = false;
+		}
+		printf("]}");
+	}
+	printf("\n]");
+}
+
+static void PrintTiles(void)
+{
+	uint32_t t, i, used;
+	uint32_t pixels;
+
+	printf("\"tiles\":[");
+	for (t = 0; t < numtiles; t++)
+	{
+		pixels = tiles[t].sizex * tiles[t].sizey;
+		for (i = 0, used = 0; i < TRANSPARENT_INDEX; i++)
+			used += tilehistograms[t][i] != 0;
+
+		printf("%s\n\t{\"tile\":%u,\"file\":%u,\"sizex\":%u,\"sizey\":%u,\"transparent\":%u,"
+			"\"transparentratio\":%.4f,\"used\":%u",
+			t ? "," : "", tiles[t].tilenum, artnumbers[tiles[t].artfile], tiles[t].sizex, tiles[t].sizey,
+			tilehistograms[t][TRANSPARENT_INDEX], (double)tilehistograms[t][TRANSPARENT_INDEX] / pixels, used);
+
+		if (printhistograms)
+		{
+			printf(",\"histogram\":[");
+			for (i = 0; i < 256; i++)
+				printf("%s%u", i ? "," : "", tilehistograms[t][i]);
+			printf("]");
+		}
+		printf("}");
+	}
+	printf("\n]");
+}
+
+int main(int argc, char* argv[])
+{
+	char cwd[FILENAME_MAX];
+	char dir[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	char name[16];
+	char* positional[2];
+	uint32_t npositional = 0;
+	uint32_t artcount, artn, j, t, tilecount, tilesusing255;
+	uint64_t histogram[256];
+	int32_t threads = -1;
+	pthread_t* counters;
+	void* p;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--rare") == 0 && i + 1 < argc)
+			rarelimit = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--tile-histograms") == 0)
+			printhistograms = true;
+		else if (argv[i][0] != '-' && npositional < 2)
+			positional[npositional++] = argv[i];
+		else
+		{
+			npositional = 0;
+			break;
+		}
+	}
+
+	// no banner, the output is JSON
+	if (npositional != 2)
+	{
+		printf("syntax: artstats [options] <num> <folder>\n"
+			"	Count which palette indexes the art files of a set use, per tile, per file\n"
+			"	and for the whole set, and print it as JSON\n"
+			"	--threads n         counting threads (default: one per cpu)\n"
+			"	--rare n            list the tiles of indexes used by at most n tiles (default 8)\n"
+			"	--tile-histograms   add the 256 counts of every tile\n"
+			"	eg: artstats 19 tiles > stats.json\n\n");
+		return 2;
+	}
+
+	if (threads < 0)
+	{
+#ifdef _WIN32
+		char* cpus = getenv("NUMBER_OF_PROCESSORS");
+		threads = cpus != NULL ? atoi(cpus) : 1;
+#else
+		threads = (int32_t)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	numthreads = threads > 0 ? threads : 1;
+
+	GetCurrentDir(cwd, sizeof(cwd));
+	artcount = atoi(positional[0]);
+	sprintf(dir, "%s%s%s", cwd, PATH_DELIMITER, positional[1]);
+
+	artfiles = calloc(artcount + 1, sizeof(mappedfile_t));
+	artnumbers = calloc(artcount + 1, sizeof(uint32_t));
+	if (artfiles == NULL || artnumbers == NULL)
+	{
+		fprintf(stderr, "error: cannot alloc enough memory for %u art files\n", artcount + 1);
+		return 2;
+	}
+
+	// every file stays mapped until the counting is done
+	for (artn = 0; artn <= artcount; artn++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			sprintf(path, "%s%s", dir, PATH_DELIMITER);
+			sprintf(path + strlen(path), artnames[j], artn);
+			if (MapFile(&artfiles[numartfiles], path))
+				break;
+		}
+
+		sprintf(name, "TILES%03u.ART", artn);
+		if (j == 3)
+		{
+			fprintf(stderr, "warning: %s is missing\n", name);
+			continue;
+		}
+
+		artnumbers[numartfiles] = artn;
+		if (!AddArtFile(&artfiles[numartfiles], name, numartfiles))
+		{
+			fprintf(stderr, "error: cannot alloc enough memory for the tiles of %s\n", name);
+			return 2;
+		}
+		numartfiles++;
+	}
+
+	p = calloc(numtiles ? numtiles : 1, sizeof(tilehistograms[0]));
+	counters = calloc(numthreads, sizeof(pthread_t));
+	if (p == NULL || counters == NULL)
+	{
+		fprintf(stderr, "error: cannot alloc enough memory for %u tile histograms\n", numtiles);
+		return 2;
+	}
+	tilehistograms = p;
+
+	// the main thread counts too
+	for (j = 1; j < numthreads; j++)
+	{
+		if (pthread_create(&counters[j], NULL, CountThread, NULL) != 0)
+			break;
+	}
+	CountThread(NULL);
+	while (--j > 0)
+		pthread_join(counters[j], NULL);
+	free(counters);
+
+	printf("{\"files\":[");
+	for (artn = 0, t = 0; artn < numartfiles; artn++)
+	{
+		memset(histogram, 0, sizeof(histogram));
+		for (tilecount = 0, tilesusing255 = 0; t < numtiles && tiles[t].artfile == artn; t++, tilecount++)
+		{
+			for (j = 0; j < 256; j++)
+				histogram[j] += tilehistograms[t][j];
+			tilesusing255 += tilehistograms[t][TRANSPARENT_INDEX] != 0;
+		}
+
+		printf("%s\n\t{\"file\":\"TILES%03u.ART\",", artn ? "," : "", artnumbers[artn]);
+		PrintTotals(histogram, tilecount, tilesusing255);
+		printf("}");
+	}
+	printf("\n],\n\"set\":{\"files\":%u,\"emptytiles\":%u,", numartfiles, emptytiles);
+
+	memset(histogram, 0, sizeof(histogram));
+	for (t = 0, tilesusing255 = 0; t < numtiles; t++)
+	{
+		for (j = 0; j < 256; j++)
+			histogram[j] += tilehistograms[t][j];
+		tilesusing255 += tilehistograms[t][TRANSPARENT_INDEX] != 0;
+	}
+	PrintTotals(histogram, numtiles, tilesusing255);
+	printf("},\n");
+
+	PrintRareIndexes();
+	printf(",\n");
+	PrintTiles();
+	printf("\n}\n");
+
+	for (artn = 0; artn < numartfiles; artn++)
+		UnmapFile(&artfiles[artn]);
+
+	return EXIT_SUCCESS;
+}
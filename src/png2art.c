@@ -17,9 +17,13 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <FreeImage.h>
 
@@ -27,20 +31,92 @@
 // Types and Constants
 //
 
-typedef		signed char		int8_t;
-typedef		signed short	int16_t;
-typedef		signed int		int32_t;
-typedef	  unsigned char		uint8_t;
-typedef	  unsigned short	uint16_t;
-typedef	  unsigned int		uint32_t;
-
-// Tile Struct
+// Tile table, indexed by tile number. Each header field gets its own
+// array so writing one header field only walks the memory it needs.
+typedef struct {
+	uint32_t capacity;
+	uint16_t* sizex;
+	uint16_t* sizey;
+	uint32_t* animdata;
+	uint32_t* offset;
+	uint8_t** pngdata;			// PNGs read from the tar stream, only used with --in-tar
+	uint32_t* pngsize;
+	uint8_t* source;			// SOURCE_PNG or SOURCE_RAW when the tile is in inputdir or the tar stream
+} tiletable_t;
+
+// One tile on its way from the PNG to the ART file
 typedef struct {
+	uint32_t seq;				// position in the ART file
+	uint32_t tilenum;
+	uint8_t* pngdata;			// PNG from the tar stream, NULL loads tileNNNN.png
+	uint32_t pngsize;
+	uint8_t* pixels;			// column-major palette indexes from the pool, filled in by a decoder
+	uint8_t* dest;				// place of the tile in the mapped art file, NULL for a pool buffer
 	uint16_t sizex;
 	uint16_t sizey;
-	uint32_t animdata;
-	uint32_t offset;
-} tile_t;
+	uint32_t reserved;			// bytes counted against --max-memory
+} tilejob_t;
+
+// Free buffer of the pool, the link sits where the buffer's data goes
+typedef struct poolbuffer_s {
+	struct poolbuffer_s* next;
+} poolbuffer_t;
+
+// Bounded lock-free queue of jobs, any number of producers and consumers.
+// Each cell's sequence number says whether it is ready to be written or read.
+typedef struct {
+	uint32_t sequence;
+	tilejob_t* job;
+} queuecell_t;
+
+typedef struct {
+	queuecell_t* cells;
+	uint32_t mask;
+	uint8_t pad0[64];			// keep both ends on their own cache line
+	uint32_t enqueuepos;
+	uint8_t pad1[64];
+	uint32_t dequeuepos;
+	uint8_t pad2[64];
+} jobqueue_t;
+
+// Adata###.ini read from a tar stream
+typedef struct {
+	uint32_t artfilenum;
+	char* text;
+	uint32_t size;
+} inifile_t;
+
+// Game Profile Struct
+typedef struct {
+	const char* name;
+	uint32_t tilesperfile;		// tiles in each TILESxxx.ART
+	uint32_t maxtiles;			// engine tile limit, only used for warnings
+} gameprofile_t;
+
+// Token Type Struct, for the animation manifest
+typedef enum {
+	TOKEN_EOF,
+	TOKEN_LBRACE,
+	TOKEN_RBRACE,
+	TOKEN_LBRACKET,
+	TOKEN_RBRACKET,
+	TOKEN_COLON,
+	TOKEN_COMMA,
+	TOKEN_STRING,
+	TOKEN_NUMBER,
+	TOKEN_LITERAL,				// true, false or null
+	TOKEN_ERROR
+} tokentype_e;
+
+// Manifest Tokenizer Struct, walks the file once
+typedef struct {
+	const char* cursor;
+	uint32_t line;
+	tokentype_e type;
+	const char* text;			// string contents without the quotes
+	uint32_t length;
+	int32_t number;
+} jsonlexer_t;
 
 // Line Type Struct
 typedef enum {
@@ -50,43 +126,149 @@ typedef enum {
 	LINE_TYPE_EOF
 } linetype_e;
 
+// How true color pngs get their palette indexes
+typedef enum {
+	DITHER_NONE,				// NeuQuant against the palette
+	DITHER_ORDERED,				// Bayer matrix
+	DITHER_BLUENOISE			// void-and-cluster matrix
+} dither_e;
+
 
 #define		PATH_DELIMITER "/"
 
 #ifdef _WIN32		// If we're on Win32/Win64
 
 #include <direct.h>
+#include <fcntl.h>
+#include <io.h>
 #define GetCurrentDir _getcwd
 
 #else				// If we're on *nix/Apple Mac OS X
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #define GetCurrentDir getcwd
 
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#endif
+
+// Art file being written, mapped into memory (a buffer written out at the end on Windows)
+typedef struct {
+	uint8_t* data;
+	size_t size;
+#ifdef _WIN32
+	FILE* file;
+#else
+	int fd;
 #endif
+} mappedfile_t;
 
 #ifndef __cplusplus
 typedef enum {false, true} bool;
 #endif
 
-#define MAX_NUMBER_OF_TILES 9216	// Maximum number of tiles
+#include "artkernels.h"
+
 #define MAX_KEY_SIZE 128			// Key size for parsing ini file keys
 #define MAX_VALUE_SIZE 128			// Value size for parsing ini file values
 #define PALETTE_SIZE (256 * 3)		// Palette size (768)
+#define TAR_BLOCK_SIZE 512			// Tar headers and data come in blocks
+#define MAX_TILE_NUMBER 1048575		// far beyond any build game, anything higher is a stray file
+#define SOURCE_NONE 0				// no file, the tile stays 0x0
+#define SOURCE_PNG 1				// tileNNNN.png
+#define SOURCE_RAW 2				// tileNNNN.raw from art2png --raw
+// Raw tiles start with a 16 byte header, all of it little-endian:
+// "BTIL", version 1, order, compression, 0, width (2), height (2), data size (4)
+#define RAW_HEADER_SIZE 16
+#define RAW_ORDER_COLUMNS 0			// column by column like the ART file
+#define RAW_ORDER_ROWS 1			// row by row from the top
+#define RAW_COMPRESSION_NONE 0
+#define RAW_COMPRESSION_RLE 1		// PackBits, see unpackRLE()
+#define POOL_MIN_SHIFT 8			// smallest buffer class, 256 bytes
+#define POOL_CLASSES 16				// up to 8 MB, bigger buffers skip the pool
+#define POOL_HEADER 16				// class number in front of every buffer
+#define DITHER_SIZE 32				// side of the threshold matrix, a power of two
+#define DITHER_SPREAD 32			// color steps the thresholds span
 
 // Global Variables
 
 static uint32_t numtiles = 0;					// Number of tiles
 static uint32_t currfilenum = 0;				// Current .ART index
 static uint32_t tilestartnum = 0;				// current file starting number
-static uint8_t artfilenum = 0;					// Not sure. Redundant?
-static uint8_t maxartfiles = 0;					// Maximum art tile
+static uint32_t artfilenum = 0;					// Not sure. Redundant?
+static uint32_t maxartfiles = 0;				// Maximum art tile
+static bool autoartfiles = false;				// "auto" art file count, taken from the input
+static int32_t lastinputtile = -1;				// highest tileNNNN.png found
+static int32_t lastinputini = -1;				// highest adataNNN.ini found
 static uint32_t tileendnum = 255;				// Current file ending number
-static tile_t TilesList[MAX_NUMBER_OF_TILES];	// list of tiles
+static tiletable_t Tiles;						// list of tiles
+static FILE* tarfile = NULL;					// tar stream to read the pngs from
+static inifile_t* inifiles = NULL;				// ini files found in the tar stream
+static uint32_t numinifiles = 0;
+static bool manifestloaded = false;				// animdata came from --manifest
+
+// Splitting a set across processes or machines: --plan cuts the tiles into
+// shards of about the same pixel count, each --shard run packs one shard
+// into shardNNN.art and --merge puts the art files together from those
+static uint32_t plancount = 0;					// --plan, 0 when not planning
+static int32_t shardnum = -1;					// --shard, -1 when not a shard run
+static bool mergeshards = false;
+
+// Watch mode: after the first build png2art keeps running and rebuilds
+// the art files whose pngs or ini files change, the palette and the
+// decoder threads stay ready in between
+static bool watchinput = false;					// --watch
+static uint32_t watchdelay = 200;				// --debounce, quiet ms before a rebuild
+
+// Dithering (--dither): a threshold from a fixed matrix is added to each
+// pixel before the nearest palette color is taken, so every pixel is done
+// on its own and the rows of a tile go through the SIMD kernel one by one
+static dither_e dithermode = DITHER_NONE;
+static int16_t ditheroffset[DITHER_SIZE * DITHER_SIZE];	// per matrix cell, added to r, g and b
+static uint8_t dithercolors[PALETTE_SIZE];				// the palette as 8-bit RGB triplets
+
+// Pipeline: decoder threads load and decode the PNGs while the main thread
+// writes the finished tiles into the ART file in order
+static uint32_t numdecoders = 0;				// 0 decodes on the main thread
+static uint32_t queuedepth = 64;				// tiles in flight at most
+static jobqueue_t decodequeue;
+static jobqueue_t donequeue;
+static pthread_t* decoders = NULL;
+static tilejob_t** pending = NULL;				// decoded tiles waiting for their turn
+static tilejob_t stopdecoder;					// pushed once per decoder to end it
+static uint32_t tileswritten = 0;				// tiles of the current file in the art file, atomic
+
+// Tile buffers come from power of two size classes and go back to them, so
+// a run reuses a handful of buffers instead of calling malloc for each tile
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static poolbuffer_t* poolfree[POOL_CLASSES];
+static uint64_t memorylimit = 0;				// --max-memory, 0 for no limit
+static uint64_t memoryinflight = 0;				// only touched through __atomic builtins
+
+// Known Build games. All of them use 256 tiles per file, the limits differ.
+static const gameprofile_t gameprofiles[] = {
+	{"duke3d", 256, 6144},
+	{"blood", 256, 6144},
+	{"sw", 256, 6144},
+	{"build", 256, 9216},
+	{"eduke32", 256, 30720}
+};
+static const gameprofile_t* game = &gameprofiles[0];
+static uint32_t tilesperfile = 256;
 
 // Animation types for Adata###.ini parser
 static const char* animtypes[4] = {"none", "oscillation", "forward", "backward"};
 
+// File extension of each tile source
+static const char* sourceext[3] = {"", "png", "raw"};
+
 // Holds palette. Currently unused
 static uint8_t palette[PALETTE_SIZE];
 
@@ -100,19 +282,121 @@ static char outputdir[FILENAME_MAX];
 // Method prototypes
 static bool createArtFile(const char* afname);
 
-static linetype_e extractAnimDataLine(FILE * animdatafile, char* key, char* value);
+static void fillArtHeader(uint8_t* header);
+
+static uint64_t layoutArtFile(void);
+
+static bool readTileSize(uint32_t tilenum, uint32_t* width, uint32_t* height);
+
+static linetype_e extractAnimDataLine(const char** cursor, char* key, char* value);
 
 static void getAnimData(void);
 
+static bool loadManifest(const char* mfname);
+
+static bool parseManifestTile(jsonlexer_t* lx);
+
+static bool skipManifestValue(jsonlexer_t* lx);
+
+static void nextToken(jsonlexer_t* lx);
+
+static bool tokenIs(const jsonlexer_t* lx, const char* name);
+
+static bool manifestError(const jsonlexer_t* lx, const char* message);
+
 static bool LoadPalette(char *pfname);
 
 static uint16_t GetLittleEndianUInt16(const uint8_t* buffer);
 
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer);
+
+static uint32_t GetBigEndianUInt32(const uint8_t* buffer);
+
+static bool GrowTileTable(tiletable_t* table, uint32_t count);
+
 static void SetLittleEndianUInt16(uint16_t integer, uint8_t* buffer);
 
 static void SetLittleEndianUInt32(uint32_t integer, uint8_t* buffer);
 
-static bool parsePNGFile(uint32_t pngi, FILE* afile);
+static bool parsePNGFile(tilejob_t* job);
+
+static bool decodePNG(FIBITMAP* pngastemp, tilejob_t* job);
+
+static FIBITMAP* ditherPNG(FIBITMAP* pngastemp);
+
+static void makeDitherMatrix(void);
+
+static void addDitherPoint(double* energy, const double* weight, uint32_t cell, double sign);
+
+static uint32_t findDitherCell(const double* energy, const bool* set, bool cluster);
+
+static bool parseRawFile(tilejob_t* job);
+
+static bool decodeRaw(const uint8_t* data, uint32_t size, tilejob_t* job);
+
+static bool unpackRLE(const uint8_t* src, uint32_t srclen, uint8_t* dst, uint32_t dstlen);
+
+static uint8_t* getTileBuffer(tilejob_t* job, uint32_t xsize, uint32_t ysize);
+
+static bool readTarStream(void);
+
+static bool scanInputDir(void);
+
+static bool addInputFile(const char* filename);
+
+static uint8_t tileSource(const char* filename, uint32_t* tilenum);
+
+static bool writeShardPlan(const char* planname, uint32_t count);
+
+static bool readShardPlan(const char* planname, uint32_t shard, uint32_t* first, uint32_t* last, uint32_t* count);
+
+static uint8_t* loadShard(uint32_t shard, uint32_t first, uint32_t last, uint8_t** pixels);
+
+static bool mergeShards(const char* planname);
+
+static bool rebuildArtFile(uint32_t filenum);
+
+static bool watchInputDir(void);
+
+static int32_t changedArtFile(const char* filename);
+
+static bool packTiles(FILE* afile);
+
+static bool packTilesMapped(uint8_t* image, bool* mismatch);
+
+static bool MapArtFile(mappedfile_t* mf, const char* path, size_t size);
+
+static bool UnmapArtFile(mappedfile_t* mf);
+
+static void* decoderThread(void* arg);
+
+static bool startPipeline(void);
+
+static void stopPipeline(void);
+
+static bool InitJobQueue(jobqueue_t* q, uint32_t depth);
+
+static tilejob_t* PopJob(jobqueue_t* q);
+
+static void PushJob(jobqueue_t* q, tilejob_t* job);
+
+static tilejob_t* TryPopJob(jobqueue_t* q);
+
+static bool TryPushJob(jobqueue_t* q, tilejob_t* job);
+
+static void WaitForQueue(uint32_t spins);
+
+static uint8_t* PoolAlloc(uint32_t size);
+
+static void PoolFree(uint8_t* buffer);
+
+static void PoolReset(void);
+
+static void ReserveMemory(uint32_t bytes, uint32_t seq);
+
+static void ReleaseMemory(uint32_t bytes);
+
+static uint64_t ParseByteCount(const char* str);
 
 //
 // IMPLEMENTATIONS
@@ -125,66 +409,229 @@ static bool createArtFile(const char* afname)
 {
 	// Variables
 	FILE* artfile;
-	uint8_t buffer[16 + MAX_NUMBER_OF_TILES * (2 + 2 + 4)];
+	uint8_t* buffer;
+	uint64_t filesize;
+	mappedfile_t image;
+	bool mismatch;
 	uint32_t i;
-	uint32_t j;
-	char png[FILENAME_MAX];
+
+	buffer = malloc(16 + numtiles * (2 + 2 + 4));
+	if (buffer == NULL || !GrowTileTable(&Tiles, tilestartnum + numtiles))
+	{
+		printf("error: not enough memory for %u tiles\n", tilestartnum + numtiles);
+		free(buffer);
+		return false;
+	}
+
+	// the manifest filled in the whole set already, and
+	// shards leave the animation data to --merge
+	if (!manifestloaded && shardnum < 0)
+	{
+		memset(&Tiles.animdata[tilestartnum], 0, numtiles * sizeof(uint32_t));
+		getAnimData();
+	}
+
+	// The png headers give the size of every tile up front, so the whole
+	// file is laid out before decoding and the decoders write each tile
+	// straight to its place in any order.
+	filesize = layoutArtFile();
+	if (filesize <= 0xFFFFFFFF && MapArtFile(&image, afname, (size_t)filesize))
+	{
+		fillArtHeader(image.data);
+		if (!packTilesMapped(image.data, &mismatch))
+		{
+			UnmapArtFile(&image);
+			free(buffer);
+			return false;
+		}
+		if (!UnmapArtFile(&image))
+		{
+			printf("error: cannot write %s\n", afname);
+			free(buffer);
+			return false;
+		}
+
+		if (!mismatch)
+		{
+			for (i = tilestartnum; i < tilestartnum + numtiles; i++)
+			{
+				free(Tiles.pngdata[i]);
+				Tiles.pngdata[i] = NULL;
+			}
+			free(buffer);
+			return true;
+		}
+
+		// a png that didn't decode to the size of its header
+		printf("warning: a tile of %s did not decode to the size in its header, writing the file again tile by tile\n", afname);
+	}
 
 	artfile = fopen(afname, "wb");
 	if (artfile == NULL)
 	{
 		printf("error: cannot create %d\n", artfilenum);
+		free(buffer);
 		return false;
 	}
 
-	SetLittleEndianUInt32(1, &buffer[0]);
-	SetLittleEndianUInt32(tilestartnum + numtiles, &buffer[4]);
-	SetLittleEndianUInt32(tilestartnum, &buffer[8]);
-	SetLittleEndianUInt32(tilestartnum + numtiles - 1, &buffer[12]);
-
+	fillArtHeader(buffer);
 	fwrite(buffer, 1, 16 + numtiles * (2 + 2 + 4), artfile);
 
-	for (i = 0; i < numtiles; i++)
+	if (!packTiles(artfile))
 	{
-		parsePNGFile(tilestartnum + i, artfile);
+		fclose(artfile);
+		free(buffer);
+		return false;
 	}
 
-	getAnimData();
-
-	if (fseek(artfile, 16, SEEK_SET) != 0)
+	if (fseek(artfile, 0, SEEK_SET) != 0)
 	{
 		printf("error: can't go to beginning of art file to write it's header\n");
 		fclose(artfile);
+		free(buffer);
 		return false;
 	}
 
+	fillArtHeader(buffer);
+	fwrite(buffer, 1, 16 + numtiles * (2 + 2 + 4), artfile);
+
+	fclose(artfile);
+	free(buffer);
+
+	return true;
+}
+
+// fillArtHeader()
+// Puts the header of the current file, as far as the tile table
+// knows it, into header (16 + numtiles * 8 bytes)
+static void fillArtHeader(uint8_t* header)
+{
+	uint32_t i;
+
+	SetLittleEndianUInt32(1, &header[0]);
+	SetLittleEndianUInt32(tilestartnum + numtiles, &header[4]);
+	SetLittleEndianUInt32(tilestartnum, &header[8]);
+	SetLittleEndianUInt32(tilestartnum + numtiles - 1, &header[12]);
+	header += 16;
+
 	for (i = 0; i < numtiles; i++)
-		SetLittleEndianUInt16(TilesList[tilestartnum + i].sizex, &buffer[i * 2]);
-	fwrite(buffer, 1, numtiles * 2, artfile);
+		SetLittleEndianUInt16(Tiles.sizex[tilestartnum + i], &header[i * 2]);
+	header += numtiles * 2;
 
 	for (i = 0; i < numtiles; i++)
-		SetLittleEndianUInt16(TilesList[tilestartnum + i].sizey, &buffer[i * 2]);
-	fwrite(buffer, 1, numtiles * 2, artfile);
+		SetLittleEndianUInt16(Tiles.sizey[tilestartnum + i], &header[i * 2]);
+	header += numtiles * 2;
 
 	for (i = 0; i < numtiles; i++)
-		SetLittleEndianUInt32(TilesList[tilestartnum + i].animdata, &buffer[i * 4]);
-	fwrite(buffer, 1, numtiles * 4, artfile);
+		SetLittleEndianUInt32(Tiles.animdata[tilestartnum + i], &header[i * 4]);
+}
 
-	fclose(artfile);
+// layoutArtFile()
+// First pass over the tiles of the current file: reads the size of every
+// png from its header and gives each tile its offset. Returns the size
+// of the whole art file.
+static uint64_t layoutArtFile(void)
+{
+	uint64_t offset;
+	uint32_t tilenum, width, height;
+
+	offset = 16 + numtiles * (2 + 2 + 4);
+	for (tilenum = tilestartnum; tilenum < tilestartnum + numtiles; tilenum++)
+	{
+		width = height = 0;
+		if (Tiles.source[tilenum] != SOURCE_NONE && !readTileSize(tilenum, &width, &height))
+			printf("warning: tile%04u.%s is not a valid %s\n", tilenum,
+				sourceext[Tiles.source[tilenum]], Tiles.source[tilenum] == SOURCE_RAW ? "raw tile" : "png");
+
+		if (width > 0xFFFF || height > 0xFFFF)
+		{
+			printf("warning: tile%04u.%s is too big for an art tile (%ux%u)\n", tilenum,
+				sourceext[Tiles.source[tilenum]], width, height);
+			width = height = 0;
+		}
+
+		Tiles.sizex[tilenum] = (uint16_t)width;
+		Tiles.sizey[tilenum] = (uint16_t)height;
+		Tiles.offset[tilenum] = (uint32_t)offset;
+		offset += (uint64_t)width * height;
+	}
+
+	return offset;
+}
+
+// readTileSize()
+// Gets the size of a tile from the IHDR chunk of its png or the header
+// of its raw file without decoding it
+static bool readTileSize(uint32_t tilenum, uint32_t* width, uint32_t* height)
+{
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	char pngfilename[FILENAME_MAX];
+	uint8_t header[24];			// signature, IHDR length and type, width, height
+	const uint8_t* data;
+	FILE* pngfile;
+	size_t got;
 
+	if (Tiles.pngdata[tilenum] != NULL)
+	{
+		got = Tiles.pngsize[tilenum];
+		data = Tiles.pngdata[tilenum];
+	}
+	else if (tarfile != NULL)
+	{
+		return false;
+	}
+	else
+	{
+		sprintf(pngfilename, "%s%stile%04u.%s", inputdir, PATH_DELIMITER, tilenum, sourceext[Tiles.source[tilenum]]);
+		pngfile = fopen(pngfilename, "rb");
+		if (pngfile == NULL)
+			return false;
+		got = fread(header, 1, sizeof(header), pngfile);
+		fclose(pngfile);
+		data = header;
+	}
+
+	if (Tiles.source[tilenum] == SOURCE_RAW)
+	{
+		// a 1x1 raw tile is shorter than a png header
+		if (got < RAW_HEADER_SIZE || memcmp(data, "BTIL", 4) != 0)
+			return false;
+		*width = GetLittleEndianUInt16(&data[8]);
+		*height = GetLittleEndianUInt16(&data[10]);
+		return true;
+	}
+
+	if (got < sizeof(header))
+		return false;
+
+	if (memcmp(data, signature, 8) != 0 || memcmp(&data[12], "IHDR", 4) != 0)
+		return false;
+
+	*width = GetBigEndianUInt32(&data[16]);
+	*height = GetBigEndianUInt32(&data[20]);
 	return true;
 }
 
 // extractAnimDataLine()
 // Extracts a line of data for reading
-static linetype_e extractAnimDataLine(FILE* animdatafile, char* key, char* value)
+static linetype_e extractAnimDataLine(const char** cursor, char* key, char* value)
 {
 	char line[128];
 	char* charptr;
 	uint32_t ki, vi;
 
-	while (fgets(line, sizeof(line), animdatafile) != NULL)
+	while (**cursor != '\0')
 	{
+		// copy one line like fgets() would
+		for (ki = 0; ki < sizeof(line) - 1 && (*cursor)[ki] != '\0'; ki++)
+			if ((line[ki] = (*cursor)[ki]) == '\n')
+			{
+				ki++;
+				break;
+			}
+		line[ki] = '\0';
+		*cursor += ki;
+
 		charptr = line;
 		while (*charptr == ' ')
 			charptr++;
@@ -251,6 +698,9 @@ static linetype_e extractAnimDataLine(FILE* animdatafile, char* key, char* value
 static void getAnimData(void)
 {
 	FILE* adfile;
+	char* adtext = NULL;
+	const char* cursor;
+	long adsize;
 	linetype_e ltype;
 	uint32_t currtilei, tilei1, tilei2;
 	int32_t integer;
@@ -259,17 +709,47 @@ static void getAnimData(void)
 	char* charptr;
 	bool validsel;
 
-	sprintf(curradatafile, "%s%sadata%03u.ini", inputdir, PATH_DELIMITER, artfilenum);
-	adfile = fopen(curradatafile, "rt");
-	if (adfile == NULL)
+	if (tarfile != NULL)
 	{
-		printf("warning: %s not found. No animation data added\n", curradatafile);
-		return;
+		for (integer = 0; integer < (int32_t)numinifiles; integer++)
+			if (inifiles[integer].artfilenum == artfilenum)
+				break;
+		if (integer == (int32_t)numinifiles)
+		{
+			printf("warning: adata%03u.ini not in the tar stream. No animation data added\n", artfilenum);
+			return;
+		}
+		cursor = inifiles[integer].text;
+	}
+	else
+	{
+		sprintf(curradatafile, "%s%sadata%03u.ini", inputdir, PATH_DELIMITER, artfilenum);
+		adfile = fopen(curradatafile, "rb");
+		if (adfile == NULL)
+		{
+			printf("warning: %s not found. No animation data added\n", curradatafile);
+			return;
+		}
+
+		// the whole file is parsed from memory
+		fseek(adfile, 0, SEEK_END);
+		adsize = ftell(adfile);
+		fseek(adfile, 0, SEEK_SET);
+		if (adsize < 0 || (adtext = malloc(adsize + 1)) == NULL)
+		{
+			printf("error: not enough memory to read %s\n", curradatafile);
+			fclose(adfile);
+			return;
+		}
+		adsize = fread(adtext, 1, adsize, adfile);
+		adtext[adsize] = '\0';
+		fclose(adfile);
+		cursor = adtext;
 	}
 	printf("parsing...\n");
 
 	currtilei = tilestartnum;
-	ltype = extractAnimDataLine(adfile, key, value);
+	ltype = extractAnimDataLine(&cursor, key, value);
 	while (ltype != LINE_TYPE_EOF)
 	{
 		switch (ltype)
@@ -286,32 +766,32 @@ static void getAnimData(void)
 					printf("Error: invalid animation type (%s)\n", value);
 					break;
 				}
-				TilesList[currtilei].animdata &= 0xFFFFFF3F;
-				TilesList[currtilei].animdata |= (integer & 0x03) << 6;
+				Tiles.animdata[currtilei] &= 0xFFFFFF3F;
+				Tiles.animdata[currtilei] |= (integer & 0x03) << 6;
 			}
 			else if (strcmp(key, "AnimationSpeed") == 0)
 			{
 				integer = atoi(value);
-				TilesList[currtilei].animdata &= 0xF0FFFFFF;
-				TilesList[currtilei].animdata |= (integer & 0x0F) << 24;
+				Tiles.animdata[currtilei] &= 0xF0FFFFFF;
+				Tiles.animdata[currtilei] |= (integer & 0x0F) << 24;
 			}
 			else if (strcmp(key, "XCenterOffset") == 0)
 			{
 				integer = atoi(value);
-				TilesList[currtilei].animdata &= 0xFFFF00FF;
-				TilesList[currtilei].animdata |= (uint8_t)((int8_t)integer) << 8;
+				Tiles.animdata[currtilei] &= 0xFFFF00FF;
+				Tiles.animdata[currtilei] |= (uint8_t)((int8_t)integer) << 8;
 			}
 			else if (strcmp(key, "YCenterOffset") == 0)
 			{
 				integer = atoi(value);
-				TilesList[currtilei].animdata &= 0xFF00FFFF;
-				TilesList[currtilei].animdata |= (uint8_t)((int8_t)integer) << 16;
+				Tiles.animdata[currtilei] &= 0xFF00FFFF;
+				Tiles.animdata[currtilei] |= (uint8_t)((int8_t)integer) << 16;
 			}
 			else if (strcmp(key, "OtherFlags") == 0)
 			{
 				integer = atoi(value);
-				TilesList[currtilei].animdata &= 0x0FFFFFFF;
-				TilesList[currtilei].animdata |= (uint8_t)integer << 28;
+				Tiles.animdata[currtilei] &= 0x0FFFFFFF;
+				Tiles.animdata[currtilei] |= (uint8_t)integer << 28;
 			}
 			else
 				printf("error: unknown key %s\n", key);
@@ -337,8 +817,8 @@ static void getAnimData(void)
 					else
 					{
 						currtilei = tilei1;
-						TilesList[currtilei].animdata &= 0xFFFFFFC0;
-						TilesList[currtilei].animdata |= (tilei2 - tilei1) & 0x3F;
+						Tiles.animdata[currtilei] &= 0xFFFFFFC0;
+						Tiles.animdata[currtilei] |= (tilei2 - tilei1) & 0x3F;
 						validsel = true;
 					}
 				}
@@ -358,15 +838,16 @@ static void getAnimData(void)
 
 				if (!validsel)
 				{
-					ltype = extractAnimDataLine(adfile, key, value);
+					// skip the keys of the bad section up to the next one
+					ltype = extractAnimDataLine(&cursor, key, value);
 					while (ltype != LINE_TYPE_SECTION)
 					{
-						if (ltype != LINE_TYPE_EOF)
+						if (ltype == LINE_TYPE_EOF)
 						{
-							fclose(adfile);
+							free(adtext);
 							return;
 						}
-						ltype = extractAnimDataLine(adfile, key, value);
+						ltype = extractAnimDataLine(&cursor, key, value);
 					}
 				}
 
@@ -377,102 +858,733 @@ static void getAnimData(void)
 			printf("    Warning: syntax error while parsing line %s\n", key);
 			break;
 			}
-		ltype = extractAnimDataLine(adfile, key, value);
+		ltype = extractAnimDataLine(&cursor, key, value);
 	}
-	fclose(adfile);
+	free(adtext);
 }
 
-static bool LoadPalette(char *pfname)
+// loadManifest()
+// Reads the animation data of the whole set from one JSON file,
+// straight into the tile table
+static bool loadManifest(const char* mfname)
 {
-	// variables
-	FILE* pfile;
-
-	uint32_t i;
-	uint8_t color;
+	FILE* mffile;
+	char* mftext;
+	long mfsize;
+	jsonlexer_t lx;
+	bool ok = false;
+
+	mffile = fopen(mfname, "rb");
+	if (mffile == NULL)
+	{
+		printf("error: cannot open manifest %s\n", mfname);
+		return false;
+	}
 
-	pfile = fopen(pfname, "rb");
-	if (pfile == NULL)
+	fseek(mffile, 0, SEEK_END);
+	mfsize = ftell(mffile);
+	fseek(mffile, 0, SEEK_SET);
+	if (mfsize < 0 || (mftext = malloc(mfsize + 1)) == NULL)
 	{
-		printf("warning: cannot open palette.dat\n");
+		printf("error: not enough memory to read %s\n", mfname);
+		fclose(mffile);
 		return false;
 	}
+	mfsize = fread(mftext, 1, mfsize, mffile);
+	mftext[mfsize] = '\0';
+	fclose(mffile);
 
-	// read palette
-	if (fread(palette, 1, PALETTE_SIZE, pfile) != PALETTE_SIZE)
+	lx.cursor = mftext;
+	lx.line = 1;
+	nextToken(&lx);
+
+	if (lx.type != TOKEN_LBRACE)
 	{
-		printf("warning: cannot read the whole palette from palette.dat file\n");
-		fclose(pfile);
+		manifestError(&lx, "expected { at the start of the manifest");
+		free(mftext);
 		return false;
 	}
+	nextToken(&lx);
 
-	for (i = 0; i < PALETTE_SIZE; i += 3)
+	while (lx.type != TOKEN_RBRACE)
 	{
-		rgbpal[i/3].rgbRed = palette[i] * 4;
-		rgbpal[i/3].rgbGreen = palette[i + 1] * 4;
-		rgbpal[i/3].rgbBlue = palette[i + 2] * 4;
+		if (lx.type != TOKEN_STRING)
+		{
+			manifestError(&lx, "expected a key");
+			break;
+		}
+
+		if (tokenIs(&lx, "tiles"))
+		{
+			nextToken(&lx);
+			if (lx.type != TOKEN_COLON)
+			{
+				manifestError(&lx, "expected : after \"tiles\"");
+				break;
+			}
+			nextToken(&lx);
+			if (lx.type != TOKEN_LBRACKET)
+			{
+				manifestError(&lx, "expected a list of tiles");
+				break;
+			}
+			nextToken(&lx);
+
+			while (lx.type != TOKEN_RBRACKET)
+			{
+				if (!parseManifestTile(&lx))
+					break;
+				if (lx.type == TOKEN_COMMA)
+					nextToken(&lx);
+				else if (lx.type != TOKEN_RBRACKET)
+				{
+					manifestError(&lx, "expected , or ] after a tile");
+					break;
+				}
+			}
+			if (lx.type != TOKEN_RBRACKET)
+				break;
+			nextToken(&lx);
+		}
+		else if (tokenIs(&lx, "version"))
+		{
+			nextToken(&lx);
+			if (lx.type != TOKEN_COLON)
+			{
+				manifestError(&lx, "expected : after \"version\"");
+				break;
+			}
+			nextToken(&lx);
+			if (lx.type != TOKEN_NUMBER || lx.number != 1)
+			{
+				manifestError(&lx, "only version 1 manifests are supported");
+				break;
+			}
+			nextToken(&lx);
+		}
+		else
+		{
+			// unknown keys are left for other tools
+			nextToken(&lx);
+			if (lx.type != TOKEN_COLON)
+			{
+				manifestError(&lx, "expected : after a key");
+				break;
+			}
+			nextToken(&lx);
+			if (!skipManifestValue(&lx))
+				break;
+		}
+
+		if (lx.type == TOKEN_COMMA)
+			nextToken(&lx);
+		else if (lx.type != TOKEN_RBRACE)
+		{
+			manifestError(&lx, "expected , or }");
+			break;
+		}
 	}
-	
-	if (rgbpal[255].rgbRed != 0 && rgbpal[255].rgbGreen != 255 && rgbpal[255].rgbBlue != 255)
+
+	if (lx.type == TOKEN_RBRACE)
 	{
-		rgbpal[255].rgbRed = 0;
-		rgbpal[255].rgbGreen = 247;
-		rgbpal[255].rgbBlue = 247;
+		nextToken(&lx);
+		if (lx.type == TOKEN_EOF)
+			ok = true;
+		else
+			manifestError(&lx, "unexpected data after the manifest");
 	}
-	
-}
 
-// GetLittleEndianUInt16()
-// returns a bitshifted LittleEndian 16-bit int
-static uint16_t GetLittleEndianUInt16(const uint8_t* buffer)
-{
-	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+	free(mftext);
+	manifestloaded = ok;
+	return ok;
 }
 
-// Main method
-int main(int argc, char* argv[])
+// parseManifestTile()
+// Parses one {"tile": n, ...} object into Tiles.animdata
+static bool parseManifestTile(jsonlexer_t* lx)
 {
-	char cwd[FILENAME_MAX];
-	char path[FILENAME_MAX];	// Temp path
-	int8_t tempnum;
+	int32_t tilenum = -1;
+	int32_t frames = 0, type = 0, speed = 0, xoffset = 0, yoffset = 0, flags = 0;
+	int32_t* field;
+	int32_t minimum, maximum;
 
-	FreeImage_Initialise(0);	// We have to initialize FreeImage library before anything else.
-	
-	GetCurrentDir(cwd, sizeof(cwd));
+	if (lx->type != TOKEN_LBRACE)
+		return manifestError(lx, "expected { at the start of a tile");
+	nextToken(lx);
 
-	printf("\n"
-		"png2art by Kraig Culp\n"
-		"based on tga2art by Matthieu Oliver\n\n");
+	while (lx->type != TOKEN_RBRACE)
+	{
+		if (lx->type != TOKEN_STRING)
+			return manifestError(lx, "expected a key");
+
+		field = NULL;
+		minimum = 0;
+		maximum = 0;
+		if (tokenIs(lx, "tile"))
+			field = &tilenum, maximum = MAX_TILE_NUMBER;
+		else if (tokenIs(lx, "frames"))
+			field = &frames, maximum = 0x3F;
+		else if (tokenIs(lx, "speed"))
+			field = &speed, maximum = 0x0F;
+		else if (tokenIs(lx, "xoffset"))
+			field = &xoffset, minimum = -128, maximum = 127;
+		else if (tokenIs(lx, "yoffset"))
+			field = &yoffset, minimum = -128, maximum = 127;
+		else if (tokenIs(lx, "flags"))
+			field = &flags, maximum = 0x0F;
+
+		if (tokenIs(lx, "type"))
+		{
+			nextToken(lx);
+			if (lx->type != TOKEN_COLON)
+				return manifestError(lx, "expected : after a key");
+			nextToken(lx);
+			for (type = 0; type < 4; type++)
+				if (lx->type == TOKEN_STRING && tokenIs(lx, animtypes[type]))
+					break;
+			if (type == 4)
+				return manifestError(lx, "type must be none, oscillation, forward or backward");
+			nextToken(lx);
+		}
+		else if (field != NULL)
+		{
+			nextToken(lx);
+			if (lx->type != TOKEN_COLON)
+				return manifestError(lx, "expected : after a key");
+			nextToken(lx);
+			if (lx->type != TOKEN_NUMBER)
+				return manifestError(lx, "expected an integer");
+			if (lx->number < minimum || lx->number > maximum)
+				return manifestError(lx, "value out of range");
+			*field = lx->number;
+			nextToken(lx);
+		}
+		else
+		{
+			nextToken(lx);
+			if (lx->type != TOKEN_COLON)
+				return manifestError(lx, "expected : after a key");
+			nextToken(lx);
+			if (!skipManifestValue(lx))
+				return false;
+		}
+
+		if (lx->type == TOKEN_COMMA)
+			nextToken(lx);
+		else if (lx->type != TOKEN_RBRACE)
+			return manifestError(lx, "expected , or } in a tile");
+	}
 
-	if (argc != 5)
+	if (tilenum < 0)
+		return manifestError(lx, "tile without a \"tile\" number");
+	if (!GrowTileTable(&Tiles, tilenum + 1))
 	{
-		printf("syntax: png2art ## palette indir outdir\n"
-			"ex: png2art 19 palette.dat pngs newart\n\n");
-		FreeImage_DeInitialise();
-		return EXIT_FAILURE;
+		printf("error: not enough memory for %u tiles\n", tilenum + 1);
+		return false;
 	}
 
-	tilestartnum = 0;
-	tileendnum = 255;
+	Tiles.animdata[tilenum] = (frames & 0x3F) | ((type & 0x03) << 6) |
+		((uint8_t)((int8_t)xoffset) << 8) | ((uint8_t)((int8_t)yoffset) << 16) |
+		((speed & 0x0F) << 24) | ((uint32_t)(flags & 0x0F) << 28);
 
-	tempnum = atoi(argv[1]);
-	
-	// check if it's in range
-	/* if (tempnum < 0)
-		tempnum = 0;
+	nextToken(lx);
+	return true;
+}
+
+// skipManifestValue()
+// Steps over a value of any kind, nested ones included
+static bool skipManifestValue(jsonlexer_t* lx)
+{
+	tokentype_e close;
+
+	switch (lx->type)
+	{
+	case TOKEN_STRING:
+	case TOKEN_NUMBER:
+	case TOKEN_LITERAL:
+		nextToken(lx);
+		return true;
+
+	case TOKEN_LBRACE:
+	case TOKEN_LBRACKET:
+		close = lx->type == TOKEN_LBRACE ? TOKEN_RBRACE : TOKEN_RBRACKET;
+		nextToken(lx);
+		while (lx->type != close)
+		{
+			if (close == TOKEN_RBRACE)
+			{
+				if (lx->type != TOKEN_STRING)
+					return manifestError(lx, "expected a key");
+				nextToken(lx);
+				if (lx->type != TOKEN_COLON)
+					return manifestError(lx, "expected : after a key");
+				nextToken(lx);
+			}
+			if (!skipManifestValue(lx))
+				return false;
+			if (lx->type == TOKEN_COMMA)
+				nextToken(lx);
+			else if (lx->type != close)
+				return manifestError(lx, "expected , or the end of the list");
+		}
+		nextToken(lx);
+		return true;
+
+	default:
+		return manifestError(lx, "expected a value");
+	}
+}
+
+// nextToken()
+// Moves the tokenizer to the next token, counting lines on the way
+static void nextToken(jsonlexer_t* lx)
+{
+	const char* p = lx->cursor;
+	char* end;
+
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+	{
+		if (*p == '\n')
+			lx->line++;
+		p++;
+	}
+
+	lx->text = p;
+	lx->length = 1;
+
+	switch (*p)
+	{
+	case '\0': lx->type = TOKEN_EOF; lx->length = 0; break;
+	case '{': lx->type = TOKEN_LBRACE; p++; break;
+	case '}': lx->type = TOKEN_RBRACE; p++; break;
+	case '[': lx->type = TOKEN_LBRACKET; p++; break;
+	case ']': lx->type = TOKEN_RBRACKET; p++; break;
+	case ':': lx->type = TOKEN_COLON; p++; break;
+	case ',': lx->type = TOKEN_COMMA; p++; break;
+
+	case '"':
+		// escapes are stepped over, keys and types are plain ascii
+		lx->text = ++p;
+		while (*p != '"' && *p != '\0' && *p != '\n')
+			p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+		lx->length = (uint32_t)(p - lx->text);
+		if (*p != '"')
+		{
+			lx->type = TOKEN_ERROR;
+			break;
+		}
+		lx->type = TOKEN_STRING;
+		p++;
+		break;
+
+	default:
+		if (*p == '-' || (*p >= '0' && *p <= '9'))
+		{
+			lx->number = (int32_t)strtol(p, &end, 10);
+			lx->type = (end == p || *end == '.' || *end == 'e' || *end == 'E') ? TOKEN_ERROR : TOKEN_NUMBER;
+			lx->length = (uint32_t)(end - p);
+			p = end;
+		}
+		else if (*p >= 'a' && *p <= 'z')
+		{
+			while (*p >= 'a' && *p <= 'z')
+				p++;
+			lx->length = (uint32_t)(p - lx->text);
+			lx->type = (tokenIs(lx, "true") || tokenIs(lx, "false") || tokenIs(lx, "null")) ?
+				TOKEN_LITERAL : TOKEN_ERROR;
+		}
+		else
+			lx->type = TOKEN_ERROR;
+		break;
+	}
+
+	lx->cursor = p;
+}
+
+// tokenIs()
+// Compares the current token's text with name
+static bool tokenIs(const jsonlexer_t* lx, const char* name)
+{
+	return strlen(name) == lx->length && memcmp(lx->text, name, lx->length) == 0;
+}
+
+// manifestError()
+// Reports a manifest error with its line, always returns false
+static bool manifestError(const jsonlexer_t* lx, const char* message)
+{
+	int len;
+
+	for (len = 0; len < 16 && lx->text[len] > ' '; len++)
+		;
+
+	if (lx->type == TOKEN_ERROR)
+		printf("error: manifest line %u: invalid token \"%.*s\"\n", lx->line, len, lx->text);
+	else
+		printf("error: manifest line %u: %s\n", lx->line, message);
+	return false;
+}
+
+static bool LoadPalette(char *pfname)
+{
+	// variables
+	FILE* pfile;
+
+	uint32_t i;
+	uint8_t color;
+
+	pfile = fopen(pfname, "rb");
+	if (pfile == NULL)
+	{
+		printf("warning: cannot open palette.dat\n");
+		return false;
+	}
+
+	// read palette
+	if (fread(palette, 1, PALETTE_SIZE, pfile) != PALETTE_SIZE)
+	{
+		printf("warning: cannot read the whole palette from palette.dat file\n");
+		fclose(pfile);
+		return false;
+	}
+
+	for (i = 0; i < PALETTE_SIZE; i += 3)
+	{
+		rgbpal[i/3].rgbRed = palette[i] * 4;
+		rgbpal[i/3].rgbGreen = palette[i + 1] * 4;
+		rgbpal[i/3].rgbBlue = palette[i + 2] * 4;
+	}
+	
+	if (rgbpal[255].rgbRed != 0 && rgbpal[255].rgbGreen != 255 && rgbpal[255].rgbBlue != 255)
+	{
+		rgbpal[255].rgbRed = 0;
+		rgbpal[255].rgbGreen = 247;
+		rgbpal[255].rgbBlue = 247;
+	}
+
+	fclose(pfile);
+	return true;
+}
+
+// GetLittleEndianUInt16()
+// returns a bitshifted LittleEndian 16-bit int
+static uint16_t GetLittleEndianUInt16(const uint8_t* buffer)
+{
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+// GetLittleEndianUInt32()
+// Get a uint32_t from a little-endian ordered buffer
+static uint32_t GetLittleEndianUInt32(const uint8_t* buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+// GetBigEndianUInt32()
+// Get a uint32_t from a big-endian ordered buffer, png's byte order
+static uint32_t GetBigEndianUInt32(const uint8_t* buffer)
+{
+	return ((uint32_t)buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+}
+
+// GrowTileTable()
+// Makes room for tile numbers below count, new tiles start out empty.
+// Tile numbers past MAX_TILE_NUMBER are refused.
+static bool GrowTileTable(tiletable_t* table, uint32_t count)
+{
+	uint32_t newcapacity;
+	void* p;
+
+	if (count <= table->capacity)
+		return true;
+	if (count > MAX_TILE_NUMBER + 1)
+		return false;
+
+	newcapacity = table->capacity ? table->capacity : 256;
+	while (newcapacity < count)
+		newcapacity *= 2;
+
+	if ((p = realloc(table->sizex, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	table->sizex = p;
+	if ((p = realloc(table->sizey, newcapacity * sizeof(uint16_t))) == NULL)
+		return false;
+	table->sizey = p;
+	if ((p = realloc(table->animdata, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	table->animdata = p;
+	if ((p = realloc(table->offset, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	table->offset = p;
+	if ((p = realloc(table->pngdata, newcapacity * sizeof(uint8_t*))) == NULL)
+		return false;
+	table->pngdata = p;
+	if ((p = realloc(table->pngsize, newcapacity * sizeof(uint32_t))) == NULL)
+		return false;
+	table->pngsize = p;
+	if ((p = realloc(table->source, newcapacity * sizeof(uint8_t))) == NULL)
+		return false;
+	table->source = p;
+
+	memset(&table->sizex[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint16_t));
+	memset(&table->sizey[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint16_t));
+	memset(&table->animdata[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint32_t));
+	memset(&table->offset[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint32_t));
+	memset(&table->pngdata[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint8_t*));
+	memset(&table->pngsize[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint32_t));
+	memset(&table->source[table->capacity], 0, (newcapacity - table->capacity) * sizeof(uint8_t));
+
+	table->capacity = newcapacity;
+	return true;
+}
+
+// Main method
+int main(int argc, char* argv[])
+{
+	char cwd[FILENAME_MAX];
+	char path[FILENAME_MAX];	// Temp path
+	char planfile[FILENAME_MAX];
+	uint32_t shardcount;
+	char* positional[4];
+	char* tarstr = NULL;
+	char* manifeststr = NULL;
+	char* isastr = NULL;
+	uint32_t npositional = 0;
+	int32_t threads = -1;
+	int32_t tempnum;
+	uint32_t i;
+	int argi;
+
+	FreeImage_Initialise(0);	// We have to initialize FreeImage library before anything else.
+	
+	GetCurrentDir(cwd, sizeof(cwd));
+
+	printf("\n"
+		"png2art by Kraig Culp\n"
+		"based on tga2art by Matthieu Oliver\n\n");
+
+	for (argi = 1; argi < argc; argi++)
+	{
+		if (strcmp(argv[argi], "--game") == 0 && argi + 1 < argc)
+		{
+			argi++;
+			for (i = 0; i < sizeof(gameprofiles) / sizeof(gameprofiles[0]); i++)
+				if (strcmp(gameprofiles[i].name, argv[argi]) == 0)
+					break;
+			if (i == sizeof(gameprofiles) / sizeof(gameprofiles[0]))
+			{
+				printf("error: unknown game %s\n", argv[argi]);
+				npositional = 0;
+				break;
+			}
+			game = &gameprofiles[i];
+			tilesperfile = game->tilesperfile;
+		}
+		else if (strcmp(argv[argi], "--tiles-per-file") == 0 && argi + 1 < argc)
+			tilesperfile = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--in-tar") == 0 && argi + 1 < argc)
+			tarstr = argv[++argi];
+		else if (strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc)
+			threads = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--queue-depth") == 0 && argi + 1 < argc)
+			queuedepth = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--max-memory") == 0 && argi + 1 < argc)
+			memorylimit = ParseByteCount(argv[++argi]);
+		else if (strcmp(argv[argi], "--manifest") == 0 && argi + 1 < argc)
+			manifeststr = argv[++argi];
+		else if (strcmp(argv[argi], "--plan") == 0 && argi + 1 < argc)
+			plancount = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--shard") == 0 && argi + 1 < argc)
+			shardnum = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--merge") == 0)
+			mergeshards = true;
+		else if (strcmp(argv[argi], "--watch") == 0)
+			watchinput = true;
+		else if (strcmp(argv[argi], "--debounce") == 0 && argi + 1 < argc)
+			watchdelay = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--isa") == 0 && argi + 1 < argc)
+			isastr = argv[++argi];
+		else if (strcmp(argv[argi], "--dither") == 0 && argi + 1 < argc)
+		{
+			argi++;
+			if (strcmp(argv[argi], "ordered") == 0)
+				dithermode = DITHER_ORDERED;
+			else if (strcmp(argv[argi], "bluenoise") == 0)
+				dithermode = DITHER_BLUENOISE;
+			else
+			{
+				npositional = 0;
+				break;
+			}
+		}
+		else if (argv[argi][0] != '-' && npositional < 4)
+			positional[npositional++] = argv[argi];
+		else
+		{
+			npositional = 0;
+			break;
+		}
+	}
+
+	if (npositional == 4 && strcmp(positional[0], "auto") == 0)
+		autoartfiles = true;
+
+	// shards read the pngs from a shared folder, not from a stream
+	if (npositional != 4 || tilesperfile == 0 || queuedepth == 0 || atoi(positional[0]) < 0 ||
+		(plancount != 0) + (shardnum >= 0) + mergeshards > 1 ||
+		(tarstr != NULL && (plancount != 0 || shardnum >= 0 || mergeshards)) ||
+		(watchinput && (tarstr != NULL || plancount != 0 || shardnum >= 0 || mergeshards)))
+	{
+		printf("syntax: png2art [options] ##|auto palette indir outdir\n"
+			"ex: png2art 19 palette.dat pngs newart\n"
+			"auto makes as many art files as the pngs in indir need\n"
+			"options:\n"
+			"  --game duke3d|blood|sw|build|eduke32  tile layout of the game (default duke3d)\n"
+			"  --tiles-per-file n                    tiles in each art file (default 256)\n"
+			"  --in-tar file                         read pngs and ini files from a tar instead\n"
+			"                                        of indir (give . as indir), - for stdin\n"
+			"  --threads n                           png decoder threads, 0 for none (default: one per cpu)\n"
+			"  --queue-depth n                       tiles decoded ahead of the art file (default 64)\n"
+			"  --max-memory bytes                    cap for the decoded tiles in flight, K/M/G suffixes work\n"
+			"  --manifest file                       read the animation data of the whole set from a json\n"
+			"                                        manifest instead of the adata ini files\n"
+			"  --plan n                              split the set into n shards for separate runs,\n"
+			"                                        writes shards.ini to outdir\n"
+			"  --shard k                             only pack shard k of the plan into outdir/shardNNN.art\n"
+			"  --merge                               write the art files from the finished shards\n"
+			"  --watch                               keep running and rebuild the art files whose\n"
+			"                                        pngs or ini files change (Linux)\n"
+			"  --debounce ms                         wait for this long without changes before\n"
+			"                                        rebuilding (default 200)\n"
+			"  --isa name                            pixel kernels: scalar, sse2, avx2 or avx512\n"
+			"                                        (default: the best the cpu can run)\n"
+			"  --dither ordered|bluenoise            dither true color pngs with a threshold matrix\n"
+			"                                        instead of quantizing them\n\n");
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (!SelectArtKernels(isastr))
+	{
+		printf("error: --isa %s is unknown or this cpu can't run it\n", isastr);
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	tilestartnum = 0;
+	tileendnum = tilesperfile - 1;
+
+	tempnum = atoi(positional[0]);
+	
+	// check if it's in range
+	/* if (tempnum < 0)
+		tempnum = 0;
 	else if (tempnum > 255)
 		tempnum = 255; */
 	
 	maxartfiles = tempnum;
-	sprintf(palfilestr, "%s%s%s", cwd, PATH_DELIMITER, argv[2]);
-	sprintf(inputdir, "%s%s%s", cwd, PATH_DELIMITER, argv[3]);
-	sprintf(outputdir, "%s%s%s", cwd, PATH_DELIMITER, argv[4]);
-	
+	sprintf(palfilestr, "%s%s%s", cwd, PATH_DELIMITER, positional[1]);
+	sprintf(inputdir, "%s%s%s", cwd, PATH_DELIMITER, positional[2]);
+	sprintf(outputdir, "%s%s%s", cwd, PATH_DELIMITER, positional[3]);
+
 	if (!LoadPalette(palfilestr))
 	{
 		FreeImage_DeInitialise();
 		return EXIT_FAILURE;
 	}
 
+	if (dithermode != DITHER_NONE)
+		makeDitherMatrix();
+
+	if (manifeststr != NULL)
+	{
+		sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, manifeststr);
+		if (!loadManifest(path))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (threads < 0)
+	{
+#ifdef _WIN32
+		char* cpus = getenv("NUMBER_OF_PROCESSORS");
+		threads = cpus != NULL ? atoi(cpus) : 1;
+#else
+		threads = (int32_t)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads < 1)
+			threads = 1;
+	}
+	numdecoders = threads;
+
+	if (!startPipeline())
+	{
+		printf("error: cannot start the decoder threads\n");
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (tarstr != NULL)
+	{
+		if (strcmp(tarstr, "-") == 0)
+		{
+			tarfile = stdin;
+#ifdef _WIN32
+			_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		}
+		else
+		{
+			sprintf(path, "%s%s%s", cwd, PATH_DELIMITER, tarstr);
+			tarfile = fopen(path, "rb");
+		}
+
+		if (tarfile == NULL)
+		{
+			printf("error: cannot open tar stream %s\n", tarstr);
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+
+		if (!readTarStream())
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+	}
+	else if (!scanInputDir())
+	{
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	if (autoartfiles)
+	{
+		if (lastinputtile < 0 && lastinputini < 0)
+		{
+			printf("error: no tile pngs or adata ini files found\n");
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+
+		maxartfiles = lastinputtile >= 0 ? lastinputtile / tilesperfile : 0;
+		if (lastinputini > (int32_t)maxartfiles)
+			maxartfiles = lastinputini;
+		printf("writing %u art files\n", maxartfiles + 1);
+	}
+	else if (lastinputtile >= 0 && (uint32_t)lastinputtile >= (maxartfiles + 1) * tilesperfile)
+	{
+		for (tempnum = 0, i = (maxartfiles + 1) * tilesperfile; i <= (uint32_t)lastinputtile; i++)
+			tempnum += Tiles.source[i] != SOURCE_NONE;
+		printf("warning: %d tiles are past the last art file (tile%04u) and are skipped\n",
+			tempnum, (maxartfiles + 1) * tilesperfile - 1);
+	}
+
+	if ((maxartfiles + 1) * tilesperfile > game->maxtiles)
+		printf("warning: %u tiles is more than %s supports (%u)\n",
+			(maxartfiles + 1) * tilesperfile, game->name, game->maxtiles);
+
 	numtiles = tileendnum - tilestartnum + 1;
 	if (tilestartnum > tileendnum)
 	{
@@ -481,10 +1593,59 @@ int main(int argc, char* argv[])
 		return EXIT_FAILURE;
 	}
 
-	for (artfilenum = 0; artfilenum <= maxartfiles; artfilenum++)
+	sprintf(planfile, "%s%sshards.ini", outputdir, PATH_DELIMITER);
+
+	if (plancount != 0)
+	{
+		// the png headers are enough to weigh the tiles
+		if (!GrowTileTable(&Tiles, (maxartfiles + 1) * tilesperfile))
+		{
+			printf("error: not enough memory for %u tiles\n", (maxartfiles + 1) * tilesperfile);
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+		for (artfilenum = 0; artfilenum <= maxartfiles; artfilenum++)
+		{
+			tilestartnum = artfilenum * tilesperfile;
+			numtiles = tilesperfile;
+			layoutArtFile();
+		}
+
+		stopPipeline();
+		FreeImage_DeInitialise();
+		return writeShardPlan(planfile, (maxartfiles + 1) * tilesperfile) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (shardnum >= 0)
+	{
+		if (!readShardPlan(planfile, shardnum, &tilestartnum, &tileendnum, &shardcount))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+
+		// a shard is packed like an art file of its own tile range
+		numtiles = tileendnum - tilestartnum + 1;
+		sprintf(path, "%s%sshard%03u.art", outputdir, PATH_DELIMITER, shardnum);
+		if (!createArtFile(path))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+		printf("shard %u of %u done\n", shardnum, shardcount);
+	}
+	else if (mergeshards)
 	{
-		tilestartnum = (artfilenum * 256);
-		tileendnum = tilestartnum + 256 - 1;
+		if (!mergeShards(planfile))
+		{
+			FreeImage_DeInitialise();
+			return EXIT_FAILURE;
+		}
+	}
+	else for (artfilenum = 0; artfilenum <= maxartfiles; artfilenum++)
+	{
+		tilestartnum = (artfilenum * tilesperfile);
+		tileendnum = tilestartnum + tilesperfile - 1;
 
 		numtiles = tileendnum - tilestartnum + 1;
 
@@ -496,6 +1657,19 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	// only comes back when watching can't start
+	if (watchinput)
+	{
+		watchInputDir();
+		FreeImage_DeInitialise();
+		return EXIT_FAILURE;
+	}
+
+	stopPipeline();
+
+	if (tarfile != NULL && tarfile != stdin)
+		fclose(tarfile);
+
 	FreeImage_DeInitialise();
 	return EXIT_SUCCESS;
 }
@@ -515,102 +1689,1794 @@ static void SetLittleEndianUInt32(uint32_t integer, uint8_t* buffer)
 }
 
 // parsePNGFile()
-// Takes in a PNG file and plugs the indexes into
-// the proper art format.
-static bool parsePNGFile(uint32_t pngi, FILE* afile)
+// Takes in a PNG file and turns it into the
+// column-major palette indexes of the art format.
+static bool parsePNGFile(tilejob_t* job)
 {
-	FILE* pngfile;
 	char pngfilename[FILENAME_MAX];
-	uint8_t* buffer;
-	uint32_t xsize, ysize;
-	int32_t xi, yi;
-	FIBITMAP *pngas;
-	FIBITMAP *pngaspal;
-	FIBITMAP *pngasbg;
-	FIBITMAP *pngas24;
 	FIBITMAP *pngastemp;
-	uint32_t m;
-	uint32_t n;
-	uint32_t _px;
-	uint32_t* _pbx;
-	
-	pngi;
+	FIMEMORY *pngmem;
 
-	TilesList[pngi].animdata = 0;
-	TilesList[pngi].offset = ftell(afile);
-	TilesList[pngi].sizex = 0;
-	TilesList[pngi].sizey = 0;
+	if (Tiles.source[job->tilenum] == SOURCE_RAW)
+		return parseRawFile(job);
 
-	sprintf(pngfilename, "%s%stile%04u.png", inputdir, PATH_DELIMITER, pngi);
-	
-	pngastemp = FreeImage_Load(FIF_PNG, pngfilename, 0);
+	if (job->pngdata != NULL)
+	{
+		// read from the tar stream earlier
+		pngmem = FreeImage_OpenMemory(job->pngdata, job->pngsize);
+		pngastemp = FreeImage_LoadFromMemory(FIF_PNG, pngmem, 0);
+		FreeImage_CloseMemory(pngmem);
+
+		if (pngastemp == NULL)
+			printf("warning: tile%04u.png is not a valid png\n", job->tilenum);
+	}
+	else if (tarfile != NULL)
+	{
+		return false;
+	}
+	else
+	{
+		sprintf(pngfilename, "%s%stile%04u.png", inputdir, PATH_DELIMITER, job->tilenum);
+		pngastemp = FreeImage_Load(FIF_PNG, pngfilename, 0);
+	}
 
 	if (pngastemp == NULL)
 		return false;
-		
-	pngas = FreeImage_AllocateEx(FreeImage_GetWidth(pngastemp), 
-		FreeImage_GetHeight(pngastemp), 8, &rgbpal[255], 0, rgbpal, 0, 0, 0);
 
-	FreeImage_FlipVertical(pngastemp);
-	
+	return decodePNG(pngastemp, job);
+}
+
+// decodePNG()
+// Turns a loaded PNG into column-major palette indexes,
+// pngastemp is unloaded.
+static bool decodePNG(FIBITMAP* pngastemp, tilejob_t* job)
+{
+	uint8_t* buffer;
+	uint32_t xsize, ysize;
+	FIBITMAP *pngas;
+	FIBITMAP *pngaspal;
+	FIBITMAP *pngasbg;
+
 	if (FreeImage_GetBPP(pngastemp) != 8)
 	{
-		// printf("ssssnaaaaoooo\n");
-		
-		if (FreeImage_GetBPP(pngastemp) == 32)
+		if (dithermode != DITHER_NONE)
+		{
+			pngaspal = ditherPNG(pngastemp);
+		}
+		else if (FreeImage_GetBPP(pngastemp) == 32)
 		{
 			pngasbg = FreeImage_Composite(pngastemp, FALSE, &rgbpal[255], NULL);
-			// pngas24 = FreeImage_ConvertTo24Bits(pngasbg);
-			
-			
-			pngaspal = FreeImage_ColorQuantizeEx(pngasbg, FIQ_NNQUANT, 256, 256, rgbpal);
-			FreeImage_SetTransparentIndex(pngaspal, 255);
+			pngaspal = pngasbg != NULL ?
+				FreeImage_ColorQuantizeEx(pngasbg, FIQ_NNQUANT, 256, 256, rgbpal) : NULL;
+			if (pngasbg != NULL)
+				FreeImage_Unload(pngasbg);
 		}
 		else
 		{
 			pngaspal = FreeImage_ColorQuantizeEx(pngastemp, FIQ_NNQUANT, 256, 256, rgbpal);
-			FreeImage_SetTransparentIndex(pngaspal, 255);
 		}
-		
+		FreeImage_Unload(pngastemp);
+
 		if (pngaspal == NULL)
 		{
-			printf("error: tile%04u.png is an invalid 8/24/32bit image\n", pngi);
+			printf("error: tile%04u.png is an invalid 8/24/32bit image\n", job->tilenum);
 			return false;
-		}	
-			
+		}
+		FreeImage_SetTransparentIndex(pngaspal, 255);
+
 		pngas = pngaspal;
-		
 	}
 	else
 	{
 		pngas = pngastemp;
 	}
-	
+
 	xsize = FreeImage_GetWidth(pngas);
 	ysize = FreeImage_GetHeight(pngas);
 
-	TilesList[pngi].sizex = xsize;
-	TilesList[pngi].sizey = ysize;
+	buffer = getTileBuffer(job, xsize, ysize);
+	if (buffer == NULL)
+	{
+		FreeImage_Unload(pngas);
+		return false;
+	}
+
+	// This is where the magic happens: FreeImage scanlines go bottom up,
+	// ART tiles are stored column by column
+	ArtKernels.Transpose(FreeImage_GetScanLine(pngas, ysize - 1), -(int32_t)FreeImage_GetPitch(pngas),
+		buffer, ysize, ysize, xsize);
 
-	buffer = malloc(xsize * ysize);
-	
+	FreeImage_Unload(pngas);
+
+	job->pixels = buffer;
+	job->sizex = xsize;
+	job->sizey = ysize;
+	return true;
+}
+
+// ditherPNG()
+// Maps a true color image onto the palette through the threshold matrix,
+// pixels less than half opaque get index 255 and no other pixel does.
+// pngastemp is left loaded.
+static FIBITMAP* ditherPNG(FIBITMAP* pngastemp)
+{
+	FIBITMAP* pngas24 = NULL;
+	FIBITMAP* pngas;
+	const uint8_t* src;
+	const int16_t* offsets;
+	uint8_t* dst;
+	uint8_t* rgb;
+	uint32_t xsize, ysize, x, y, bytespp;
+	int32_t value, i;
+
+	if (FreeImage_GetBPP(pngastemp) != 24 && FreeImage_GetBPP(pngastemp) != 32)
+	{
+		pngas24 = FreeImage_ConvertTo24Bits(pngastemp);
+		if (pngas24 == NULL)
+			return NULL;
+		pngastemp = pngas24;
+	}
+
+	bytespp = FreeImage_GetBPP(pngastemp) / 8;
+	xsize = FreeImage_GetWidth(pngastemp);
+	ysize = FreeImage_GetHeight(pngastemp);
+
+	pngas = FreeImage_AllocateEx(xsize, ysize, 8, &rgbpal[255], 0, rgbpal, 0, 0, 0);
+	rgb = malloc(xsize * 3);
+	if (pngas == NULL || rgb == NULL)
+	{
+		if (pngas != NULL)
+			FreeImage_Unload(pngas);
+		if (pngas24 != NULL)
+			FreeImage_Unload(pngas24);
+		free(rgb);
+		return NULL;
+	}
+
+	for (y = 0; y < ysize; y++)
+	{
+		src = FreeImage_GetScanLine(pngastemp, y);
+		dst = FreeImage_GetScanLine(pngas, y);
+
+		// the matrix starts at the top left corner of the tile, scanlines go bottom up
+		offsets = &ditheroffset[((ysize - 1 - y) & (DITHER_SIZE - 1)) * DITHER_SIZE];
+		for (x = 0; x < xsize; x++)
+		{
+			for (i = 0; i < 3; i++)
+			{
+				value = src[x * bytespp + (i == 0 ? FI_RGBA_RED : i == 1 ? FI_RGBA_GREEN : FI_RGBA_BLUE)] +
+					offsets[x & (DITHER_SIZE - 1)];
+				rgb[x * 3 + i] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+			}
+		}
+
+		// a whole row at once, the transparent color is left out
+		ArtKernels.NearestColors(dithercolors, 255, rgb, dst, xsize);
+
+		if (bytespp == 4)
+		{
+			for (x = 0; x < xsize; x++)
+			{
+				if (src[x * 4 + FI_RGBA_ALPHA] < 128)
+					dst[x] = 255;
+			}
+		}
+	}
+
+	free(rgb);
+	if (pngas24 != NULL)
+		FreeImage_Unload(pngas24);
+	return pngas;
+}
+
+// makeDitherMatrix()
+// Ranks the cells of the threshold matrix and turns the ranks into color
+// offsets. Bayer ranks come from the bits of x and y, blue noise ranks from
+// void-and-cluster: points go where the gaussian weighted sum of the points
+// around them is lowest (the largest void) and come out where it is highest
+// (the tightest cluster), so each rank spreads out as evenly as it can.
+static void makeDitherMatrix(void)
+{
+	static double weight[DITHER_SIZE * DITHER_SIZE];
+	static double energy[DITHER_SIZE * DITHER_SIZE];
+	static double initialenergy[DITHER_SIZE * DITHER_SIZE];
+	static bool set[DITHER_SIZE * DITHER_SIZE];
+	static bool initialset[DITHER_SIZE * DITHER_SIZE];
+	uint32_t rank[DITHER_SIZE * DITHER_SIZE];
+	const uint32_t cells = DITHER_SIZE * DITHER_SIZE;
+	uint32_t i, x, y, bit, points, seed, cluster, hole, r;
+	double falloff;
+
+	for (i = 0; i < 256; i++)
+	{
+		dithercolors[i * 3] = rgbpal[i].rgbRed;
+		dithercolors[i * 3 + 1] = rgbpal[i].rgbGreen;
+		dithercolors[i * 3 + 2] = rgbpal[i].rgbBlue;
+	}
+
+	if (dithermode == DITHER_ORDERED)
+	{
+		for (y = 0; y < DITHER_SIZE; y++)
+		{
+			for (x = 0; x < DITHER_SIZE; x++)
+			{
+				// the lowest bits of x and y give the highest bits of the rank
+				for (r = 0, bit = 1; bit < DITHER_SIZE; bit <<= 1)
+					r = (r << 2) | (((x ^ y) & bit) ? 2 : 0) | ((y & bit) ? 1 : 0);
+				rank[y * DITHER_SIZE + x] = r;
+			}
+		}
+	}
+	else
+	{
+		// exp(-d^2 / (2 * 1.5^2)) for the distances on a torus, centered on
+		// the middle cell, from powers of exp(-1 / 4.5) so no libm is needed
+		for (y = 0; y < DITHER_SIZE; y++)
+		{
+			for (x = 0; x < DITHER_SIZE; x++)
+			{
+				int32_t dx = (int32_t)x - DITHER_SIZE / 2, dy = (int32_t)y - DITHER_SIZE / 2;
+
+				falloff = 1.0;
+				for (i = (uint32_t)(dx * dx + dy * dy); i > 0 && falloff > 1e-12; i--)
+					falloff *= 0.80073740291680806;
+				weight[y * DITHER_SIZE + x] = falloff;
+			}
+		}
+
+		// a tenth of the cells set at random to start with, always the same ones
+		memset(set, false, sizeof(set));
+		memset(energy, 0, sizeof(energy));
+		for (points = 0, seed = 1; points < cells / 10; )
+		{
+			seed = seed * 1103515245 + 12345;
+			i = (seed >> 16) & (cells - 1);
+			if (!set[i])
+			{
+				addDitherPoint(energy, weight, i, 1.0);
+				set[i] = true;
+				points++;
+			}
+		}
+
+		// move the tightest cluster into the largest void until it stays put
+		for (i = 0; i < cells; i++)
+		{
+			cluster = findDitherCell(energy, set, true);
+			addDitherPoint(energy, weight, cluster, -1.0);
+			set[cluster] = false;
+			hole = findDitherCell(energy, set, false);
+			addDitherPoint(energy, weight, hole, 1.0);
+			set[hole] = true;
+			if (hole == cluster)
+				break;
+		}
+		memcpy(initialset, set, sizeof(set));
+		memcpy(initialenergy, energy, sizeof(energy));
+
+		// the starting points are ranked by taking them out again...
+		for (r = points; r > 0; r--)
+		{
+			cluster = findDitherCell(energy, set, true);
+			addDitherPoint(energy, weight, cluster, -1.0);
+			set[cluster] = false;
+			rank[cluster] = r - 1;
+		}
+
+		// ...the rest by filling up the voids. Past half the cells the
+		// largest void of the points is the tightest cluster of the holes.
+		memcpy(set, initialset, sizeof(set));
+		memcpy(energy, initialenergy, sizeof(energy));
+		for (r = points; r < cells; r++)
+		{
+			hole = findDitherCell(energy, set, false);
+			addDitherPoint(energy, weight, hole, 1.0);
+			set[hole] = true;
+			rank[hole] = r;
+		}
+	}
+
+	// ranks to offsets centered on 0
+	for (i = 0; i < cells; i++)
+		ditheroffset[i] = (int16_t)((2 * rank[i] + 1) * DITHER_SPREAD / (2 * cells)) - DITHER_SPREAD / 2;
+}
+
+// addDitherPoint()
+// Adds (sign 1) or takes away (sign -1) the weight of a point of the
+// threshold matrix from the energy of every cell
+static void addDitherPoint(double* energy, const double* weight, uint32_t cell, double sign)
+{
+	uint32_t x, y, px = cell % DITHER_SIZE, py = cell / DITHER_SIZE;
+
+	for (y = 0; y < DITHER_SIZE; y++)
+	{
+		for (x = 0; x < DITHER_SIZE; x++)
+		{
+			// the shortest way around the torus
+			energy[y * DITHER_SIZE + x] += sign * weight[
+				((y + DITHER_SIZE + DITHER_SIZE / 2 - py) % DITHER_SIZE) * DITHER_SIZE +
+				(x + DITHER_SIZE + DITHER_SIZE / 2 - px) % DITHER_SIZE];
+		}
+	}
+}
+
+// findDitherCell()
+// The set cell with the highest energy (cluster) or the empty cell with
+// the lowest, the first one on a tie
+static uint32_t findDitherCell(const double* energy, const bool* set, bool cluster)
+{
+	uint32_t i, best = DITHER_SIZE * DITHER_SIZE;
+
+	for (i = 0; i < DITHER_SIZE * DITHER_SIZE; i++)
+	{
+		if (set[i] != cluster)
+			continue;
+		if (best == DITHER_SIZE * DITHER_SIZE ||
+			(cluster ? energy[i] > energy[best] : energy[i] < energy[best]))
+			best = i;
+	}
+
+	return best;
+}
+
+// getTileBuffer()
+// Gives the place for the indexes of a tile: its place in the mapped art
+// file, or a pool buffer counted against --max-memory
+static uint8_t* getTileBuffer(tilejob_t* job, uint32_t xsize, uint32_t ysize)
+{
+	uint8_t* buffer;
+
+	if (job->dest != NULL)
+	{
+		// the place in the mapped file only fits the size from the header
+		if (xsize != job->sizex || ysize != job->sizey)
+			return NULL;
+		return job->dest;
+	}
+
+	job->reserved = xsize * ysize;
+	ReserveMemory(job->reserved, job->seq);
+
+	buffer = PoolAlloc(xsize * ysize);
+
+	if (buffer == NULL)
+	{
+		printf("error: not enough memory to read image\n");
+		ReleaseMemory(job->reserved);
+		job->reserved = 0;
+	}
+
+	return buffer;
+}
+
+// parseRawFile()
+// Loads a tileNNNN.raw written by art2png --raw and turns it into
+// column-major palette indexes.
+static bool parseRawFile(tilejob_t* job)
+{
+	char rawfilename[FILENAME_MAX];
+	uint8_t* data;
+	FILE* rawfile;
+	long size;
+	bool result;
+
+	if (job->pngdata != NULL)
+		return decodeRaw(job->pngdata, job->pngsize, job);	// read from the tar stream earlier
+	else if (tarfile != NULL)
+		return false;
+
+	sprintf(rawfilename, "%s%stile%04u.raw", inputdir, PATH_DELIMITER, job->tilenum);
+	rawfile = fopen(rawfilename, "rb");
+	if (rawfile == NULL)
+		return false;
+
+	fseek(rawfile, 0, SEEK_END);
+	size = ftell(rawfile);
+	fseek(rawfile, 0, SEEK_SET);
+
+	data = size > 0 ? malloc(size) : NULL;
+	if (data == NULL || fread(data, 1, size, rawfile) != (size_t)size)
+	{
+		printf("warning: cannot read %s\n", rawfilename);
+		free(data);
+		fclose(rawfile);
+		return false;
+	}
+	fclose(rawfile);
+
+	result = decodeRaw(data, (uint32_t)size, job);
+	free(data);
+	return result;
+}
+
+// decodeRaw()
+// Checks the header of a raw tile and unpacks its indexes, rows are
+// turned into columns on the way.
+static bool decodeRaw(const uint8_t* data, uint32_t size, tilejob_t* job)
+{
+	uint8_t* buffer;
+	uint8_t* rows = NULL;
+	uint8_t* unpacked;
+	uint32_t xsize, ysize, datasize;
+	bool ok;
+
+	if (size < RAW_HEADER_SIZE || memcmp(data, "BTIL", 4) != 0 || data[4] != 1 ||
+		data[5] > RAW_ORDER_ROWS || data[6] > RAW_COMPRESSION_RLE ||
+		GetLittleEndianUInt16(&data[8]) == 0 || GetLittleEndianUInt16(&data[10]) == 0 ||
+		GetLittleEndianUInt32(&data[12]) > size - RAW_HEADER_SIZE)
+	{
+		printf("warning: tile%04u.raw is not a valid raw tile\n", job->tilenum);
+		return false;
+	}
+
+	xsize = GetLittleEndianUInt16(&data[8]);
+	ysize = GetLittleEndianUInt16(&data[10]);
+	datasize = GetLittleEndianUInt32(&data[12]);
+
+	buffer = getTileBuffer(job, xsize, ysize);
 	if (buffer == NULL)
+		return false;
+
+	unpacked = buffer;
+	if (data[5] == RAW_ORDER_ROWS)
+		unpacked = rows = malloc(xsize * ysize);
+
+	if (unpacked == NULL)
 	{
 		printf("error: not enough memory to read image\n");
+		ok = false;
+	}
+	else
+	{
+		if (data[6] == RAW_COMPRESSION_RLE)
+			ok = unpackRLE(&data[RAW_HEADER_SIZE], datasize, unpacked, xsize * ysize);
+		else if ((ok = datasize == xsize * ysize))
+			memcpy(unpacked, &data[RAW_HEADER_SIZE], datasize);
+
+		if (!ok)
+			printf("warning: tile%04u.raw does not hold %ux%u pixels\n", job->tilenum, xsize, ysize);
+	}
+
+	if (ok && rows != NULL)
+	{
+		ArtKernels.Transpose(rows, xsize, buffer, ysize, ysize, xsize);
+	}
+	free(rows);
+
+	if (!ok)
+	{
+		if (job->dest == NULL)
+		{
+			PoolFree(buffer);
+			ReleaseMemory(job->reserved);
+			job->reserved = 0;
+		}
 		return false;
 	}
 
-	// This is where the magic happens
-	for (xi = 0; xi  < TilesList[pngi].sizex; xi++)
+	job->pixels = buffer;
+	job->sizex = xsize;
+	job->sizey = ysize;
+	return true;
+}
+
+// unpackRLE()
+// Undoes art2png's PackBits: a control byte of 0-127 is followed by
+// that many plus one bytes as they are, 128-255 repeats the next byte
+// 2-129 times. The data has to fill dst exactly.
+static bool unpackRLE(const uint8_t* src, uint32_t srclen, uint8_t* dst, uint32_t dstlen)
+{
+	uint32_t in = 0, out = 0, n;
+
+	while (in < srclen)
 	{
-		for (yi = 0; yi < TilesList[pngi].sizey; yi++)
+		if (src[in] < 128)
+		{
+			n = src[in] + 1;
+			if (in + 1 + n > srclen || out + n > dstlen)
+				return false;
+			memcpy(&dst[out], &src[in + 1], n);
+			in += 1 + n;
+		}
+		else
 		{
-			FreeImage_GetPixelIndex(pngas, xi, yi, &buffer[xi * TilesList[pngi].sizey + yi]);
-			fwrite(&buffer[xi * TilesList[pngi].sizey + yi], 1, 1, afile);
+			n = src[in] - 126;
+			if (in + 1 >= srclen || out + n > dstlen)
+				return false;
+			memset(&dst[out], src[in + 1], n);
+			in += 2;
 		}
+		out += n;
+	}
+
+	return out == dstlen;
+}
+
+// packTiles()
+// Puts the tiles of the current file into afile in order while the
+// decoders work up to queuedepth tiles ahead.
+static bool packTiles(FILE* afile)
+{
+	tilejob_t* job;
+	uint32_t submitted = 0;
+	uint32_t written = 0;
+	uint32_t size, pngi;
+
+	__atomic_store_n(&tileswritten, 0, __ATOMIC_RELEASE);
+
+	while (written < numtiles)
+	{
+		// keep the decoders fed, the depth bounds the tiles in flight.
+		// Without decoders each tile is decoded right before it is written.
+		while (submitted < numtiles && submitted - written < (numdecoders != 0 ? queuedepth : 1))
+		{
+			job = calloc(1, sizeof(tilejob_t));
+			if (job == NULL)
+			{
+				printf("error: not enough memory to read image\n");
+				return false;
+			}
+			job->seq = submitted;
+			job->tilenum = tilestartnum + submitted;
+			if (tarfile != NULL)
+			{
+				job->pngdata = Tiles.pngdata[job->tilenum];
+				job->pngsize = Tiles.pngsize[job->tilenum];
+				Tiles.pngdata[job->tilenum] = NULL;
+			}
+
+			if (Tiles.source[job->tilenum] == SOURCE_NONE)
+				pending[job->seq % queuedepth] = job;	// no png, stays a 0x0 tile
+			else if (numdecoders == 0)
+			{
+				parsePNGFile(job);
+				pending[job->seq % queuedepth] = job;
+			}
+			else
+				PushJob(&decodequeue, job);
+			submitted++;
+		}
+
+		// wait for the next tile in line, keep the ones that finish early
+		while (pending[written % queuedepth] == NULL)
+		{
+			job = PopJob(&donequeue);
+			pending[job->seq % queuedepth] = job;
+		}
+
+		job = pending[written % queuedepth];
+		pending[written % queuedepth] = NULL;
+		written++;
+		__atomic_store_n(&tileswritten, written, __ATOMIC_RELEASE);
+
+		pngi = job->tilenum;
+		Tiles.offset[pngi] = ftell(afile);
+		Tiles.sizex[pngi] = job->sizex;
+		Tiles.sizey[pngi] = job->sizey;
+
+		// the whole tile goes out in one write
+		size = (uint32_t)job->sizex * job->sizey;
+		if (job->pixels != NULL && fwrite(job->pixels, 1, size, afile) != size)
+		{
+			printf("error: cannot write tile%04u.png to the art file\n", pngi);
+			PoolFree(job->pixels);
+			ReleaseMemory(job->reserved);
+			free(job->pngdata);
+			free(job);
+			return false;
+		}
+
+		if (job->pixels != NULL)
+			PoolFree(job->pixels);	// Gotta give memory back explicitly
+		ReleaseMemory(job->reserved);
+		free(job->pngdata);
+		free(job);
+	}
+
+	// buffers kept from this file may be the wrong sizes for the next one
+	PoolReset();
+
+	return true;
+}
+
+// packTilesMapped()
+// Decodes the tiles of the current file straight into their places in
+// the mapped art file, in whatever order the decoders finish them.
+// mismatch is set when a tile doesn't have the size layoutArtFile() read.
+static bool packTilesMapped(uint8_t* image, bool* mismatch)
+{
+	tilejob_t* job;
+	uint32_t next = 0;
+	uint32_t inflight = 0;
+	uint32_t tilenum;
+
+	*mismatch = false;
+
+	while (next < numtiles || inflight > 0)
+	{
+		if (next < numtiles && inflight < queuedepth)
+		{
+			tilenum = tilestartnum + next++;
+			if (Tiles.sizex[tilenum] == 0 || Tiles.sizey[tilenum] == 0)
+				continue;
+
+			job = calloc(1, sizeof(tilejob_t));
+			if (job == NULL)
+			{
+				printf("error: not enough memory to read image\n");
+				return false;
+			}
+			job->seq = next - 1;
+			job->tilenum = tilenum;
+			job->pngdata = Tiles.pngdata[tilenum];	// stays with the table in case of a second try
+			job->pngsize = Tiles.pngsize[tilenum];
+			job->dest = &image[Tiles.offset[tilenum]];
+			job->sizex = Tiles.sizex[tilenum];
+			job->sizey = Tiles.sizey[tilenum];
+
+			if (numdecoders != 0)
+			{
+				PushJob(&decodequeue, job);
+				inflight++;
+				continue;
+			}
+
+			parsePNGFile(job);
+		}
+		else
+		{
+			job = PopJob(&donequeue);
+			inflight--;
+		}
+
+		if (job->pixels != job->dest)
+			*mismatch = true;
+		free(job);
+	}
+
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool MapArtFile(mappedfile_t* mf, const char* path, size_t size)
+{
+	mf->file = fopen(path, "wb");
+	if (mf->file == NULL)
+		return false;
+
+	mf->data = calloc(size, 1);
+	if (mf->data == NULL)
+	{
+		fclose(mf->file);
+		return false;
+	}
+
+	mf->size = size;
+	return true;
+}
+
+static bool UnmapArtFile(mappedfile_t* mf)
+{
+	bool ok;
+
+	ok = fwrite(mf->data, 1, mf->size, mf->file) == mf->size;
+	free(mf->data);
+	return fclose(mf->file) == 0 && ok;
+}
+
+#else
+
+static bool MapArtFile(mappedfile_t* mf, const char* path, size_t size)
+{
+	mf->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (mf->fd < 0)
+		return false;
+
+	// taking the blocks now turns a full disk into an error here
+	// instead of a SIGBUS in the middle of a decoder
+#ifdef __linux__
+	if (posix_fallocate(mf->fd, 0, size) != 0 && ftruncate(mf->fd, size) != 0)
+#else
+	if (ftruncate(mf->fd, size) != 0)
+#endif
+	{
+		close(mf->fd);
+		return false;
+	}
+
+	mf->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mf->fd, 0);
+	if (mf->data == MAP_FAILED)
+	{
+		close(mf->fd);
+		return false;
 	}
-	
-	free(buffer);	// Gotta free memory explicitly
 
+	mf->size = size;
 	return true;
-}
\ No newline at end of file
+}
+
+static bool UnmapArtFile(mappedfile_t* mf)
+{
+	bool ok;
+
+	ok = munmap(mf->data, mf->size) == 0;
+	return close(mf->fd) == 0 && ok;
+}
+
+#endif
+
+// decoderThread()
+// Loads and decodes PNGs until it gets the stop job
+static void* decoderThread(void* arg)
+{
+	tilejob_t* job;
+
+	(void)arg;
+
+	while ((job = PopJob(&decodequeue)) != &stopdecoder)
+	{
+		parsePNGFile(job);
+		PushJob(&donequeue, job);
+	}
+
+	return NULL;
+}
+
+// startPipeline()
+// Starts the decoder threads
+static bool startPipeline(void)
+{
+	uint32_t i;
+
+	pending = calloc(queuedepth, sizeof(tilejob_t*));
+	if (pending == NULL)
+		return false;
+
+	if (numdecoders == 0)
+		return true;
+
+	decoders = malloc(numdecoders * sizeof(pthread_t));
+	if (decoders == NULL ||
+		!InitJobQueue(&decodequeue, queuedepth) || !InitJobQueue(&donequeue, queuedepth))
+		return false;
+
+	for (i = 0; i < numdecoders; i++)
+		if (pthread_create(&decoders[i], NULL, decoderThread, NULL) != 0)
+			return false;
+
+	return true;
+}
+
+// stopPipeline()
+// Ends the decoder threads, all tiles have been written by then
+static void stopPipeline(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < numdecoders; i++)
+		PushJob(&decodequeue, &stopdecoder);
+	for (i = 0; i < numdecoders; i++)
+		pthread_join(decoders[i], NULL);
+}
+
+// InitJobQueue()
+// Sets up an empty queue with room for at least depth jobs
+static bool InitJobQueue(jobqueue_t* q, uint32_t depth)
+{
+	uint32_t i, size;
+
+	// the cell index wraps with a mask, so the size is a power of two
+	for (size = 2; size < depth; size *= 2)
+		;
+
+	q->cells = malloc(size * sizeof(queuecell_t));
+	if (q->cells == NULL)
+		return false;
+
+	for (i = 0; i < size; i++)
+		q->cells[i].sequence = i;
+	q->mask = size - 1;
+	q->enqueuepos = 0;
+	q->dequeuepos = 0;
+
+	return true;
+}
+
+// PopJob()
+// Pops a job, waits while the queue is empty
+static tilejob_t* PopJob(jobqueue_t* q)
+{
+	tilejob_t* job;
+	uint32_t spins;
+
+	for (spins = 0; (job = TryPopJob(q)) == NULL; spins++)
+		WaitForQueue(spins);
+
+	return job;
+}
+
+// PushJob()
+// Pushes a job, waits while the queue is full
+static void PushJob(jobqueue_t* q, tilejob_t* job)
+{
+	uint32_t spins;
+
+	for (spins = 0; !TryPushJob(q, job); spins++)
+		WaitForQueue(spins);
+}
+
+// TryPopJob()
+// Pops a job, NULL if the queue is empty
+static tilejob_t* TryPopJob(jobqueue_t* q)
+{
+	queuecell_t* cell;
+	tilejob_t* job;
+	uint32_t pos, seq;
+
+	pos = __atomic_load_n(&q->dequeuepos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+		if ((int32_t)(seq - (pos + 1)) == 0)
+		{
+			if (__atomic_compare_exchange_n(&q->dequeuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int32_t)(seq - (pos + 1)) < 0)
+			return NULL;	// empty
+		else
+			pos = __atomic_load_n(&q->dequeuepos, __ATOMIC_RELAXED);
+	}
+
+	job = cell->job;
+	// the cell is free again one lap later
+	__atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return job;
+}
+
+// TryPushJob()
+// Pushes a job, false if the queue is full
+static bool TryPushJob(jobqueue_t* q, tilejob_t* job)
+{
+	queuecell_t* cell;
+	uint32_t pos, seq;
+
+	pos = __atomic_load_n(&q->enqueuepos, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+		if ((int32_t)(seq - pos) == 0)
+		{
+			if (__atomic_compare_exchange_n(&q->enqueuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int32_t)(seq - pos) < 0)
+			return false;	// full
+		else
+			pos = __atomic_load_n(&q->enqueuepos, __ATOMIC_RELAXED);
+	}
+
+	cell->job = job;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// WaitForQueue()
+// Backs off a little longer each time a queue was full or empty
+static void WaitForQueue(uint32_t spins)
+{
+	struct timespec ts = {0, 50000};
+
+	// spin a bit, then give the cpu away, then sleep
+	if (spins < 64)
+		return;
+	else if (spins < 1024)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+// PoolAlloc()
+// Gets a buffer of at least size bytes from the pool
+static uint8_t* PoolAlloc(uint32_t size)
+{
+	poolbuffer_t* buffer = NULL;
+	uint8_t* raw;
+	uint32_t sizeclass;
+
+	for (sizeclass = 0; sizeclass < POOL_CLASSES && (1u << (sizeclass + POOL_MIN_SHIFT)) < size; sizeclass++)
+		;
+
+	if (sizeclass < POOL_CLASSES)
+	{
+		pthread_mutex_lock(&poollock);
+		buffer = poolfree[sizeclass];
+		if (buffer != NULL)
+			poolfree[sizeclass] = buffer->next;
+		pthread_mutex_unlock(&poollock);
+		size = 1u << (sizeclass + POOL_MIN_SHIFT);
+	}
+
+	raw = buffer != NULL ? (uint8_t*)buffer : malloc(POOL_HEADER + size);
+	if (raw == NULL)
+		return NULL;
+
+	*(uint32_t*)raw = sizeclass;
+	return raw + POOL_HEADER;
+}
+
+// PoolFree()
+// Gives a PoolAlloc() buffer back to the pool
+static void PoolFree(uint8_t* buffer)
+{
+	uint8_t* raw = buffer - POOL_HEADER;
+	uint32_t sizeclass = *(uint32_t*)raw;
+
+	// too big for a class, nobody is likely to ask for it again
+	if (sizeclass >= POOL_CLASSES)
+	{
+		free(raw);
+		return;
+	}
+
+	pthread_mutex_lock(&poollock);
+	((poolbuffer_t*)raw)->next = poolfree[sizeclass];
+	poolfree[sizeclass] = (poolbuffer_t*)raw;
+	pthread_mutex_unlock(&poollock);
+}
+
+// PoolReset()
+// Frees the buffers the pool keeps for reuse
+static void PoolReset(void)
+{
+	poolbuffer_t* buffer;
+	uint32_t i;
+
+	pthread_mutex_lock(&poollock);
+	for (i = 0; i < POOL_CLASSES; i++)
+	{
+		while ((buffer = poolfree[i]) != NULL)
+		{
+			poolfree[i] = buffer->next;
+			free(buffer);
+		}
+	}
+	pthread_mutex_unlock(&poollock);
+}
+
+// ReserveMemory()
+// Counts bytes against --max-memory, waits while the tiles in flight use
+// too much. The tile the art file waits for always goes through, so a
+// decoder can never hold up the tiles that would free the memory.
+static void ReserveMemory(uint32_t bytes, uint32_t seq)
+{
+	uint64_t inflight;
+	uint32_t spins;
+
+	inflight = __atomic_load_n(&memoryinflight, __ATOMIC_ACQUIRE);
+	for (spins = 0; ; spins++)
+	{
+		if (memorylimit != 0 && inflight != 0 && inflight + bytes > memorylimit &&
+			seq != __atomic_load_n(&tileswritten, __ATOMIC_ACQUIRE))
+		{
+			WaitForQueue(spins);
+			inflight = __atomic_load_n(&memoryinflight, __ATOMIC_ACQUIRE);
+		}
+		else if (__atomic_compare_exchange_n(&memoryinflight, &inflight, inflight + bytes, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+}
+
+// ReleaseMemory()
+// Gives back bytes counted by ReserveMemory()
+static void ReleaseMemory(uint32_t bytes)
+{
+	__atomic_sub_fetch(&memoryinflight, bytes, __ATOMIC_ACQ_REL);
+}
+
+// ParseByteCount()
+// Parses a byte count with an optional K, M or G suffix
+static uint64_t ParseByteCount(const char* str)
+{
+	char* end;
+	uint64_t count;
+
+	count = strtoull(str, &end, 10);
+	switch (*end)
+	{
+	case 'g': case 'G':
+		count *= 1024;
+		// fall through
+	case 'm': case 'M':
+		count *= 1024;
+		// fall through
+	case 'k': case 'K':
+		count *= 1024;
+		break;
+	}
+
+	return count;
+}
+
+// readTarStream()
+// Reads every tileNNNN.png and adataNNN.ini out of the tar stream
+// into memory, the art files are decoded and written from there.
+static bool readTarStream(void)
+{
+	uint8_t header[TAR_BLOCK_SIZE];
+	uint8_t* data;
+	char name[FILENAME_MAX];
+	char* basename;
+	char* linkname;
+	uint32_t size, padding, i;
+	uint32_t tilenum, linknum;
+	uint8_t source;
+	int namelen;
+	inifile_t* newinis;
+
+	printf("reading tar stream...\n");
+
+	for (;;)
+	{
+		if (fread(header, 1, TAR_BLOCK_SIZE, tarfile) != TAR_BLOCK_SIZE)
+		{
+			printf("error: tar stream ends in the middle of a header\n");
+			return false;
+		}
+
+		// an empty block marks the end
+		for (i = 0; i < TAR_BLOCK_SIZE && header[i] == 0; i++)
+			;
+		if (i == TAR_BLOCK_SIZE)
+			break;
+
+		// ustar splits long names into a prefix and a name
+		name[0] = '\0';
+		if (memcmp(&header[257], "ustar", 5) == 0 && header[345] != '\0')
+			sprintf(name, "%.155s/", (const char*)&header[345]);
+		sprintf(name + strlen(name), "%.100s", (const char*)&header[0]);
+		basename = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+
+		size = (uint32_t)strtoul((const char*)&header[124], NULL, 8);
+		padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+		data = malloc(size + padding + 1);
+		if (data == NULL)
+		{
+			printf("error: not enough memory for %s\n", name);
+			return false;
+		}
+		if (fread(data, 1, size + padding, tarfile) != size + padding)
+		{
+			printf("error: tar stream ends in the middle of %s\n", name);
+			free(data);
+			return false;
+		}
+		data[size] = '\0';
+
+		if (header[156] != '0' && header[156] != '\0' && header[156] != '1')
+		{
+			// directories, pax headers and the like
+			free(data);
+			continue;
+		}
+
+		if ((source = tileSource(basename, &tilenum)) != SOURCE_NONE)
+		{
+			if (tilenum > MAX_TILE_NUMBER)
+			{
+				printf("warning: %s is skipped, tile numbers stop at %u, misnamed or stray file?\n",
+					name, MAX_TILE_NUMBER);
+				free(data);
+				continue;
+			}
+			if (!GrowTileTable(&Tiles, tilenum + 1))
+			{
+				printf("error: not enough memory for %u tiles\n", tilenum + 1);
+				free(data);
+				return false;
+			}
+			if (Tiles.source[tilenum] == SOURCE_PNG && source == SOURCE_RAW)
+			{
+				printf("warning: %s is skipped, tile%04u.png is used instead\n", name, tilenum);
+				free(data);
+				continue;
+			}
+			if (Tiles.source[tilenum] == SOURCE_RAW && source == SOURCE_PNG)
+				printf("warning: tile%04u.raw is skipped, %s is used instead\n", tilenum, name);
+			free(Tiles.pngdata[tilenum]);
+			Tiles.pngdata[tilenum] = NULL;
+			Tiles.source[tilenum] = SOURCE_NONE;
+
+			if (header[156] == '1')
+			{
+				// hardlink, the tile repeats one read before
+				header[257] = '\0';
+				linkname = strrchr((char*)&header[157], '/') != NULL ?
+					strrchr((char*)&header[157], '/') + 1 : (char*)&header[157];
+
+				if (tileSource(linkname, &linknum) == SOURCE_NONE ||
+					linknum >= Tiles.capacity || Tiles.pngdata[linknum] == NULL)
+				{
+					printf("warning: %s links to %s which is not in the tar stream\n", name, linkname);
+				}
+				else if ((Tiles.pngdata[tilenum] = malloc(Tiles.pngsize[linknum])) != NULL)
+				{
+					memcpy(Tiles.pngdata[tilenum], Tiles.pngdata[linknum], Tiles.pngsize[linknum]);
+					Tiles.pngsize[tilenum] = Tiles.pngsize[linknum];
+					Tiles.source[tilenum] = Tiles.source[linknum];
+					if ((int32_t)tilenum > lastinputtile)
+						lastinputtile = tilenum;
+				}
+				free(data);
+				continue;
+			}
+
+			// decoded later by the pipeline
+			Tiles.pngdata[tilenum] = data;
+			Tiles.pngsize[tilenum] = size;
+			Tiles.source[tilenum] = source;
+			if ((int32_t)tilenum > lastinputtile)
+				lastinputtile = tilenum;
+		}
+		else if (sscanf(basename, "adata%u.ini%n", &tilenum, &namelen) == 1 && basename[namelen] == '\0' &&
+			header[156] != '1')
+		{
+			newinis = realloc(inifiles, (numinifiles + 1) * sizeof(inifile_t));
+			if (newinis == NULL)
+			{
+				printf("error: not enough memory for %s\n", name);
+				free(data);
+				return false;
+			}
+			inifiles = newinis;
+			inifiles[numinifiles].artfilenum = tilenum;
+			inifiles[numinifiles].text = (char*)data;
+			inifiles[numinifiles].size = size;
+			numinifiles++;
+			if ((int32_t)tilenum > lastinputini)
+				lastinputini = tilenum;
+		}
+		else
+		{
+			printf("warning: skipping %s in the tar stream\n", name);
+			free(data);
+		}
+	}
+
+	return true;
+}
+
+// scanInputDir()
+// Lists inputdir once and marks the tiles that have a png, so only those
+// are opened later instead of trying every tile number of every art file.
+static bool scanInputDir(void)
+{
+#ifdef _WIN32
+	struct _finddata_t found;
+	intptr_t find;
+	char pattern[FILENAME_MAX];
+
+	sprintf(pattern, "%s%s*", inputdir, PATH_DELIMITER);
+	find = _findfirst(pattern, &found);
+	if (find == -1)
+	{
+		printf("error: cannot list %s\n", inputdir);
+		return false;
+	}
+
+	do
+	{
+		if ((found.attrib & _A_SUBDIR) || found.name[0] == '.')
+			continue;
+		if (!addInputFile(found.name))
+		{
+			_findclose(find);
+			return false;
+		}
+	} while (_findnext(find, &found) == 0);
+
+	_findclose(find);
+#else
+	DIR* dir;
+	struct dirent* entry;
+
+	dir = opendir(inputdir);
+	if (dir == NULL)
+	{
+		printf("error: cannot list %s\n", inputdir);
+		return false;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		// ., .. and hidden files
+		if (entry->d_name[0] == '.')
+			continue;
+#ifdef DT_DIR
+		if (entry->d_type == DT_DIR)
+			continue;
+#endif
+		if (!addInputFile(entry->d_name))
+		{
+			closedir(dir);
+			return false;
+		}
+	}
+
+	closedir(dir);
+#endif
+
+	return true;
+}
+
+// addInputFile()
+// Sorts one file of inputdir into the tile table, warns about the ones
+// png2art won't read.
+static bool addInputFile(const char* filename)
+{
+	char lowername[FILENAME_MAX];
+	char expected[32];
+	uint32_t number, i;
+	uint8_t source;
+	int namelen = 0;
+
+	for (i = 0; filename[i] != '\0' && i < sizeof(lowername) - 1; i++)
+		lowername[i] = (filename[i] >= 'A' && filename[i] <= 'Z') ? filename[i] - 'A' + 'a' : filename[i];
+	lowername[i] = '\0';
+
+	if ((source = tileSource(lowername, &number)) != SOURCE_NONE)
+	{
+		if (number > MAX_TILE_NUMBER)
+		{
+			printf("warning: %s is skipped, tile numbers stop at %u, misnamed or stray file?\n",
+				filename, MAX_TILE_NUMBER);
+			return true;
+		}
+
+		sprintf(expected, "tile%04u.%s", number, sourceext[source]);
+#ifdef _WIN32
+		if (strcmp(lowername, expected) != 0)
+#else
+		if (strcmp(filename, expected) != 0)
+#endif
+		{
+			printf("warning: %s is skipped, tile %u has to be called %s\n", filename, number, expected);
+			return true;
+		}
+
+		if (!GrowTileTable(&Tiles, number + 1))
+		{
+			printf("error: not enough memory for %u tiles\n", number + 1);
+			return false;
+		}
+		if (Tiles.source[number] != SOURCE_NONE && Tiles.source[number] != source)
+		{
+			// both are there, whichever comes first in the listing
+			printf("warning: tile%04u.raw is skipped, tile%04u.png is used instead\n", number, number);
+			source = SOURCE_PNG;
+		}
+		Tiles.source[number] = source;
+		if ((int32_t)number > lastinputtile)
+			lastinputtile = number;
+	}
+	else if (sscanf(lowername, "adata%u.ini%n", &number, &namelen) == 1 && lowername[namelen] == '\0')
+	{
+		if ((int32_t)number > lastinputini)
+			lastinputini = number;
+	}
+	else
+		printf("warning: skipping %s, it is not a tile png, raw tile or adata ini\n", filename);
+
+	return true;
+}
+
+// tileSource()
+// Tells whether a file name is tileNNNN.png, tileNNNN.raw or neither
+static uint8_t tileSource(const char* filename, uint32_t* tilenum)
+{
+	int namelen = 0;
+
+	if (sscanf(filename, "tile%u.png%n", tilenum, &namelen) == 1 && namelen > 0 && filename[namelen] == '\0')
+		return SOURCE_PNG;
+
+	namelen = 0;
+	if (sscanf(filename, "tile%u.raw%n", tilenum, &namelen) == 1 && namelen > 0 && filename[namelen] == '\0')
+		return SOURCE_RAW;
+
+	return SOURCE_NONE;
+}
+
+// writeShardPlan()
+// Cuts tiles 0..ntiles-1 into count shards of about the same number of
+// pixels. The cuts only depend on the tile sizes, so every run agrees.
+static bool writeShardPlan(const char* planname, uint32_t ntiles)
+{
+	FILE* planfile;
+	uint64_t total, done;
+	uint32_t shard, first, last, count;
+	bool ok;
+
+	count = plancount;
+	if (count > ntiles)
+	{
+		printf("warning: only %u tiles, planning %u shards\n", ntiles, ntiles);
+		count = ntiles;
+	}
+
+	planfile = fopen(planname, "wt");
+	if (planfile == NULL)
+	{
+		printf("error: cannot create shard plan %s\n", planname);
+		return false;
+	}
+
+	for (total = 0, last = 0; last < ntiles; last++)
+		total += (uint64_t)Tiles.sizex[last] * Tiles.sizey[last];
+
+	fprintf(planfile,
+		"; shard plan written by png2art\n"
+		"; run png2art --shard k for every shard with the same arguments, then --merge\n"
+		"\n"
+		"[shards]\n"
+		"    Count=%u\n"
+		"    Pixels=%" PRIu64 "\n"
+		"\n",
+		count, total);
+
+	first = 0;
+	done = 0;
+	for (shard = 0; shard < count; shard++)
+	{
+		// at least one tile each, and a shard ends once it has its share
+		last = first;
+		done += (uint64_t)Tiles.sizex[first] * Tiles.sizey[first];
+		while (last + 1 < ntiles && ntiles - (last + 1) > count - shard - 1 &&
+			(shard + 1 == count ||
+			done + (uint64_t)Tiles.sizex[last + 1] * Tiles.sizey[last + 1] <= total * (shard + 1) / count))
+		{
+			last++;
+			done += (uint64_t)Tiles.sizex[last] * Tiles.sizey[last];
+		}
+
+		fprintf(planfile,
+			"[shard%u]\n"
+			"    FirstTile=%u\n"
+			"    LastTile=%u\n"
+			"\n",
+			shard, first, last);
+		printf("shard %u: tiles %u-%u\n", shard, first, last);
+		first = last + 1;
+	}
+
+	ok = !ferror(planfile);
+	if (fclose(planfile) != 0 || !ok)
+	{
+		printf("error: cannot write shard plan %s\n", planname);
+		return false;
+	}
+
+	printf("%u shards planned in %s\n", count, planname);
+	return true;
+}
+
+// readShardPlan()
+// Gets the tile range of one shard and the number of shards from a plan
+static bool readShardPlan(const char* planname, uint32_t shard, uint32_t* first, uint32_t* last, uint32_t* count)
+{
+	FILE* planfile;
+	char line[256];
+	uint32_t value;
+	int32_t section = -1;		// shard of the current section, -1 outside of one
+	bool foundfirst = false, foundlast = false;
+
+	planfile = fopen(planname, "rt");
+	if (planfile == NULL)
+	{
+		printf("error: cannot open shard plan %s, run --plan first\n", planname);
+		return false;
+	}
+
+	*count = 0;
+	while (fgets(line, sizeof(line), planfile) != NULL)
+	{
+		if (sscanf(line, " [shard%u]", &value) == 1)
+			section = value;
+		else if (line[strspn(line, " \t")] == '[')
+			section = -1;
+		else if (sscanf(line, " Count=%u", &value) == 1)
+			*count = value;
+		else if (section == (int32_t)shard && sscanf(line, " FirstTile=%u", first) == 1)
+			foundfirst = true;
+		else if (section == (int32_t)shard && sscanf(line, " LastTile=%u", last) == 1)
+			foundlast = true;
+	}
+	fclose(planfile);
+
+	if (*count == 0 || (shard < *count && (!foundfirst || !foundlast || *last < *first)))
+	{
+		printf("error: %s is not a valid shard plan\n", planname);
+		return false;
+	}
+	if (shard >= *count)
+	{
+		printf("error: the plan only has shards 0 to %u\n", *count - 1);
+		return false;
+	}
+
+	return true;
+}
+
+// loadShard()
+// Reads shardNNN.art into memory and points pixels[] at its tiles.
+// Returns the buffer to free once merged, NULL on errors.
+static uint8_t* loadShard(uint32_t shard, uint32_t first, uint32_t last, uint8_t** pixels)
+{
+	FILE* shardfile;
+	uint8_t* data;
+	char path[FILENAME_MAX];
+	uint64_t offset;
+	uint32_t t, i, count;
+	long size;
+
+	sprintf(path, "%s%sshard%03u.art", outputdir, PATH_DELIMITER, shard);
+	shardfile = fopen(path, "rb");
+	if (shardfile == NULL)
+	{
+		printf("error: shard %u is not done yet\n", shard);
+		return NULL;
+	}
+
+	fseek(shardfile, 0, SEEK_END);
+	size = ftell(shardfile);
+	fseek(shardfile, 0, SEEK_SET);
+	data = malloc(size > 0 ? size : 1);
+	if (data == NULL || fread(data, 1, size, shardfile) != (size_t)size)
+	{
+		printf("error: cannot read %s\n", path);
+		fclose(shardfile);
+		free(data);
+		return NULL;
+	}
+	fclose(shardfile);
+
+	// the shard has to be the plan's, with all of its tile data
+	count = last - first + 1;
+	offset = 16 + (uint64_t)count * (2 + 2 + 4);
+	if ((uint64_t)size < offset || GetLittleEndianUInt32(&data[8]) != first ||
+		GetLittleEndianUInt32(&data[12]) != last)
+	{
+		printf("error: %s does not match the plan\n", path);
+		free(data);
+		return NULL;
+	}
+
+	for (t = first; t <= last; t++)
+	{
+		i = t - first;
+		Tiles.sizex[t] = GetLittleEndianUInt16(&data[16 + i * 2]);
+		Tiles.sizey[t] = GetLittleEndianUInt16(&data[16 + count * 2 + i * 2]);
+		pixels[t] = &data[offset];
+		offset += (uint64_t)Tiles.sizex[t] * Tiles.sizey[t];
+	}
+
+	if (offset > (uint64_t)size)
+	{
+		printf("error: %s is truncated\n", path);
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+// mergeShards()
+// Writes the art files of the set from the shardNNN.art files of the
+// plan, then removes the shards and the plan
+static bool mergeShards(const char* planname)
+{
+	FILE* artfile;
+	uint8_t** sharddata;
+	uint8_t** pixels;			// where every tile's pixels are in the shards
+	uint8_t* header;
+	char path[FILENAME_MAX];
+	uint32_t shard, count, first, last, ntiles, t;
+	bool ok;
+
+	if (!readShardPlan(planname, 0, &first, &last, &count))
+		return false;
+
+	ntiles = (maxartfiles + 1) * tilesperfile;
+	sharddata = calloc(count, sizeof(uint8_t*));
+	pixels = calloc(ntiles, sizeof(uint8_t*));
+	header = malloc(16 + tilesperfile * (2 + 2 + 4));
+	ok = sharddata != NULL && pixels != NULL && header != NULL && GrowTileTable(&Tiles, ntiles);
+	if (!ok)
+		printf("error: not enough memory for %u tiles\n", ntiles);
+
+	for (shard = 0; ok && shard < count; shard++)
+	{
+		ok = readShardPlan(planname, shard, &first, &last, &count);
+		if (ok && last >= ntiles)
+		{
+			printf("error: shard %u goes past the last art file\n", shard);
+			ok = false;
+		}
+		if (ok)
+			ok = (sharddata[shard] = loadShard(shard, first, last, pixels)) != NULL;
+	}
+
+	for (artfilenum = 0; ok && artfilenum <= maxartfiles; artfilenum++)
+	{
+		tilestartnum = artfilenum * tilesperfile;
+		numtiles = tilesperfile;
+
+		if (!manifestloaded)
+		{
+			memset(&Tiles.animdata[tilestartnum], 0, numtiles * sizeof(uint32_t));
+			getAnimData();
+		}
+
+		sprintf(path, "%s%sTILES%03u.art", outputdir, PATH_DELIMITER, artfilenum);
+		artfile = fopen(path, "wb");
+		if (artfile == NULL)
+		{
+			printf("error: cannot create %d\n", artfilenum);
+			ok = false;
+			break;
+		}
+
+		fillArtHeader(header);
+		fwrite(header, 1, 16 + numtiles * (2 + 2 + 4), artfile);
+		for (t = tilestartnum; t < tilestartnum + numtiles; t++)
+			if (pixels[t] != NULL)
+				fwrite(pixels[t], 1, (size_t)Tiles.sizex[t] * Tiles.sizey[t], artfile);
+
+		ok = !ferror(artfile);
+		if (fclose(artfile) != 0 || !ok)
+		{
+			printf("error: cannot write %s\n", path);
+			ok = false;
+		}
+	}
+
+	if (ok)
+	{
+		// leave the folder as a single run would
+		for (shard = 0; shard < count; shard++)
+		{
+			sprintf(path, "%s%sshard%03u.art", outputdir, PATH_DELIMITER, shard);
+			remove(path);
+		}
+		remove(planname);
+		printf("%u shards merged into %u art files\n", count, maxartfiles + 1);
+	}
+
+	for (shard = 0; sharddata != NULL && shard < count; shard++)
+		free(sharddata[shard]);
+	free(sharddata);
+	free(pixels);
+	free(header);
+	return ok;
+}
+
+// rebuildArtFile()
+// Writes art file filenum again next to the old one and renames it
+// over it, anything reading the file never sees half of it
+static bool rebuildArtFile(uint32_t filenum)
+{
+	char path[FILENAME_MAX];
+	char temppath[FILENAME_MAX];
+
+	artfilenum = filenum;
+	tilestartnum = filenum * tilesperfile;
+	tileendnum = tilestartnum + tilesperfile - 1;
+	numtiles = tilesperfile;
+
+	sprintf(path, "%s%sTILES%03u.art", outputdir, PATH_DELIMITER, filenum);
+	sprintf(temppath, "%s.tmp", path);
+	if (!createArtFile(temppath))
+	{
+		remove(temppath);
+		return false;
+	}
+
+#ifdef _WIN32
+	remove(path);
+#endif
+	if (rename(temppath, path) != 0)
+	{
+		printf("error: cannot replace %s\n", path);
+		remove(temppath);
+		return false;
+	}
+
+	return true;
+}
+
+#ifdef __linux__
+
+// watchInputDir()
+// Waits for changes to inputdir and rebuilds the art files they belong
+// to once no more changes came for watchdelay ms. Only returns on errors.
+static bool watchInputDir(void)
+{
+	uint64_t events[4096 / sizeof(uint64_t)];		// aligned for struct inotify_event
+	const struct inotify_event* event;
+	struct pollfd pfd;
+	struct timespec start, end;
+	uint8_t* dirty;
+	uint8_t* newdirty;
+	uint32_t i, pos;
+	int32_t filenum;
+	ssize_t len;
+	int fd, ready;
+	bool waiting = false;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, inputdir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+	{
+		printf("error: cannot watch %s\n", inputdir);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	dirty = calloc(maxartfiles + 1, 1);
+	if (dirty == NULL)
+	{
+		printf("error: not enough memory to watch %s\n", inputdir);
+		close(fd);
+		return false;
+	}
+
+	printf("watching %s for changes, Ctrl+C to stop\n", inputdir);
+	fflush(stdout);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (;;)
+	{
+		// a burst of saves ends when nothing came for watchdelay ms
+		ready = poll(&pfd, 1, waiting ? (int)watchdelay : -1);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready < 0)
+		{
+			printf("error: cannot watch %s\n", inputdir);
+			break;
+		}
+
+		if (ready == 0)
+		{
+			for (i = 0; i <= maxartfiles; i++)
+			{
+				if (!dirty[i])
+					continue;
+				dirty[i] = 0;
+
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (rebuildArtFile(i))
+				{
+					clock_gettime(CLOCK_MONOTONIC, &end);
+					printf("rebuilt TILES%03u.art in %.0f ms\n", i,
+						(end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+				}
+			}
+			fflush(stdout);
+			waiting = false;
+			continue;
+		}
+
+		len = read(fd, events, sizeof(events));
+		if (len <= 0)
+			continue;
+
+		for (pos = 0; pos < (uint32_t)len; pos += sizeof(struct inotify_event) + event->len)
+		{
+			event = (const struct inotify_event*)((const uint8_t*)events + pos);
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				// changes got lost, look at everything again
+				memset(Tiles.source, SOURCE_NONE, Tiles.capacity);
+				scanInputDir();
+				memset(dirty, 1, maxartfiles + 1);
+				waiting = true;
+				continue;
+			}
+
+			if (event->len == 0 || (filenum = changedArtFile(event->name)) < 0)
+				continue;
+
+			if ((uint32_t)filenum > maxartfiles)
+			{
+				if (!autoartfiles)
+				{
+					printf("warning: %s is past the last art file and is skipped\n", event->name);
+					continue;
+				}
+
+				// auto grows the set, the art files in between are new as well
+				newdirty = realloc(dirty, filenum + 1);
+				if (newdirty == NULL)
+				{
+					printf("error: not enough memory for %u art files\n", filenum + 1);
+					continue;
+				}
+				dirty = newdirty;
+				memset(&dirty[maxartfiles + 1], 1, filenum - maxartfiles);
+				maxartfiles = filenum;
+			}
+
+			dirty[filenum] = 1;
+			waiting = true;
+		}
+	}
+
+	free(dirty);
+	close(fd);
+	return false;
+}
+
+// changedArtFile()
+// Updates the tile table for a file of inputdir that changed, returns
+// the number of the art file it belongs to or -1 if it isn't an input
+static int32_t changedArtFile(const char* filename)
+{
+	char path[FILENAME_MAX];
+	char expected[32];
+	uint32_t number;
+	uint8_t source;
+	FILE* file;
+	int namelen = 0;
+
+	// editors' swap and backup files
+	if (filename[0] == '.')
+		return -1;
+
+	if ((source = tileSource(filename, &number)) != SOURCE_NONE)
+	{
+		sprintf(expected, "tile%04u.%s", number, sourceext[source]);
+		if (number > MAX_TILE_NUMBER || strcmp(filename, expected) != 0 || !GrowTileTable(&Tiles, number + 1))
+			return -1;
+
+		// saved, replaced or deleted: the png wins if it is (still) there
+		Tiles.source[number] = SOURCE_NONE;
+		for (source = SOURCE_PNG; source <= SOURCE_RAW && Tiles.source[number] == SOURCE_NONE; source++)
+		{
+			sprintf(path, "%s%stile%04u.%s", inputdir, PATH_DELIMITER, number, sourceext[source]);
+			if ((file = fopen(path, "rb")) != NULL)
+			{
+				Tiles.source[number] = source;
+				fclose(file);
+			}
+		}
+
+		return (int32_t)(number / tilesperfile);
+	}
+
+	if (sscanf(filename, "adata%u.ini%n", &number, &namelen) == 1 && filename[namelen] == '\0')
+		return (int32_t)number;
+
+	return -1;
+}
+
+#else
+
+// watchInputDir()
+// Without inotify there is nothing to wait on
+static bool watchInputDir(void)
+{
+	printf("error: --watch needs inotify, it only works on Linux\n");
+	return false;
+}
+
+#endif